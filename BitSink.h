@@ -8,8 +8,11 @@
 #ifndef BITSINK_H_
 #define BITSINK_H_
 
+#include "utils.h"
+
 #include "stdint.h"
 
+#include <cassert>
 #include <memory>
 #include <vector>
 
@@ -17,29 +20,82 @@ namespace qs {
 
 class ByteSink;
 
+/*
+ * BitSink
+ *
+ * Packs variable length codes (msb first) into bytes that are passed on to a ByteSink.
+ * BYTEWISE mode moves bits out of the accumulator one byte at a time. WORDWISE mode stores
+ * the whole 64 bit accumulator into byteBuf with one unaligned (big endian) store, and advances
+ * by the number of complete bytes. Both modes produce exactly the same byte stream.
+ */
 class BitSink
 {
 public:
-	BitSink(std::shared_ptr<ByteSink> byteSink);
+	enum Mode { BYTEWISE, WORDWISE };
+
+	BitSink(std::shared_ptr<ByteSink> byteSink, Mode mode = WORDWISE);
 	~BitSink();
 
-	void receive(uint32_t code, int size);
+	// Maximum code size for receive: queuedBits <= 7 after each receive, so 7 + 57 bits fit in bitBuf
+	static const int MAX_CODE_SIZE = 57;
+	inline void receive(uint64_t code, int size); // inline so coders can inline it into their loops
 	void flush();
 	void close();
 
+	class BlockWriter;
+
 private:
     void emitByte(uint8_t c);
 
 private:
     std::shared_ptr<ByteSink> out;
-    uint32_t bitBuf;
+    Mode mode;
+    uint64_t bitBuf;
     int queuedBits;
 	static const int BITSTREAM_BYTE_BUFFER_SIZE=1024;
-    uint8_t byteBuf[BITSTREAM_BYTE_BUFFER_SIZE];
+    uint8_t byteBuf[BITSTREAM_BYTE_BUFFER_SIZE + 8]; // + 8 so a whole word can be stored at the end
     int queuedBytes;
     unsigned int byteTally;
 };
 
+/*
+ * BlockWriter
+ *
+ * Receives the codes of a block for a BitSink with the BitSink's state (bitBuf, queuedBits and
+ * queuedBytes) copied into its own members, so a coding loop with a local BlockWriter keeps the
+ * state in registers instead of loading and storing it for each code. Codes are only merged into
+ * bitBuf, which is stored (as in WORDWISE mode, whatever the BitSink's mode) when the next code
+ * doesn't fit, so most codes cost a subtract, a shift and an or. Unlike BitSink::receive, code
+ * mustn't have bits set above its size bits. The state is copied back when the BlockWriter is
+ * destroyed, and the BitSink mustn't be used until then.
+ */
+class BitSink::BlockWriter
+{
+public:
+	explicit BlockWriter(BitSink& bitSink)
+		: bitSink(bitSink),
+		  bitBuf(bitSink.bitBuf),
+		  freeBits(64 - bitSink.queuedBits),
+		  queuedBytes(bitSink.queuedBytes) {}
+	~BlockWriter() {
+		storeBytes();
+		bitSink.bitBuf = bitBuf;
+		bitSink.queuedBits = 64 - freeBits;
+		bitSink.queuedBytes = queuedBytes;
+	}
+
+	inline void receive(uint64_t code, int size);
+
+private:
+	inline void storeBytes();
+
+private:
+	BitSink& bitSink;
+	uint64_t bitBuf;
+	int freeBits; // 64 - the number of queued bits in bitBuf
+	int queuedBytes;
+};
+
 class ByteSink
 {
 public:
@@ -61,6 +117,71 @@ private:
 	std::vector<uint8_t> buf;
 };
 
+/*
+ * queuedBits queued bits are stored in the msb's of bitBuf. So the first bit received is
+ * stored in bit 63, the second bit in bit 62 etc. When there are at least 8 queuedBits in bitBuf,
+ * the msbyte of bitBuf is output (to byteBuf). Thus the first bit received becomes the msb of the
+ * (first) byte in byteBuf, the second bit the next msb of this byte and so on.
+ *
+ * In WORDWISE mode all 8 bytes of bitBuf are stored at byteBuf[queuedBytes], but queuedBytes only
+ * advances over the complete bytes. The partial byte (and the garbage after it) is overwritten by
+ * the next store.
+ */
+inline void BitSink::receive(uint64_t code, int size)
+{
+	assert(size > 0 && size <= MAX_CODE_SIZE);
+
+	code &= (((uint64_t) 1) << size) - 1; // mask off any extra bits in code
+	int putBits = queuedBits + size;     // queuedBits <= 7, so putBits <= 64 if size <= 57
+	code <<= 64 - putBits; // align incoming bits
+	code |= bitBuf; // and merge with old put buffer contents
+	if (mode == WORDWISE) {
+		storeBigEndian64(byteBuf + queuedBytes, code);
+		int numBytes = putBits >> 3;
+		queuedBytes += numBytes;
+		// Two shifts as a shift of 64 (numBytes = 8) is undefined
+		code = (code << (numBytes << 2)) << (numBytes << 2);
+		putBits &= 0x07;
+		if (queuedBytes >= BITSTREAM_BYTE_BUFFER_SIZE)
+			flush();
+	}
+	else {
+		while (putBits >= 8) {
+			uint8_t c = (uint8_t) (code >> 56);
+			emitByte(c);
+			code <<= 8;
+			putBits -= 8;
+		}
+	}
+	bitBuf = code; /* update state variables */
+	queuedBits = putBits;
+}
+
+inline void BitSink::BlockWriter::receive(uint64_t code, int size)
+{
+	assert(size > 0 && size <= MAX_CODE_SIZE && (code >> size) == 0);
+
+	if (size > freeBits)
+		storeBytes(); // Leaves at least 57 free bits
+	freeBits -= size;
+	bitBuf |= code << freeBits;
+}
+
+// Stores the complete bytes of bitBuf, as BitSink::receive in WORDWISE mode
+inline void BitSink::BlockWriter::storeBytes()
+{
+	storeBigEndian64(bitSink.byteBuf + queuedBytes, bitBuf);
+	int numBytes = (64 - freeBits) >> 3;
+	queuedBytes += numBytes;
+	bitBuf = (bitBuf << (numBytes << 2)) << (numBytes << 2);
+	freeBits += numBytes << 3;
+	if (queuedBytes >= BITSTREAM_BYTE_BUFFER_SIZE) {
+		bitSink.queuedBytes = queuedBytes;
+		bitSink.flush();
+		queuedBytes = 0;
+	}
+}
+
 }
 
 #endif /* BITSINK_H_ */
@@ -8,11 +8,17 @@
 #include "BitSink.h"
 #include "Coders.h"
 #include "HuffmanCoder.h"
+#include "LutRegistry.h"
+#include "RangeCoder.h"
+#include "Rans.h"
+#include "utils.h"
 
 #include <limits.h>
 #include <math.h>
 
+#include <algorithm>
 #include <memory>
+#include <stdexcept>
 #include <vector>
 
 using std::shared_ptr;
@@ -34,14 +40,30 @@ namespace qs {
  *
  *  Or do we just use a generic IntCoder as below?
  */
-static void predictiveCode(const double* data, int len, double qf, IntPredictor& predictor,
+// Calls the predictiveCode instantiation for predictor's concrete type
+template <class Coder>
+static void predictiveCodeAs(const double* data, int len, double qf, IntPredictor& predictor,
+		Coder& coder, BitSink& bitSink)
+{
+	if (SecondOrderPredictor* p = dynamic_cast<SecondOrderPredictor*>(&predictor))
+		predictiveCode(data, len, qf, *p, coder, bitSink);
+	else if (FirstOrderPredictor* p = dynamic_cast<FirstOrderPredictor*>(&predictor))
+		predictiveCode(data, len, qf, *p, coder, bitSink);
+	else if (ZeroOrderPredictor* p = dynamic_cast<ZeroOrderPredictor*>(&predictor))
+		predictiveCode(data, len, qf, *p, coder, bitSink);
+	else if (ThirdOrderPredictor* p = dynamic_cast<ThirdOrderPredictor*>(&predictor))
+		predictiveCode(data, len, qf, *p, coder, bitSink);
+	else
+		predictiveCode<IntPredictor, Coder>(data, len, qf, predictor, coder, bitSink);
+}
+
+void predictiveCode(const double* data, int len, double qf, IntPredictor& predictor,
 		IntCoder& coder, BitSink& bitSink)
 {
-    for (int n = 0; n < len; ++n) {
-        int x = lround(data[n] * qf);
-        coder.code(bitSink, x - predictor.predict());
-        predictor.update(x);
-    }
+	if (SizeIntCoder* c = dynamic_cast<SizeIntCoder*>(&coder))
+		predictiveCodeAs(data, len, qf, predictor, *c, bitSink);
+	else
+		predictiveCodeAs(data, len, qf, predictor, coder, bitSink);
 }
 
 DoublesCoder::DoublesCoder(double qStep, std::shared_ptr<IntPredictor> predictor,
@@ -58,57 +80,90 @@ void DoublesCoder::code(const double* data, int len)
     predictiveCode(data, len, qf, *predictor, *coder, *bitSink);
 }
 
-namespace {
-
-class ZeroOrderPredictor : public IntPredictor
+IntPredictor* getIntPredictor(int order, int initial1, int initial2, int initial3)
 {
-public:
-	ZeroOrderPredictor(int initialVal) : initialVal(initialVal) {}
-
-	virtual int predict() { return initialVal; }
-	virtual void update(int) { }
+	if (order == 0)
+		return new ZeroOrderPredictor(initial1);
+	if (order == 1)
+		return new FirstOrderPredictor(initial1);
+	else if (order == 2)
+		return new SecondOrderPredictor(initial1, initial2);
+	else if (order == 3)
+		return new ThirdOrderPredictor(initial1, initial2, initial3);
+	else
+		throw std::logic_error("Predictor order must be 0, 1, 2 or 3");
+}
 
-private:
-	int initialVal;
-};
+const int SelectablePredictor::MAX_ORDER;
+const int SelectablePredictor::ORDER_BITS;
 
-class FirstOrderPredictor : public IntPredictor
+SelectablePredictor::SelectablePredictor(int order)
+	: order(0),
+	  prev1(0),
+	  prev2(0),
+	  prev3(0)
 {
-public:
-	FirstOrderPredictor(int initialVal) : prev(initialVal) {}
-
-	virtual int predict() { return prev; }
-	virtual void update(int val) { prev = val; }
-
-private:
-	int prev;
-};
+	setOrder(order);
+}
 
-class SecondOrderPredictor : public IntPredictor
+void SelectablePredictor::setOrder(int order)
 {
-public:
-	SecondOrderPredictor(int prev1, int prev2) : prev1(prev1), prev2(prev2) {}
-
-	virtual int predict() { return 2*prev1 - prev2; }
-	virtual void update(int val) { prev2 = prev1; prev1 = val; }
+	if (order < 0 || order > MAX_ORDER)
+		throw std::logic_error("SelectablePredictor: order must be 0 to 3");
+	this->order = order;
+}
 
-private:
-	int prev1;
-	int prev2;
-};
+// Quantizes with the kernel (order 0 from 0 gives the values themselves), then sums the residual
+// magnitudes of every order (cheaper than summing sizes, and vectorizable)
+int SelectablePredictor::selectOrder(const double* data, int len, double qf) const
+{
+	uint64_t sums[MAX_ORDER + 1] = {0};
+	uint32_t p1 = prev1, p2 = prev2, p3 = prev3;
+	int xs[PREDICTIVE_CODE_BLOCK_SIZE];
+	for (int start = 0; start < len; start += PREDICTIVE_CODE_BLOCK_SIZE) {
+		int blockLen = std::min(len - start, PREDICTIVE_CODE_BLOCK_SIZE);
+		int zero = 0, unused = 0;
+		quantizeResiduals(data + start, blockLen, qf, 0, zero, unused, xs, NULL, NULL);
+		for (int n = 0; n < blockLen; ++n) {
+			uint32_t x = xs[n];
+			uint32_t rs[MAX_ORDER + 1] = {x, x - p1, x - (2*p1 - p2), x - (3*(p1 - p2) + p3)};
+			for (int o = 0; o <= MAX_ORDER; ++o)
+				sums[o] += (int)rs[o] < 0 ? -rs[o] : rs[o];
+			p3 = p2;
+			p2 = p1;
+			p1 = x;
+		}
+	}
+	return (int)(std::min_element(sums, sums + MAX_ORDER + 1) - sums);
+}
 
-}  // anonymous namespace
+void SelectablePredictor::quantizeBlock(const double* data, int len, double qf, int* residuals,
+		uint8_t* sizes, uint32_t* amps)
+{
+	if (order == MAX_ORDER || len < 3) {
+		IntPredictor::quantizeBlock(data, len, qf, residuals, sizes, amps);
+		return;
+	}
+	int p1 = order ? prev1 : 0, p2 = prev2;
+	quantizeResiduals(data, len, qf, order, p1, p2, residuals, sizes, amps);
+	// The kernel keeps two values
+	prev3 = lroundFast(data[len - 3] * qf);
+	prev2 = lroundFast(data[len - 2] * qf);
+	prev1 = lroundFast(data[len - 1] * qf);
+}
 
-IntPredictor* getIntPredictor(int order, int initial1, int initial2)
+void SelectablePredictor::reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+		double* vals)
 {
-	if (order == 0)
-		return new ZeroOrderPredictor(initial1);
-	if (order == 1)
-		return new FirstOrderPredictor(initial1);
-	else if (order == 2)
-		return new SecondOrderPredictor(initial1, initial2);
-	else
-		throw std::logic_error("Predictor order must be 0, 1 or 2");
+	if (order == MAX_ORDER || len < 3) {
+		IntPredictor::reconstructBlock(residuals, len, qStep, xs, vals);
+		return;
+	}
+	int p1 = order ? prev1 : 0, p2 = prev2;
+	reconstructResiduals(residuals, len, qStep, order, p1, p2, xs, vals);
+	prev3 = xs[len - 3];
+	prev2 = xs[len - 2];
+	prev1 = xs[len - 1];
 }
 
 struct SizeAmp {
@@ -125,12 +180,7 @@ SizeAmp getSizeAmp(int val)
         val = -val;
         temp--; // assumes two's complement machine
     }
-    int nbits = 0;
-    while (val) {
-      nbits++;
-      val >>= 1;
-    }
-    return SizeAmp{nbits, temp};
+    return SizeAmp{bitLength(val), temp};
 }
 
 
@@ -147,49 +197,577 @@ SizeAmp getSizeAmp(int val)
  *
  *
  ******************************************************************************/
-#define UNUSED(x) (void)(x)
-class SizeIntCoder : public IntCoder
+SizeCoderLuts::SizeCoderLuts(const HuffmanTable& table, int fusedRange, bool deferFusedLut)
+	: huffCoder(table),
+	  fusedRange(fusedRange),
+	  numFusedEntries(0)
 {
-    public:
-        SizeIntCoder(std::shared_ptr<HuffmanCoder> huffCoder);
-        virtual ~SizeIntCoder();
+	if (fusedRange < 0 || fusedRange > MAX_FUSED_RANGE)
+		throw std::logic_error("SizeCoderLuts: fusedRange out of range");
+	fusedLut.reserve(2*fusedRange + 1);
+	if (!deferFusedLut)
+		generateFusedLut(2*fusedRange + 1);
+}
 
-    	virtual void code(BitSink& bitSink, int val);
-        virtual const std::vector<int>& getCounts() const { return counts; }
-        virtual void flush(BitSink& bitSink) { UNUSED(bitSink); }
+bool SizeCoderLuts::generateFusedLut(int maxEntries)
+{
+	int end = std::min(2*fusedRange + 1, numFusedEntries + maxEntries);
+	for (; numFusedEntries < end; ++numFusedEntries) {
+		int val = numFusedEntries - fusedRange;
+		SizeAmp sa = getSizeAmp(val);
+		FusedCode fc;
+		int codeLength = huffCoder.getCodeLength(sa.size);
+		fc.size = sa.size;
+		fc.numBits = codeLength ? codeLength + sa.size : 0;
+		fc.code = (huffCoder.getCode(sa.size) << sa.size) | (sa.amp & ((1u << sa.size) - 1));
+		fusedLut.push_back(fc);
+	}
+	return isComplete();
+}
 
-    private:
-        std::shared_ptr<HuffmanCoder> huffCoder;
-        std::vector<int> counts;
-        int nlsbs;
-};
+std::shared_ptr<const SizeCoderLuts> getSizeCoderLuts(const HuffmanTable& table, int fusedRange)
+{
+	static LutRegistry<SizeCoderLuts> registry;
+	return registry.get(table, fusedRange);
+}
 
-SizeIntCoder::SizeIntCoder(std::shared_ptr<HuffmanCoder> huffCoder)
-    : huffCoder(huffCoder),
-	  counts(vector<int>(HUFF_MAX_NUMBER_SYMBOLS, 0)),
-      nlsbs(0)
+SizeIntCoder::SizeIntCoder(std::shared_ptr<const SizeCoderLuts> luts)
+    : luts(luts),
+	  fusedLut(luts->fusedLut.data()),
+	  fusedRange(luts->fusedRange),
+	  counts(vector<int>(HUFF_MAX_NUMBER_SYMBOLS, 0))
 {
+	if (!luts->isComplete())
+		throw std::logic_error("SizeIntCoder: fusedLut is not complete");
 }
 
 SizeIntCoder::~SizeIntCoder()
 {
 }
 
-void SizeIntCoder::code(BitSink& bitSink, int val)
+void SizeIntCoder::codeSlow(BitSink& bitSink, int val)
 {
 	SizeAmp sa = getSizeAmp(val);
-    huffCoder->code(bitSink, sa.size);
+    luts->huffCoder.code(bitSink, sa.size);
     counts[sa.size]++;
     if (sa.size) {
         bitSink.receive(sa.amp, sa.size);
     }
 }
 
-IntCoder* getSizeIntCoder(const HuffmanTable& table)
+// Codes the fused values with a BlockWriter, leaving its scope only to codeSlow a value
+void SizeIntCoder::codeBlock(BitSink& bitSink, const int* vals, size_t n)
+{
+	const SizeCoderLuts::FusedCode* centre = fusedLut + fusedRange; // centre[val]
+	unsigned range = fusedRange;
+	int* sizeCounts = &counts[0];
+	const int* end = vals + n;
+	while (vals != end) {
+		{
+			BitSink::BlockWriter writer(bitSink);
+			for (; vals != end; ++vals) {
+				int val = *vals;
+				if ((unsigned)val + range > 2*range || centre[val].numBits == 0)
+					break;
+				const SizeCoderLuts::FusedCode& fc = centre[val];
+				writer.receive(fc.code, fc.numBits);
+				sizeCounts[fc.size]++;
+			}
+		}
+		if (vals != end)
+			codeSlow(bitSink, *vals++);
+	}
+}
+
+IntCoder* getSizeIntCoder(const HuffmanTable& table, int fusedRange)
+{
+    return new SizeIntCoder(getSizeCoderLuts(table, fusedRange));
+}
+
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Adaptive magnitude huffman coding
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * AdaptiveSizeIntCoder
+ *
+ * A SizeIntCoder whose Huffman table follows the data. At the end of each period (of period
+ * values) the sizes of the last windowPeriods periods give the next table. It is built during
+ * the next period a step per value (see rebuildStep), so no value pays for more than one step:
+ * the window's optimal table on the first value, its SizeCoderLuts (with fusedLut only reserved)
+ * on the second, then a slice of fusedLut per value, done half way through the period. At the
+ * end of that period a 1 bit flag, before the next value, says whether the coder switches to the
+ * new table, which it does if the new table would have coded the period just ended in fewer
+ * bits (which needs the period's final counts, so is decided there). The decoder (see
+ * AdaptiveSizeIntDecoder) counts the same sizes, so builds the same tables, and follows the
+ * flags.
+ */
+class AdaptiveSizeIntCoder final : public IntCoder
+{
+public:
+	AdaptiveSizeIntCoder(const HuffmanTable& initialTable, int period, int windowPeriods,
+			int fusedRange);
+	virtual ~AdaptiveSizeIntCoder() {}
+
+	virtual void code(BitSink& bitSink, int val);
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink&) { }
+
+private:
+	void startPeriod(BitSink& bitSink);
+	void rebuildStep();
+
+private:
+	static const int NUM_SIZES = 32;
+	enum Rebuild { NO_REBUILD, MAKE_TABLE, MAKE_LUTS, FILL_LUTS }; // The next rebuildStep
+	WindowedHuffmanTable window;
+	int fusedRange;
+	int stepEntries; // fusedLut entries of nextLuts to generate per value
+	HuffmanTable table;
+	shared_ptr<SizeIntCoder> coder;
+	Rebuild rebuild; // NO_REBUILD in the first period
+	HuffmanTable nextTable;
+	shared_ptr<SizeCoderLuts> nextLuts;
+	std::vector<int> counts;
+};
+
+AdaptiveSizeIntCoder::AdaptiveSizeIntCoder(const HuffmanTable& initialTable, int period,
+		int windowPeriods, int fusedRange)
+	: window(NUM_SIZES, period, windowPeriods),
+	  fusedRange(fusedRange),
+	  stepEntries((2*fusedRange + 1) / std::max(period/2 - 2, 1) + 1),
+	  table(initialTable),
+	  coder(new SizeIntCoder(getSizeCoderLuts(initialTable, fusedRange))),
+	  rebuild(NO_REBUILD),
+	  counts(HUFF_MAX_NUMBER_SYMBOLS, 0)
+{
+}
+
+void AdaptiveSizeIntCoder::rebuildStep()
+{
+	switch (rebuild) {
+	case MAKE_TABLE:
+		nextTable = window.makeWindowTable();
+		rebuild = MAKE_LUTS;
+		break;
+	case MAKE_LUTS:
+		// Window tables are rarely repeated, so aren't worth registering
+		nextLuts.reset(new SizeCoderLuts(nextTable, fusedRange, true));
+		rebuild = FILL_LUTS;
+		break;
+	case FILL_LUTS:
+		nextLuts->generateFusedLut(stepEntries);
+		break;
+	case NO_REBUILD:
+		break;
+	}
+}
+
+void AdaptiveSizeIntCoder::startPeriod(BitSink& bitSink)
+{
+	bool rebuilt = rebuild != NO_REBUILD;
+	if (rebuilt) {
+		// Normally already complete (unless the period is very short)
+		while (rebuild != FILL_LUTS)
+			rebuildStep();
+		nextLuts->generateFusedLut(2*fusedRange + 1);
+	}
+	window.nextPeriod();
+	if (rebuilt) {
+		const vector<int>& periodCounts = window.getLastPeriodCounts();
+		bool switchTable = huffmanCodeBits(periodCounts, nextTable) < huffmanCodeBits(periodCounts, table);
+		bitSink.receive(switchTable, 1);
+		if (switchTable) {
+			table = nextTable;
+			coder.reset(new SizeIntCoder(nextLuts));
+		}
+		nextLuts.reset();
+	}
+	rebuild = MAKE_TABLE;
+}
+
+void AdaptiveSizeIntCoder::code(BitSink& bitSink, int val)
+{
+	if (window.isPeriodComplete())
+		startPeriod(bitSink);
+	coder->code(bitSink, val); // Throws for INT_MIN, the only value of size 32
+	int size = bitLength(val < 0 ? -(uint32_t)val : val);
+	counts[size]++;
+	window.count(size);
+	rebuildStep();
+}
+
+IntCoder* getAdaptiveSizeIntCoder(const HuffmanTable& initialTable, int period, int windowPeriods,
+		int fusedRange)
+{
+	return new AdaptiveSizeIntCoder(initialTable, period, windowPeriods, fusedRange);
+}
+
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Context switched magnitude huffman coding
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * ContextSizeIntCoder
+ *
+ * A SizeIntCoder per context (see getSizeContext): each value is coded with the table of the
+ * context of the previous two sizes. The decoder (see ContextSizeIntDecoder) tracks the same
+ * sizes, so switching tables costs no bits.
+ */
+class ContextSizeIntCoder final : public IntCoder
+{
+public:
+	ContextSizeIntCoder(const std::vector<HuffmanTable>& tables, int fusedRange);
+	virtual ~ContextSizeIntCoder() {}
+
+	virtual void code(BitSink& bitSink, int val);
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink&) { }
+
+private:
+	std::vector<shared_ptr<SizeIntCoder> > coders; // coders[context]
+	int prevSize;
+	int context;
+	std::vector<int> counts;
+};
+
+ContextSizeIntCoder::ContextSizeIntCoder(const std::vector<HuffmanTable>& tables, int fusedRange)
+	: prevSize(0),
+	  context(getSizeContext(0, 0)),
+	  counts(HUFF_MAX_NUMBER_SYMBOLS, 0)
+{
+	if (tables.size() != (size_t)NUM_SIZE_CONTEXTS)
+		throw std::logic_error("ContextSizeIntCoder: need a table per context");
+	for (const auto& table : tables)
+		coders.push_back(shared_ptr<SizeIntCoder>(new SizeIntCoder(getSizeCoderLuts(table, fusedRange))));
+}
+
+void ContextSizeIntCoder::code(BitSink& bitSink, int val)
+{
+	coders[context]->code(bitSink, val); // Throws for INT_MIN, the only value of size 32
+	int size = bitLength(val < 0 ? -(uint32_t)val : val);
+	counts[size]++;
+	context = getSizeContext(size, prevSize);
+	prevSize = size;
+}
+
+IntCoder* getContextSizeIntCoder(const std::vector<HuffmanTable>& tables, int fusedRange)
+{
+	return new ContextSizeIntCoder(tables, fusedRange);
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Magnitude rANS coding
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * RansIntCoder
+ *
+ * Codes the same sizes as SizeIntCoder, but with rANS (see Rans.h) instead of Huffman codes, so
+ * a size costs close to its information content, including well under 1 bit for the very common
+ * size of (nearly) constant quantities. The amplitudes are raw bits, as in SizeIntCoder.
+ *
+ * rANS codes in reverse, so values are buffered and coded a block (of up to blockSize values)
+ * at a time, with frequencies scaled from the block's own counts. The sizes are coded with
+ * numStates (1, 4 or 8) interleaved rANS states, value n with state n % numStates, so the
+ * decoder's states have independent dependency chains that the CPU can run in parallel. The
+ * states share one word stream. A block is:
+ *   16 bits: number of values (>= 1)
+ *   5 bits: maxSize, the largest size in the block
+ *   13 bits each: the frequencies of sizes 0,1,..,maxSize (summing to RANS_PROB_SCALE)
+ *   32 bits: number of rANS words
+ *   the rANS words (the final states, state 0 first, then the renormalization words)
+ *   the amplitudes, in value order
+ * flush codes the (partial) block buffered so far, so must be called before the bitSink is closed.
+ */
+class RansIntCoder final : public IntCoder
+{
+public:
+	RansIntCoder(int blockSize, int numStates);
+	virtual ~RansIntCoder() {}
+
+	virtual void code(BitSink& bitSink, int val);
+	virtual bool usesSizeAmps() const { return true; }
+	virtual void codeSizeAmps(BitSink& bitSink, const int* residuals, const uint8_t* sizes,
+			const uint32_t* amps, size_t n);
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink& bitSink) { if (numVals) codeBuffered(bitSink); }
+
+private:
+	void codeBuffered(BitSink& bitSink);
+
+private:
+	static const int NUM_SIZES = 32;
+	int blockSize;
+	int numStates;
+	int numVals; // Buffered in sizes and amps
+	std::vector<uint8_t> sizes;
+	std::vector<uint32_t> amps; // The size lsbs
+	std::vector<uint16_t> ransWords; // Written backwards from the end
+	std::vector<int> counts;
+};
+
+RansIntCoder::RansIntCoder(int blockSize, int numStates)
+	: blockSize(blockSize),
+	  numStates(numStates),
+	  numVals(0),
+	  sizes(blockSize),
+	  amps(blockSize),
+	  ransWords(blockSize + 2*numStates), // At most a word per size, and the final states
+	  counts(HUFF_MAX_NUMBER_SYMBOLS, 0)
+{
+	if (blockSize < 1 || blockSize > MAX_RANS_BLOCK_SIZE)
+		throw std::logic_error("RansIntCoder: blockSize out of range");
+	if (numStates != 1 && numStates != 4 && numStates != 8)
+		throw std::logic_error("RansIntCoder: numStates must be 1, 4 or 8");
+}
+
+/*
+ * Codes sizes[0],..,sizes[numVals-1] backwards from end, size n with state n % NumStates, and
+ * returns the start of the words. The states of a group of NumStates values are coded together
+ * (in a loop the compiler unrolls), so they stay in registers.
+ */
+template <int NumStates>
+static uint16_t* ransEncodeSizes(const uint8_t* sizes, int numVals, const RansEncSymbol* syms,
+		uint16_t* end)
+{
+	uint32_t x[NumStates];
+	for (int s = 0; s < NumStates; ++s)
+		x[s] = RANS_L;
+	uint16_t* ptr = end;
+	int n = numVals - 1;
+	for (; n >= 0 && (n + 1) % NumStates; --n) // The partial group at the end
+		ransEncode(x[n % NumStates], ptr, syms[sizes[n]]);
+	for (; n >= 0; n -= NumStates) {
+		const uint8_t* group = sizes + n - (NumStates - 1);
+		for (int s = NumStates - 1; s >= 0; --s)
+			ransEncode(x[s], ptr, syms[group[s]]);
+	}
+	for (int s = NumStates - 1; s >= 0; --s)
+		ransEncodeFlush(x[s], ptr);
+	return ptr;
+}
+
+// Branch free (the sign of a residual is unpredictable), unlike getSizeAmp
+void RansIntCoder::code(BitSink& bitSink, int val)
+{
+	int size = bitLength(val < 0 ? -(uint32_t)val : val);
+	if (size >= NUM_SIZES)
+		throw std::logic_error("Int min reached");
+	counts[size]++;
+	sizes[numVals] = size;
+	amps[numVals] = (uint32_t)(val + (val >> 31)) & ((1u << size) - 1);
+	if (++numVals == blockSize)
+		codeBuffered(bitSink);
+}
+
+// Buffers the kernel's sizes and amps, which are the ones code works out
+void RansIntCoder::codeSizeAmps(BitSink& bitSink, const int*, const uint8_t* valSizes,
+		const uint32_t* valAmps, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (valSizes[i] >= NUM_SIZES)
+			throw std::logic_error("Int min reached");
+		counts[valSizes[i]]++;
+		sizes[numVals] = valSizes[i];
+		amps[numVals] = valAmps[i];
+		if (++numVals == blockSize)
+			codeBuffered(bitSink);
+	}
+}
+
+void RansIntCoder::codeBuffered(BitSink& bitSink)
+{
+	vector<uint32_t> blockCounts(NUM_SIZES, 0);
+	int maxSize = 0;
+	for (int n = 0; n < numVals; ++n) {
+		blockCounts[sizes[n]]++;
+		maxSize = std::max(maxSize, (int)sizes[n]);
+	}
+	blockCounts.resize(maxSize + 1);
+	vector<uint32_t> freqs = ransNormalize(blockCounts);
+	RansEncSymbol syms[NUM_SIZES];
+	for (int size = 0, start = 0; size <= maxSize; start += freqs[size++])
+		syms[size] = ransEncSymbol(start, freqs[size]);
+
+	uint16_t* end = &ransWords[0] + ransWords.size();
+	uint16_t* ptr;
+	if (numStates == 8)
+		ptr = ransEncodeSizes<8>(&sizes[0], numVals, syms, end);
+	else if (numStates == 4)
+		ptr = ransEncodeSizes<4>(&sizes[0], numVals, syms, end);
+	else
+		ptr = ransEncodeSizes<1>(&sizes[0], numVals, syms, end);
+
+	bitSink.receive(numVals, 16);
+	bitSink.receive(maxSize, 5);
+	for (int size = 0; size <= maxSize; ++size)
+		bitSink.receive(freqs[size], RANS_PROB_BITS + 1);
+	bitSink.receive(end - ptr, 32);
+	for (; end - ptr >= 2; ptr += 2)
+		bitSink.receive(((uint32_t)ptr[0] << 16) | ptr[1], 32);
+	if (ptr < end)
+		bitSink.receive(*ptr, 16);
+	// Amplitudes are gathered 32 bits at a time, as many are 0 or 1 bits long
+	uint64_t ampBits = 0;
+	int numAmpBits = 0;
+	for (int n = 0; n < numVals; ++n) {
+		ampBits = (ampBits << sizes[n]) | amps[n];
+		numAmpBits += sizes[n];
+		if (numAmpBits >= 32) {
+			numAmpBits -= 32;
+			bitSink.receive(ampBits >> numAmpBits, 32);
+		}
+	}
+	if (numAmpBits)
+		bitSink.receive(ampBits, numAmpBits);
+	numVals = 0;
+}
+
+IntCoder* getRansIntCoder(int blockSize, int numStates)
 {
-	shared_ptr<HuffmanCoder> huffCoder(new HuffmanCoder(table));
-    return new SizeIntCoder(huffCoder);
+	return new RansIntCoder(blockSize, numStates);
 }
 
 
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Context adaptive binary arithmetic coding
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * ArithIntCoder
+ *
+ * Codes values with an adaptive binary range coder (see RangeCoder.h), for the smallest code at
+ * a higher CPU cost than SizeIntCoder. As in CABAC a value is binarized and each binary decision
+ * is coded with the probability of its own context:
+ *   size: unary, (size > 0), (size > 1),.., each decision k in context (previous size, k)
+ *   sign (for size >= 1): a direct bit
+ *   magnitude below its leading 1 (for size >= 2): the top bit in context (size), the rest
+ *     direct bits
+ * The contexts belong to the coder, so each quantity (with its own coder) has its own.
+ *
+ * The range coder is flushed every block (of up to blockSize values) and a block is written as:
+ *   16 bits: number of values (>= 1)
+ *   32 bits: number of bytes
+ *   the bytes
+ * so the decoder can read a block before decoding it, resuming if the bitstream isn't all
+ * there yet. The probabilities and previous size carry over from block to block. flush codes the
+ * (partial) block buffered so far, so must be called before the bitSink is closed.
+ */
+class ArithIntCoder final : public IntCoder
+{
+public:
+	ArithIntCoder(int blockSize);
+	virtual ~ArithIntCoder() {}
+
+	virtual void code(BitSink& bitSink, int val);
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink& bitSink);
+
+private:
+	static const int NUM_SIZES = 32;
+	int blockSize;
+	int numVals; // In the block so far
+	std::vector<uint8_t> bytes;
+	RangeEncoder encoder;
+	int prevSize;
+	RcProb sizeProbs[NUM_SIZES][NUM_SIZES - 1]; // [previous size][k] for (size > k)
+	RcProb magProbs[NUM_SIZES];                 // [size] for the top bit below the leading 1
+	std::vector<int> counts;
+};
+
+ArithIntCoder::ArithIntCoder(int blockSize)
+	: blockSize(blockSize),
+	  numVals(0),
+	  encoder(bytes),
+	  prevSize(0),
+	  counts(HUFF_MAX_NUMBER_SYMBOLS, 0)
+{
+	if (blockSize < 1 || blockSize > MAX_ARITH_BLOCK_SIZE)
+		throw std::logic_error("ArithIntCoder: blockSize out of range");
+	std::fill(&sizeProbs[0][0], &sizeProbs[0][0] + NUM_SIZES*(NUM_SIZES - 1), RC_PROB_INIT);
+	std::fill(magProbs, magProbs + NUM_SIZES, RC_PROB_INIT);
+}
+
+void ArithIntCoder::code(BitSink& bitSink, int val)
+{
+	uint32_t mag = val < 0 ? -(uint32_t)val : val;
+	int size = bitLength(mag);
+	if (size >= NUM_SIZES)
+		throw std::logic_error("Int min reached");
+	counts[size]++;
+	RcProb* probs = sizeProbs[prevSize];
+	for (int k = 0; k < NUM_SIZES - 1; ++k) {
+		encoder.encodeBit(probs[k], size > k);
+		if (size == k)
+			break;
+	}
+	if (size >= 1)
+		encoder.encodeDirectBits(val > 0, 1);
+	if (size >= 2) {
+		encoder.encodeBit(magProbs[size], (mag >> (size - 2)) & 1);
+		encoder.encodeDirectBits(mag, size - 2);
+	}
+	prevSize = size;
+	if (++numVals == blockSize)
+		flush(bitSink);
+}
+
+void ArithIntCoder::flush(BitSink& bitSink)
+{
+	if (numVals == 0)
+		return;
+	encoder.flush();
+	bitSink.receive(numVals, 16);
+	bitSink.receive(bytes.size(), 32);
+	for (auto byte : bytes)
+		bitSink.receive(byte, 8);
+	bytes.clear();
+	encoder.reset();
+	numVals = 0;
+}
+
+IntCoder* getArithIntCoder(int blockSize)
+{
+	return new ArithIntCoder(blockSize);
+}
+
 }
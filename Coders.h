@@ -8,19 +8,46 @@
 #ifndef CODERS_H_
 #define CODERS_H_
 
+#include "BitSink.h"
+#include "HuffmanCoder.h"
+#include "HuffmanTable.h"
+#include "QuantizeKernels.h"
+#include "RangeCoder.h"
+#include "Rans.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stddef.h>
+
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 namespace qs {
 
 class Modeller;
-class BitSink;
 
 class IntCoder
 {
 public:
 	virtual ~IntCoder() {}
 	virtual void code(BitSink& bitSink, int val) = 0;
+	// Codes vals[0],..,vals[n-1]. Coders override it with a loop that doesn't make a virtual call
+	// per value.
+	virtual void codeBlock(BitSink& bitSink, const int* vals, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			code(bitSink, vals[i]);
+	}
+	// Codes the output of a quantize kernel (see QuantizeKernels.h). Coders that code sizes and
+	// amplitudes override it to use sizes and amps, and usesSizeAmps to return true; the default
+	// codes the residuals (and sizes and amps may be null).
+	virtual bool usesSizeAmps() const { return false; }
+	virtual void codeSizeAmps(BitSink& bitSink, const int* residuals, const uint8_t* sizes,
+			const uint32_t* amps, size_t n) {
+		(void)sizes;
+		(void)amps;
+		codeBlock(bitSink, residuals, n);
+	}
     virtual void flush(BitSink& bitSink) = 0;
     virtual const std::vector<int>& getCounts() const = 0;
 };
@@ -35,8 +62,382 @@ public:
 	 */
 	virtual int predict() = 0;
 	virtual void update(int) = 0;
+
+	/*!
+	 * Quantizes len doubles with qf, and predicts each one, as a quantize kernel (see
+	 * QuantizeKernels.h) does. The concrete predictors below run the kernel.
+	 */
+	virtual void quantizeBlock(const double* data, int len, double qf, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		for (int n = 0; n < len; ++n) {
+			int x = lroundFast(data[n] * qf);
+			residuals[n] = x - predict();
+			update(x);
+			if (sizes)
+				residualSizeAmp(residuals[n], sizes[n], amps[n]);
+		}
+	}
+
+	/*!
+	 * The inverse of quantizeBlock: reconstructs len values from their residuals to xs, and unless
+	 * vals is null dequantizes them with qStep to vals, as a reconstruct kernel (see
+	 * QuantizeKernels.h) does. The concrete predictors below run the kernel.
+	 */
+	virtual void reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+			double* vals) {
+		for (int n = 0; n < len; ++n) {
+			xs[n] = (int)((uint32_t)residuals[n] + (uint32_t)predict());
+			update(xs[n]);
+			if (vals)
+				vals[n] = xs[n] * qStep;
+		}
+	}
 };
 
+/*
+ * Concrete predictors. They are final, so calls through a predictor of the concrete type (e.g.
+ * in predictiveCode below) are not virtual and can be inlined.
+ */
+class ZeroOrderPredictor final : public IntPredictor
+{
+public:
+	ZeroOrderPredictor(int initialVal) : initialVal(initialVal) {}
+
+	virtual int predict() { return initialVal; }
+	virtual void update(int) { }
+	virtual void quantizeBlock(const double* data, int len, double qf, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		int unused = 0;
+		quantizeResiduals(data, len, qf, 0, initialVal, unused, residuals, sizes, amps);
+	}
+	virtual void reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+			double* vals) {
+		int unused = 0;
+		reconstructResiduals(residuals, len, qStep, 0, initialVal, unused, xs, vals);
+	}
+
+private:
+	int initialVal;
+};
+
+class FirstOrderPredictor final : public IntPredictor
+{
+public:
+	FirstOrderPredictor(int initialVal) : prev(initialVal) {}
+
+	virtual int predict() { return prev; }
+	virtual void update(int val) { prev = val; }
+	virtual void quantizeBlock(const double* data, int len, double qf, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		int prev2 = 0;
+		quantizeResiduals(data, len, qf, 1, prev, prev2, residuals, sizes, amps);
+	}
+	virtual void reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+			double* vals) {
+		int prev2 = 0;
+		reconstructResiduals(residuals, len, qStep, 1, prev, prev2, xs, vals);
+	}
+
+private:
+	int prev;
+};
+
+class SecondOrderPredictor final : public IntPredictor
+{
+public:
+	SecondOrderPredictor(int prev1, int prev2) : prev1(prev1), prev2(prev2) {}
+
+	virtual int predict() { return 2*prev1 - prev2; }
+	virtual void update(int val) { prev2 = prev1; prev1 = val; }
+	virtual void quantizeBlock(const double* data, int len, double qf, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		quantizeResiduals(data, len, qf, 2, prev1, prev2, residuals, sizes, amps);
+	}
+	virtual void reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+			double* vals) {
+		reconstructResiduals(residuals, len, qStep, 2, prev1, prev2, xs, vals);
+	}
+
+private:
+	int prev1;
+	int prev2;
+};
+
+// Quantizes and reconstructs with the IntPredictor loops (no kernel)
+class ThirdOrderPredictor final : public IntPredictor
+{
+public:
+	ThirdOrderPredictor(int prev1, int prev2, int prev3) : prev1(prev1), prev2(prev2), prev3(prev3) {}
+
+	virtual int predict() { return (int)(3*((uint32_t)prev1 - (uint32_t)prev2) + (uint32_t)prev3); }
+	virtual void update(int val) { prev3 = prev2; prev2 = prev1; prev1 = val; }
+
+private:
+	int prev1;
+	int prev2;
+	int prev3;
+};
+
+/*
+ * SelectablePredictor
+ *
+ * A predictor of order 0 (predicts 0) to MAX_ORDER, keeping the last three values whatever its
+ * order, so the order can change from one block to the next (see setOrder) and the new order
+ * predicts from the values before it. selectOrder picks the order for a block: the one whose
+ * residuals have the smallest sum of magnitudes (as FLAC does, a proxy for the fewest size and
+ * amplitude bits), the lowest order on a tie. QuantitiesSequence signals the order of each block
+ * in ORDER_BITS bits.
+ *
+ * Orders 0, 1 and 2 run the quantize and reconstruct kernels.
+ */
+class SelectablePredictor final : public IntPredictor
+{
+public:
+	static const int MAX_ORDER = 3;
+	static const int ORDER_BITS = 2;
+
+	SelectablePredictor(int order = 2);
+
+	int getOrder() const { return order; }
+	void setOrder(int order);
+	int selectOrder(const double* data, int len, double qf) const;
+
+	virtual int predict();
+	virtual void update(int val) { prev3 = prev2; prev2 = prev1; prev1 = val; }
+	virtual void quantizeBlock(const double* data, int len, double qf, int* residuals,
+			uint8_t* sizes, uint32_t* amps);
+	virtual void reconstructBlock(const int* residuals, int len, double qStep, int* xs,
+			double* vals);
+
+private:
+	int order;
+	int prev1;
+	int prev2;
+	int prev3;
+};
+
+inline int SelectablePredictor::predict()
+{
+	switch (order) {
+	case 0:
+		return 0;
+	case 1:
+		return prev1;
+	case 2:
+		return (int)(2*(uint32_t)prev1 - (uint32_t)prev2);
+	default:
+		return (int)(3*((uint32_t)prev1 - (uint32_t)prev2) + (uint32_t)prev3);
+	}
+}
+
+IntPredictor* getIntPredictor(int order, int initial1=0, int initial2=0, int initial3=0);
+
+class HuffmanTable;
+// Values in [-fusedRange, fusedRange] are coded from a precomputed table - see SizeIntCoder
+static const int DEFAULT_FUSED_RANGE = 4095;
+static const int MAX_FUSED_RANGE = 65535; // So Huffman code + amplitude fit in 32 bits
+IntCoder* getSizeIntCoder(const HuffmanTable& table, int fusedRange = DEFAULT_FUSED_RANGE);
+// A SizeIntCoder whose table adapts to the data - see AdaptiveSizeIntCoder
+IntCoder* getAdaptiveSizeIntCoder(const HuffmanTable& initialTable,
+		int period = DEFAULT_ADAPTIVE_PERIOD, int windowPeriods = DEFAULT_ADAPTIVE_WINDOW_PERIODS,
+		int fusedRange = DEFAULT_FUSED_RANGE);
+// Codes a value with tables[getSizeContext(previous 2 sizes)] (tables.size() == NUM_SIZE_CONTEXTS)
+// - see ContextSizeIntCoder
+IntCoder* getContextSizeIntCoder(const std::vector<HuffmanTable>& tables,
+		int fusedRange = DEFAULT_FUSED_RANGE);
+// Codes sizes with numStates (1, 4 or 8) interleaved rANS states, a block of up to blockSize
+// values at a time - see RansIntCoder
+IntCoder* getRansIntCoder(int blockSize = DEFAULT_RANS_BLOCK_SIZE, int numStates = DEFAULT_RANS_STATES);
+// Codes values with a context adaptive binary range coder, a block of up to blockSize values at a
+// time - see ArithIntCoder
+IntCoder* getArithIntCoder(int blockSize = DEFAULT_ARITH_BLOCK_SIZE);
+
+/*
+ * SizeCoderLuts
+ *
+ * The lookup tables of a SizeIntCoder: the HuffmanCoder of its table and fusedLut. For values
+ * in [-fusedRange, fusedRange] fusedLut holds the Huffman code and amplitude already
+ * concatenated. They don't change once generated, so all the coders of a table share them (see
+ * getSizeCoderLuts).
+ */
+struct SizeCoderLuts
+{
+	// deferFusedLut: leave fusedLut to (staged) calls of generateFusedLut. It's only reserved, so
+	// not even zero filled, until then.
+	SizeCoderLuts(const HuffmanTable& table, int fusedRange, bool deferFusedLut = false);
+
+	// Appends up to maxEntries more fusedLut entries. Returns true when fusedLut is complete.
+	bool generateFusedLut(int maxEntries);
+	bool isComplete() const { return numFusedEntries == 2*fusedRange + 1; }
+
+	struct FusedCode {
+		uint32_t code;   // Huffman code followed by amplitude
+		uint8_t numBits; // Huffman code length + size, or 0 if the size isn't in the Huffman table
+		uint8_t size;
+	};
+	HuffmanCoder huffCoder;
+	int fusedRange;
+	std::vector<FusedCode> fusedLut; // fusedLut[val + fusedRange]
+	int numFusedEntries; // Entries of fusedLut generated so far (fusedLut.size())
+};
+
+// The complete SizeCoderLuts of table and fusedRange, shared with every other caller (see
+// LutRegistry)
+std::shared_ptr<const SizeCoderLuts> getSizeCoderLuts(const HuffmanTable& table,
+		int fusedRange = DEFAULT_FUSED_RANGE);
+
+/*
+ * SizeIntCoder
+ *
+ * Codes the size (number of bits) of a value with a HuffmanCoder, followed by size amplitude
+ * bits. A value in [-fusedRange, fusedRange] costs one fusedLut lookup (see SizeCoderLuts) and
+ * one BitSink::receive. That path is inline, the rest is in codeSlow. codeBlock codes the fused
+ * values through a BitSink::BlockWriter.
+ */
+class SizeIntCoder final : public IntCoder
+{
+public:
+	// luts must be complete
+	SizeIntCoder(std::shared_ptr<const SizeCoderLuts> luts);
+	virtual ~SizeIntCoder();
+
+	virtual void code(BitSink& bitSink, int val);
+	virtual void codeBlock(BitSink& bitSink, const int* vals, size_t n);
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink&) { }
+
+private:
+	void codeSlow(BitSink& bitSink, int val);
+
+private:
+	std::shared_ptr<const SizeCoderLuts> luts;
+	const SizeCoderLuts::FusedCode* fusedLut; // luts->fusedLut
+	int fusedRange;
+	std::vector<int> counts;
+};
+
+inline void SizeIntCoder::code(BitSink& bitSink, int val)
+{
+	if ((unsigned)val + (unsigned)fusedRange <= (unsigned)(2*fusedRange)) {
+		const SizeCoderLuts::FusedCode& fc = fusedLut[val + fusedRange];
+		if (fc.numBits) {
+			bitSink.receive(fc.code, fc.numBits);
+			counts[fc.size]++;
+			return;
+		}
+	}
+	codeSlow(bitSink, val);
+}
+
+/*
+ * SizeCounter
+ *
+ * Counts the sizes SizeIntCoder would code, without coding anything: the first pass of a two
+ * pass encode with an optimal Huffman table (see makeOptimalHuffmanTable).
+ */
+class SizeCounter final : public IntCoder
+{
+public:
+	SizeCounter() : counts(HUFF_MAX_NUMBER_SYMBOLS, 0) {}
+
+	virtual void code(BitSink&, int val) { counts[bitLength(val < 0 ? -(uint32_t)val : val)]++; }
+	virtual void codeBlock(BitSink&, const int* vals, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			counts[bitLength(vals[i] < 0 ? -(uint32_t)vals[i] : vals[i])]++;
+	}
+	virtual bool usesSizeAmps() const { return true; }
+	virtual void codeSizeAmps(BitSink&, const int*, const uint8_t* sizes, const uint32_t*, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			counts[sizes[i]]++;
+	}
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink&) { }
+
+private:
+	std::vector<int> counts;
+};
+
+/*
+ * ContextSizeCounter
+ *
+ * A SizeCounter that also counts the sizes in each context (see getSizeContext), for the first
+ * pass of a two pass encode with context switched tables (see ContextSizeIntCoder).
+ */
+class ContextSizeCounter final : public IntCoder
+{
+public:
+	ContextSizeCounter()
+		: counts(HUFF_MAX_NUMBER_SYMBOLS, 0),
+		  contextCounts(NUM_SIZE_CONTEXTS, counts),
+		  prev1(0),
+		  prev2(0) {}
+
+	virtual void code(BitSink&, int val) {
+		int size = bitLength(val < 0 ? -(uint32_t)val : val);
+		counts[size]++;
+		contextCounts[getSizeContext(prev1, prev2)][size]++;
+		prev2 = prev1;
+		prev1 = size;
+	}
+	virtual void codeBlock(BitSink& bitSink, const int* vals, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			ContextSizeCounter::code(bitSink, vals[i]);
+	}
+	virtual bool usesSizeAmps() const { return true; }
+	virtual void codeSizeAmps(BitSink&, const int*, const uint8_t* sizes, const uint32_t*, size_t n) {
+		for (size_t i = 0; i < n; ++i) {
+			counts[sizes[i]]++;
+			contextCounts[getSizeContext(prev1, prev2)][sizes[i]]++;
+			prev2 = prev1;
+			prev1 = sizes[i];
+		}
+	}
+	virtual const std::vector<int>& getCounts() const { return counts; }
+	virtual void flush(BitSink&) { }
+
+	// contextCounts[context][size]
+	const std::vector<std::vector<int> >& getContextCounts() const { return contextCounts; }
+
+private:
+	std::vector<int> counts;
+	std::vector<std::vector<int> > contextCounts;
+	int prev1;
+	int prev2;
+};
+
+/*
+ * Quantizes (with quantization factor qf = 1/qStep), predicts and codes len doubles.
+ *
+ * The doubles are quantized and predicted PREDICTIVE_CODE_BLOCK_SIZE at a time (with the
+ * predictor's quantizeBlock, a quantize kernel for the concrete predictors) into buffers of
+ * residuals, and if the coder uses them sizes and amplitudes, which are coded with one
+ * Coder::codeSizeAmps call. Instantiated with concrete (final) Predictor and Coder types the
+ * loops are inlined. The non-template overload taking the
+ * IntPredictor and IntCoder interfaces looks up the concrete types once per call and forwards to
+ * the matching instantiation, so callers with runtime configured coders should call it once per
+ * block rather than once per value.
+ */
+static const int PREDICTIVE_CODE_BLOCK_SIZE = 256;
+
+template <class Predictor, class Coder>
+inline void predictiveCode(const double* data, int len, double qf, Predictor& predictor,
+		Coder& coder, BitSink& bitSink)
+{
+	int residuals[PREDICTIVE_CODE_BLOCK_SIZE];
+	uint8_t sizes[PREDICTIVE_CODE_BLOCK_SIZE];
+	uint32_t amps[PREDICTIVE_CODE_BLOCK_SIZE];
+	bool sizeAmps = coder.usesSizeAmps();
+	for (int start = 0; start < len; start += PREDICTIVE_CODE_BLOCK_SIZE) {
+		int blockLen = std::min(len - start, PREDICTIVE_CODE_BLOCK_SIZE);
+		predictor.quantizeBlock(data + start, blockLen, qf, residuals, sizeAmps ? sizes : nullptr,
+				amps);
+		coder.codeSizeAmps(bitSink, residuals, sizes, amps, blockLen);
+	}
+}
+
+void predictiveCode(const double* data, int len, double qf, IntPredictor& predictor,
+		IntCoder& coder, BitSink& bitSink);
+
 class DoublesCoder
 {
 public:
@@ -52,11 +453,6 @@ private:
 	std::shared_ptr<BitSink> bitSink;
 };
 
-IntPredictor* getIntPredictor(int order, int initial1=0, int initial2=0);
-
-class HuffmanTable;
-IntCoder* getSizeIntCoder(const HuffmanTable& table);
-
 }
 
 #endif /* CODERS_H_ */
@@ -9,33 +9,206 @@
 #include "Decoders.h"
 #include "HuffmanDecoder.h"
 #include "HuffmanTable.h"
+#include "LutRegistry.h"
+#include "RangeCoder.h"
+#include "Rans.h"
 
 #include <limits.h>
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <vector>
 
 namespace qs {
 
+size_t IntDecoder::decodeBlock(BitSource& bitSource, int* out, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		Run run;
+		if (decode(bitSource, run) != HuffmanDecoder::HUFF_DECODING_OK)
+			return i;
+		out[i] = run.val;
+	}
+	return n;
+}
+
+/*
+ * SizeDecoderLuts
+ *
+ * The lookup tables of a SizeIntDecoder: the HuffmanDecoder of its table and fusedLut. When a
+ * size code and amplitude together fit in fusedLookahead bits (the common case of small
+ * residuals) a single fusedLut lookup gives the reconstructed value and the total number of
+ * bits. They don't change once generated, so all the decoders of a table share them (see
+ * getSizeDecoderLuts).
+ */
+struct SizeDecoderLuts
+{
+	// deferFusedLut: leave fusedLut, including zero filling it, to (staged) calls of
+	// generateFusedLut
+	SizeDecoderLuts(const HuffmanTable& table, int fusedLookahead, bool deferFusedLut = false);
+
+    // Zero fills up to maxCodes codes' worth of fusedLut (the table size over the number of
+    // codes), then fills in the entries of up to maxCodes more (size) codes. Returns true when
+    // fusedLut is complete.
+    bool generateFusedLut(int maxCodes);
+    bool isComplete() const
+    {
+    	return fusedLut.size() == ((size_t)1 << fusedLookahead) && nextCode == (int)sizes.size();
+    }
+
+    HuffmanDecoder huffDecoder;
+    int fusedLookahead;
+    // fusedLut entry: value << 8 | total bits (size code + amplitude), or 0 if they don't fit
+    std::vector<int32_t> fusedLut;
+    // Size, code and code length of each code, in code order, and the next code for fusedLut
+    std::vector<int> sizes;
+    std::vector<int> codes;
+    std::vector<int> codeLens;
+    int nextCode;
+};
+
+/*
+ * SizeIntDecoder
+ *
+ * Decodes values coded by SizeIntCoder: a Huffman coded size followed by size amplitude bits.
+ * Small values are decoded with one fusedLut lookup (see SizeDecoderLuts). Otherwise the value is
+ * decoded in steps (Huffman decode, then amplitude).
+ *
+ * A value is at most MAX_VALUE_BITS bits, so decodeBlock decodes getAvailableBits() /
+ * MAX_VALUE_BITS values at a time with decodeFast, without checking for the end of the
+ * bitstream or a saved size. Only the last few values of the bitstream go through decode.
+ */
 class SizeIntDecoder : public IntDecoder
 {
 public:
-	SizeIntDecoder(std::shared_ptr<HuffmanDecoder>);
+	// luts must be complete
+	SizeIntDecoder(std::shared_ptr<const SizeDecoderLuts> luts);
 	virtual ~SizeIntDecoder() {}
 
     virtual int decode(BitSource& bitSource, Run& out);
+    virtual size_t decodeBlock(BitSource& bitSource, int* out, size_t n);
+
+private:
+    // Decodes a value that bitSource is known to hold, after a refill
+    inline int decodeFast(BitSource& bitSource) const;
 
 private:
-    std::shared_ptr<HuffmanDecoder> huffDecoder;
+    static const int MAX_VALUE_BITS = HUFF_MAX_CODE_LENGTH + 31;
+    std::shared_ptr<const SizeDecoderLuts> luts;
+    const HuffmanDecoder* huffDecoder; // &luts->huffDecoder
+    const int32_t* fusedLut; // luts->fusedLut
+    int fusedLookahead;
     static const int SIZE_NOT_SAVED = -1;
     int savedSize;
 };
 
 
-SizeIntDecoder::SizeIntDecoder(std::shared_ptr<HuffmanDecoder> huffDecoder)
-	: huffDecoder(huffDecoder),
+/*
+ * Amplitudes with a leading 0 bit are negative (see getSizeAmp): amp = val - 1 for val < 0,
+ * keeping the size lsbs.
+ */
+static inline int extendAmp(uint32_t amp, int size)
+{
+	uint32_t range = (uint32_t)1 << size;
+	return (int)(amp - (amp < (range >> 1) ? range - 1 : 0)); // No branch on the sign
+}
+
+SizeDecoderLuts::SizeDecoderLuts(const HuffmanTable& table, int fusedLookahead, bool deferFusedLut)
+	: huffDecoder(table),
+	  fusedLookahead(fusedLookahead),
+	  nextCode(0)
+{
+	if (fusedLookahead < 1 || fusedLookahead > MAX_FUSED_LOOKAHEAD)
+		throw std::logic_error("SizeDecoderLuts: fusedLookahead out of range");
+	if (deferFusedLut)
+		fusedLut.reserve(1 << fusedLookahead);
+	else
+		fusedLut.assign(1 << fusedLookahead, 0);
+	int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1];
+	uint8_t huffCodeLen[HUFF_MAX_NUMBER_SYMBOLS + 1];
+	int numSymbols = makeCodeAndLengthTables(huffCode, huffCodeLen, table);
+	for (int p = 0; p < numSymbols; p++) {
+		sizes.push_back(table.symbol[p]);
+		codes.push_back(huffCode[p]);
+		codeLens.push_back(huffCodeLen[p]);
+	}
+	if (!deferFusedLut)
+		generateFusedLut(numSymbols);
+}
+
+/*
+ * For each (size) code of length len, and each of the 2^size amplitudes, fill in the entries
+ * for all fusedLookahead bit patterns starting with code followed by the amplitude.
+ */
+bool SizeDecoderLuts::generateFusedLut(int maxCodes)
+{
+	size_t lutSize = (size_t)1 << fusedLookahead;
+	if (fusedLut.size() < lutSize) {
+		size_t perCode = lutSize / std::max(sizes.size(), (size_t)1) + 1;
+		fusedLut.resize(std::min(lutSize, fusedLut.size() + maxCodes * perCode), 0);
+		if (fusedLut.size() < lutSize)
+			return false;
+	}
+	int end = std::min((int)sizes.size(), nextCode + maxCodes);
+	for (; nextCode < end; nextCode++) {
+		int size = sizes[nextCode];
+		int numBits = codeLens[nextCode] + size;
+		if (numBits > fusedLookahead)
+			continue;
+		int fill = 1 << (fusedLookahead - numBits);
+		for (uint32_t amp = 0; amp < ((uint32_t)1 << size); amp++) {
+			int32_t entry = (int32_t)((uint32_t)extendAmp(amp, size) << 8) | numBits;
+			int lutBits = ((codes[nextCode] << size) | amp) << (fusedLookahead - numBits);
+			for (int n = 0; n < fill; n++)
+				fusedLut[lutBits + n] = entry;
+		}
+	}
+	return isComplete();
+}
+
+std::shared_ptr<const SizeDecoderLuts> getSizeDecoderLuts(const HuffmanTable& table, int fusedLookahead)
+{
+	static LutRegistry<SizeDecoderLuts> registry;
+	return registry.get(table, fusedLookahead);
+}
+
+SizeIntDecoder::SizeIntDecoder(std::shared_ptr<const SizeDecoderLuts> luts)
+	: luts(luts),
+	  huffDecoder(&luts->huffDecoder),
+	  fusedLut(luts->fusedLut.data()),
+	  fusedLookahead(luts->fusedLookahead),
 	  savedSize(SIZE_NOT_SAVED)
 {
+	if (!luts->isComplete())
+		throw std::logic_error("SizeIntDecoder: fusedLut is not complete");
+}
+
+[[noreturn]] static void throwSizeTooBig(int size)
+{
+	std::ostringstream oss;
+	oss<<"SizeIntDecoder::decode: size="<<size<<" is more than the maximum of 31 bits";
+	throw std::logic_error(oss.str());
+}
+
+inline int SizeIntDecoder::decodeFast(BitSource& bitSource) const
+{
+	int32_t entry = fusedLut[bitSource.peekFast(fusedLookahead)];
+	if (entry & 0xFF) {
+		bitSource.consumeFast(entry & 0xFF);
+		return entry >> 8;
+	}
+	// One refill covers both the size code (<= 16 bits) and the amplitude (<= 31 bits)
+	int size = huffDecoder->decodeFast(bitSource);
+	if (size < (int)sizeof(int) * 8) {
+		uint32_t amp = (uint32_t)bitSource.peekFast(size);
+		bitSource.consumeFast(size);
+		return extendAmp(amp, size);
+	}
+	if (size == sizeof(int) * 8) // 32 bit INT_MIN
+		return INT_MIN;
+	throwSizeTooBig(size);
 }
 
 int SizeIntDecoder::decode(BitSource& bitSource, Run& val)
@@ -45,7 +218,11 @@ int SizeIntDecoder::decode(BitSource& bitSource, Run& val)
 	 * get that number of bits and work out actual value
 	 */
 	int size;
-	if (savedSize >= 0)
+	if (savedSize < 0 && bitSource.refill() >= BitSource::FAST_ZONE_BITS) {
+		val = Run(0, decodeFast(bitSource));
+		return HuffmanDecoder::HUFF_DECODING_OK;
+	}
+	else if (savedSize >= 0)
 		size = savedSize;
 	else
 		size = huffDecoder->decode(bitSource);
@@ -53,7 +230,7 @@ int SizeIntDecoder::decode(BitSource& bitSource, Run& val)
 		return HuffmanDecoder::HUFF_NEED_MORE_BITS;
 
 	if (size == sizeof(int) * 8) { // Decode special case of 32 bit INT_MIN
-		val = INT_MIN;
+		val = Run(0, INT_MIN);
 		savedSize = SIZE_NOT_SAVED;
 		return HuffmanDecoder::HUFF_DECODING_OK;
 	}
@@ -66,33 +243,489 @@ int SizeIntDecoder::decode(BitSource& bitSource, Run& val)
 
 	// o.k. we have enough bits to decode amp. The remaining bits store the
 	// value of amp
-	int nlsbs = size;
-	if (size > 31) { // Caught INT32_MIN case (size = 32) above
-		std::ostringstream oss;
-		oss<<"SizeIntDecoder::decode: size="<<size<<" is more than the maximum of 31 bits";
-		throw std::logic_error(oss.str());
-	}
-	int temp = 0x0;
-	if (size > 16) { // Decode in two chunks
-		temp = bitSource.peek(size - 16) << 16;
-		bitSource.consume(size - 16);
-		nlsbs = 16;
-	}
-	temp |= bitSource.peek(nlsbs);
-	bitSource.consume(nlsbs);
-	int thresh = 1 << (size - 1);
-	if (temp < thresh)
-		temp = ((-1) << size) + temp + 1;
+	if (size > 31) // Caught INT32_MIN case (size = 32) above
+		throwSizeTooBig(size);
+	uint32_t amp = bitSource.pop(size);
 
 	savedSize = SIZE_NOT_SAVED;
-	val = Run(0, temp);
+	val = Run(0, extendAmp(amp, size));
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+size_t SizeIntDecoder::decodeBlock(BitSource& bitSource, int* out, size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		size_t sure = savedSize < 0 ? bitSource.getAvailableBits() / MAX_VALUE_BITS : 0;
+		if (sure == 0) {
+			// The end of the bitstream (so far), or a value left part decoded
+			Run run;
+			if (decode(bitSource, run) != HuffmanDecoder::HUFF_DECODING_OK)
+				return i;
+			out[i++] = run.val;
+			continue;
+		}
+		size_t end = i + std::min(sure, n - i);
+		for (; i < end; ++i) {
+			bitSource.refill();
+			out[i] = decodeFast(bitSource);
+		}
+	}
+	return n;
+}
+
+IntDecoder* getSizeIntDecoder(const HuffmanTable& table, int fusedLookahead)
+{
+    return new SizeIntDecoder(getSizeDecoderLuts(table, fusedLookahead));
+}
+
+/*
+ * AdaptiveSizeIntDecoder
+ *
+ * Decodes values coded by AdaptiveSizeIntCoder, building the same tables from the decoded sizes
+ * and switching to them when the stream's flags say so. As in the coder, the next table is built a
+ * step per value: the window's optimal table, its SizeDecoderLuts (without fusedLut), then a
+ * slice of fusedLut (zero fill, then codes) per value.
+ */
+class AdaptiveSizeIntDecoder : public IntDecoder
+{
+public:
+	AdaptiveSizeIntDecoder(const HuffmanTable& initialTable, int period, int windowPeriods,
+			int fusedLookahead);
+	virtual ~AdaptiveSizeIntDecoder() {}
+
+	virtual int decode(BitSource& bitSource, Run& out);
+
+private:
+	void startPeriod(BitSource& bitSource);
+	void rebuildStep();
+
+private:
+	static const int NUM_SIZES = 32;
+	enum Rebuild { NO_REBUILD, MAKE_TABLE, MAKE_LUTS, FILL_LUTS }; // The next rebuildStep
+	WindowedHuffmanTable window;
+	int fusedLookahead;
+	int stepCodes; // fusedLut codes of nextLuts to generate per value
+	std::shared_ptr<SizeIntDecoder> decoder;
+	Rebuild rebuild; // NO_REBUILD in the first period
+	HuffmanTable nextTable;
+	std::shared_ptr<SizeDecoderLuts> nextLuts;
+};
+
+AdaptiveSizeIntDecoder::AdaptiveSizeIntDecoder(const HuffmanTable& initialTable, int period,
+		int windowPeriods, int fusedLookahead)
+	: window(NUM_SIZES, period, windowPeriods),
+	  fusedLookahead(fusedLookahead),
+	  stepCodes(2*NUM_SIZES / std::max(period/2 - 2, 1) + 1), // Zero fill and codes
+	  decoder(new SizeIntDecoder(getSizeDecoderLuts(initialTable, fusedLookahead))),
+	  rebuild(NO_REBUILD)
+{
+}
+
+void AdaptiveSizeIntDecoder::rebuildStep()
+{
+	switch (rebuild) {
+	case MAKE_TABLE:
+		nextTable = window.makeWindowTable();
+		rebuild = MAKE_LUTS;
+		break;
+	case MAKE_LUTS:
+		nextLuts.reset(new SizeDecoderLuts(nextTable, fusedLookahead, true));
+		rebuild = FILL_LUTS;
+		break;
+	case FILL_LUTS:
+		nextLuts->generateFusedLut(stepCodes);
+		break;
+	case NO_REBUILD:
+		break;
+	}
+}
+
+void AdaptiveSizeIntDecoder::startPeriod(BitSource& bitSource)
+{
+	if (rebuild != NO_REBUILD) {
+		// Normally already complete (unless the period is very short)
+		while (rebuild != FILL_LUTS)
+			rebuildStep();
+		nextLuts->generateFusedLut(nextLuts->sizes.size());
+		if (bitSource.pop(1))
+			decoder.reset(new SizeIntDecoder(nextLuts));
+		nextLuts.reset();
+	}
+	window.nextPeriod();
+	rebuild = MAKE_TABLE;
+}
+
+int AdaptiveSizeIntDecoder::decode(BitSource& bitSource, Run& val)
+{
+	if (window.isPeriodComplete()) {
+		if (rebuild != NO_REBUILD && bitSource.getAvailableBits() < 1)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		startPeriod(bitSource);
+	}
+	int err = decoder->decode(bitSource, val);
+	if (err != HuffmanDecoder::HUFF_DECODING_OK)
+		return err;
+	int size = bitLength(val.val < 0 ? -(uint32_t)val.val : val.val);
+	if (size >= NUM_SIZES)
+		throw std::logic_error("AdaptiveSizeIntDecoder: INT_MIN is not coded");
+	window.count(size);
+	rebuildStep();
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+IntDecoder* getAdaptiveSizeIntDecoder(const HuffmanTable& initialTable, int period,
+		int windowPeriods, int fusedLookahead)
+{
+	return new AdaptiveSizeIntDecoder(initialTable, period, windowPeriods, fusedLookahead);
+}
+
+
+/*
+ * ContextSizeIntDecoder
+ *
+ * Decodes values coded by ContextSizeIntCoder, decoding each with the SizeIntDecoder of the
+ * context of the previous two decoded sizes.
+ */
+class ContextSizeIntDecoder : public IntDecoder
+{
+public:
+	ContextSizeIntDecoder(const std::vector<HuffmanTable>& tables, int fusedLookahead);
+	virtual ~ContextSizeIntDecoder() {}
+
+	virtual int decode(BitSource& bitSource, Run& out);
+
+private:
+	std::vector<std::shared_ptr<SizeIntDecoder> > decoders; // decoders[context]
+	int prevSize;
+	int context;
+};
+
+ContextSizeIntDecoder::ContextSizeIntDecoder(const std::vector<HuffmanTable>& tables,
+		int fusedLookahead)
+	: prevSize(0),
+	  context(getSizeContext(0, 0))
+{
+	if (tables.size() != (size_t)NUM_SIZE_CONTEXTS)
+		throw std::logic_error("ContextSizeIntDecoder: need a table per context");
+	for (const auto& table : tables)
+		decoders.push_back(std::shared_ptr<SizeIntDecoder>(
+				new SizeIntDecoder(getSizeDecoderLuts(table, fusedLookahead))));
+}
+
+int ContextSizeIntDecoder::decode(BitSource& bitSource, Run& val)
+{
+	int err = decoders[context]->decode(bitSource, val);
+	if (err != HuffmanDecoder::HUFF_DECODING_OK)
+		return err;
+	int size = bitLength(val.val < 0 ? -(uint32_t)val.val : val.val);
+	context = getSizeContext(size, prevSize);
+	prevSize = size;
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+IntDecoder* getContextSizeIntDecoder(const std::vector<HuffmanTable>& tables, int fusedLookahead)
+{
+	return new ContextSizeIntDecoder(tables, fusedLookahead);
+}
+
+/*
+ * RansIntDecoder
+ *
+ * Decodes values coded by RansIntCoder. When a block starts its header and rANS words are read
+ * and all its sizes decoded at once, numStates interleaved states at a time (see
+ * ransDecodeSizes). Each decode then only reads the value's amplitude bits. Each stage can stop
+ * (returning HUFF_NEED_MORE_BITS) and resume when there are more bits.
+ */
+class RansIntDecoder : public IntDecoder
+{
+public:
+	RansIntDecoder(int numStates);
+	virtual ~RansIntDecoder() {}
+
+	virtual int decode(BitSource& bitSource, Run& out);
+
+private:
+	int readBlock(BitSource& bitSource);
+	void decodeSizes();
+
+public:
+	struct Slot {
+		uint16_t freq;
+		uint16_t start;
+		uint8_t size;
+	};
+
+private:
+	static const int NUM_SIZES = 32;
+	enum Stage {BLOCK_START, FREQS, NUM_WORDS, WORDS, VALUES};
+	int numStates;
+	Stage stage;
+	int numVals;
+	int numSizes;
+	uint32_t numWords;
+	std::vector<uint32_t> freqs;
+	std::vector<uint16_t> ransWords;
+	std::vector<Slot> slots; // slots[ransDecodeSlot(x)]
+	std::vector<uint8_t> sizes; // Of the block's values
+	int nextVal;
+};
+
+RansIntDecoder::RansIntDecoder(int numStates)
+	: numStates(numStates),
+	  stage(BLOCK_START),
+	  numVals(0),
+	  numSizes(0),
+	  numWords(0),
+	  slots(RANS_PROB_SCALE),
+	  nextVal(0)
+{
+	if (numStates != 1 && numStates != 4 && numStates != 8)
+		throw std::logic_error("RansIntDecoder: numStates must be 1, 4 or 8");
+}
+
+// Reads the block header and rANS words, as far as bitSource has them
+int RansIntDecoder::readBlock(BitSource& bitSource)
+{
+	if (stage == BLOCK_START) {
+		if (bitSource.getAvailableBits() < 16 + 5)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		numVals = bitSource.pop(16);
+		numSizes = bitSource.pop(5) + 1;
+		if (numVals == 0)
+			throw std::logic_error("RansIntDecoder: empty block");
+		freqs.clear();
+		stage = FREQS;
+	}
+	if (stage == FREQS) {
+		while ((int)freqs.size() < numSizes) {
+			if (bitSource.getAvailableBits() < RANS_PROB_BITS + 1)
+				return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+			freqs.push_back(bitSource.pop(RANS_PROB_BITS + 1));
+		}
+		stage = NUM_WORDS;
+	}
+	if (stage == NUM_WORDS) {
+		if (bitSource.getAvailableBits() < 32)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		numWords = bitSource.pop(32);
+		// The final states, and at most a word per size
+		if (numWords < 2*(uint32_t)numStates || numWords > (uint32_t)numVals + 2*numStates)
+			throw std::logic_error("RansIntDecoder: bad number of rANS words");
+		ransWords.clear();
+		stage = WORDS;
+	}
+	while (ransWords.size() < numWords) {
+		if (bitSource.getAvailableBits() < 16)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		ransWords.push_back(bitSource.pop(16));
+	}
+	decodeSizes();
+	nextVal = 0;
+	stage = VALUES;
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+/*
+ * Decodes numVals sizes from ptr, size n with state n % NumStates. The NumStates states of a
+ * group are independent, so (with the loop over them unrolled) their decodes overlap. A group
+ * reads at most NumStates words past end (for a corrupt stream), which the caller pads for.
+ * Returns the end of the words read.
+ */
+template <int NumStates>
+static const uint16_t* ransDecodeSizes(const uint16_t* ptr, const uint16_t* end,
+		const RansIntDecoder::Slot* slots, uint8_t* sizes, int numVals)
+{
+	uint32_t x[NumStates];
+	for (int s = 0; s < NumStates; ++s)
+		x[s] = ransDecodeInit(ptr);
+	int n = 0;
+	for (; n + NumStates <= numVals; n += NumStates) {
+		for (int s = 0; s < NumStates; ++s) {
+			const RansIntDecoder::Slot& slot = slots[ransDecodeSlot(x[s])];
+			sizes[n + s] = slot.size;
+			ransDecodeAdvance(x[s], ptr, slot.start, slot.freq);
+		}
+		if (ptr > end)
+			throw std::logic_error("RansIntDecoder: rANS words overrun");
+	}
+	for (int s = 0; n < numVals; ++n, ++s) { // The partial group at the end
+		const RansIntDecoder::Slot& slot = slots[ransDecodeSlot(x[s])];
+		sizes[n] = slot.size;
+		ransDecodeAdvance(x[s], ptr, slot.start, slot.freq);
+	}
+	// The encoder started from RANS_L
+	for (int s = 0; s < NumStates; ++s) {
+		if (x[s] != RANS_L)
+			throw std::logic_error("RansIntDecoder: corrupt rANS words");
+	}
+	return ptr;
+}
+
+void RansIntDecoder::decodeSizes()
+{
+	uint32_t start = 0;
+	for (int size = 0; size < numSizes; ++size) {
+		if (freqs[size] > RANS_PROB_SCALE - start)
+			throw std::logic_error("RansIntDecoder: frequencies sum to more than RANS_PROB_SCALE");
+		for (uint32_t slot = start; slot < start + freqs[size]; ++slot)
+			slots[slot] = Slot{(uint16_t)freqs[size], (uint16_t)start, (uint8_t)size};
+		start += freqs[size];
+	}
+	if (start != RANS_PROB_SCALE)
+		throw std::logic_error("RansIntDecoder: frequencies sum to less than RANS_PROB_SCALE");
+
+	// Padding for ransDecodeAdvance's read ahead and a corrupt stream's overrun
+	ransWords.resize(numWords + 2*numStates, 0);
+	const uint16_t* begin = &ransWords[0];
+	const uint16_t* end = begin + numWords;
+	sizes.resize(numVals);
+	const uint16_t* ptr;
+	if (numStates == 8)
+		ptr = ransDecodeSizes<8>(begin, end, &slots[0], &sizes[0], numVals);
+	else if (numStates == 4)
+		ptr = ransDecodeSizes<4>(begin, end, &slots[0], &sizes[0], numVals);
+	else
+		ptr = ransDecodeSizes<1>(begin, end, &slots[0], &sizes[0], numVals);
+	if (ptr != end)
+		throw std::logic_error("RansIntDecoder: corrupt rANS words");
+}
+
+int RansIntDecoder::decode(BitSource& bitSource, Run& val)
+{
+	if (stage != VALUES) {
+		int err = readBlock(bitSource);
+		if (err != HuffmanDecoder::HUFF_DECODING_OK)
+			return err;
+	}
+	int size = sizes[nextVal];
+	uint32_t amp;
+	if (bitSource.refill() >= size) {
+		amp = (uint32_t)bitSource.peekFast(size);
+		bitSource.consumeFast(size);
+	}
+	else if (bitSource.getAvailableBits() >= size)
+		amp = bitSource.pop(size);
+	else
+		return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+	val = Run(0, extendAmp(amp, size));
+	if (++nextVal == numVals)
+		stage = BLOCK_START;
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+IntDecoder* getRansIntDecoder(int numStates)
+{
+	return new RansIntDecoder(numStates);
+}
+
+
+/*
+ * ArithIntDecoder
+ *
+ * Decodes values coded by ArithIntCoder, with the same contexts. A block's bytes are read (as far
+ * as bitSource has them, resuming on the next call) before any of its values are decoded.
+ */
+class ArithIntDecoder : public IntDecoder
+{
+public:
+	ArithIntDecoder();
+	virtual ~ArithIntDecoder() {}
+
+	virtual int decode(BitSource& bitSource, Run& out);
+
+private:
+	int readBlock(BitSource& bitSource);
+
+private:
+	static const int NUM_SIZES = 32;
+	// Binary decisions per value (size, sign and magnitude), each reading at most a byte
+	static const int MAX_BYTES_PER_VALUE = (NUM_SIZES - 1) + 1 + (NUM_SIZES - 2);
+	enum Stage {BLOCK_START, NUM_BYTES, BYTES, VALUES};
+	Stage stage;
+	int numVals;
+	uint32_t numBytes;
+	std::vector<uint8_t> bytes;
+	RangeDecoder decoder;
+	int nextVal;
+	int prevSize;
+	RcProb sizeProbs[NUM_SIZES][NUM_SIZES - 1];
+	RcProb magProbs[NUM_SIZES];
+};
+
+ArithIntDecoder::ArithIntDecoder()
+	: stage(BLOCK_START),
+	  numVals(0),
+	  numBytes(0),
+	  nextVal(0),
+	  prevSize(0)
+{
+	std::fill(&sizeProbs[0][0], &sizeProbs[0][0] + NUM_SIZES*(NUM_SIZES - 1), RC_PROB_INIT);
+	std::fill(magProbs, magProbs + NUM_SIZES, RC_PROB_INIT);
+}
+
+int ArithIntDecoder::readBlock(BitSource& bitSource)
+{
+	if (stage == BLOCK_START) {
+		if (bitSource.getAvailableBits() < 16)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		numVals = bitSource.pop(16);
+		if (numVals == 0)
+			throw std::logic_error("ArithIntDecoder: empty block");
+		stage = NUM_BYTES;
+	}
+	if (stage == NUM_BYTES) {
+		if (bitSource.getAvailableBits() < 32)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		numBytes = bitSource.pop(32);
+		if (numBytes < (uint32_t)RC_FLUSH_BYTES ||
+				numBytes > (uint32_t)numVals * MAX_BYTES_PER_VALUE + RC_FLUSH_BYTES)
+			throw std::logic_error("ArithIntDecoder: bad number of bytes");
+		bytes.clear();
+		stage = BYTES;
+	}
+	while (bytes.size() < numBytes) {
+		if (bitSource.getAvailableBits() < 8)
+			return HuffmanDecoder::HUFF_NEED_MORE_BITS;
+		bytes.push_back(bitSource.pop(8));
+	}
+	// A (corrupt) value can read MAX_BYTES_PER_VALUE bytes past the end before decode notices
+	bytes.resize(numBytes + MAX_BYTES_PER_VALUE, 0);
+	decoder.start(&bytes[0]);
+	nextVal = 0;
+	stage = VALUES;
+	return HuffmanDecoder::HUFF_DECODING_OK;
+}
+
+int ArithIntDecoder::decode(BitSource& bitSource, Run& val)
+{
+	if (stage != VALUES) {
+		int err = readBlock(bitSource);
+		if (err != HuffmanDecoder::HUFF_DECODING_OK)
+			return err;
+	}
+	RcProb* probs = sizeProbs[prevSize];
+	int size = 0;
+	while (size < NUM_SIZES - 1 && decoder.decodeBit(probs[size]))
+		size++;
+	int sign = size >= 1 ? decoder.decodeDirectBits(1) : 0;
+	uint32_t mag = size >= 1 ? 1 : 0;
+	if (size >= 2) {
+		mag = (mag << 1) | decoder.decodeBit(magProbs[size]);
+		mag = (mag << (size - 2)) | decoder.decodeDirectBits(size - 2);
+	}
+	if (decoder.getPos() > &bytes[0] + numBytes)
+		throw std::logic_error("ArithIntDecoder: bytes overrun");
+	prevSize = size;
+	val = Run(0, sign ? (int)mag : -(int)mag);
+	if (++nextVal == numVals)
+		stage = BLOCK_START;
 	return HuffmanDecoder::HUFF_DECODING_OK;
 }
 
-IntDecoder* getSizeIntDecoder(const HuffmanTable& table)
+IntDecoder* getArithIntDecoder()
 {
-    std::shared_ptr<HuffmanDecoder> huffDecoder(new HuffmanDecoder(table));
-    return new SizeIntDecoder(huffDecoder);
+	return new ArithIntDecoder();
 }
 
 }
@@ -8,6 +8,14 @@
 #ifndef DECODERS_H_
 #define DECODERS_H_
 
+#include "HuffmanTable.h"
+#include "Rans.h"
+
+#include <stddef.h>
+
+#include <memory>
+#include <vector>
+
 namespace qs {
 
 class BitSource;
@@ -24,10 +32,35 @@ class IntDecoder
         virtual ~IntDecoder() {}
 
         virtual int decode(BitSource& bitSource, Run& out) = 0;
+        /*
+         * Decodes up to n values into out. Returns the number decoded, which is less than n only
+         * when the bitstream runs out (call again for the rest once there are more bits). The
+         * default calls decode for each value; decoders override it with a loop that checks the
+         * available bits once for as many values as they are sure to hold.
+         */
+        virtual size_t decodeBlock(BitSource& bitSource, int* out, size_t n);
 };
 
-class HuffmanTable;
-IntDecoder* getSizeIntDecoder(const HuffmanTable& table);
+// fusedLookahead: number of bits looked up at once to decode a (small) value - see SizeIntDecoder
+static const int DEFAULT_FUSED_LOOKAHEAD = 11;
+static const int MAX_FUSED_LOOKAHEAD = 16;
+IntDecoder* getSizeIntDecoder(const HuffmanTable& table, int fusedLookahead = DEFAULT_FUSED_LOOKAHEAD);
+// The lookup tables of the decoders of table and fusedLookahead, shared with every other caller
+// (see LutRegistry)
+struct SizeDecoderLuts;
+std::shared_ptr<const SizeDecoderLuts> getSizeDecoderLuts(const HuffmanTable& table,
+		int fusedLookahead = DEFAULT_FUSED_LOOKAHEAD);
+// Decodes the output of getAdaptiveSizeIntCoder (with the same initialTable, period and windowPeriods)
+IntDecoder* getAdaptiveSizeIntDecoder(const HuffmanTable& initialTable,
+		int period = DEFAULT_ADAPTIVE_PERIOD, int windowPeriods = DEFAULT_ADAPTIVE_WINDOW_PERIODS,
+		int fusedLookahead = DEFAULT_FUSED_LOOKAHEAD);
+// Decodes the output of getContextSizeIntCoder (with the same tables)
+IntDecoder* getContextSizeIntDecoder(const std::vector<HuffmanTable>& tables,
+		int fusedLookahead = DEFAULT_FUSED_LOOKAHEAD);
+// Decodes the output of getRansIntCoder (of any blockSize, with the same numStates)
+IntDecoder* getRansIntDecoder(int numStates = DEFAULT_RANS_STATES);
+// Decodes the output of getArithIntCoder (of any blockSize)
+IntDecoder* getArithIntDecoder();
 
 }
 
@@ -6,8 +6,10 @@
  */
 
 #include "BitSink.h"
+#include "BuiltinHuffmanTables.h"
 #include "HuffmanCoder.h"
 #include "HuffmanTable.h"
+#include "utils.h"
 
 #include <stdint.h>
 
@@ -16,69 +18,45 @@
 
 namespace qs {
 
-HuffmanCoder::HuffmanCoder(const HuffmanTable& huffmanTable)
+void throwInvalidHuffmanSymbol(int symbol)
 {
-	generateLUTs(huffmanTable);
+	std::ostringstream oss;
+	oss<<"HuffmanCoder(generateLuts): symbol "<<symbol<<" is in the Huffman table more than once";
+	throw std::logic_error(oss.str());
 }
 
-/*
- * generateLuts method
- *
- * Generates the lookup tables (LUT's) used for the Huffman encoding.
- * codeLut[n] is the code for symbol n, while codeLengthLut[n] is the code length,
- * in codeLen (the number of bits in the code) for symbol n. These LUTs are generated from a
- * Canonical Huffman Table in the input HuffmanTable. See HuffmanTable.h for more info.
- */
-void HuffmanCoder::generateLUTs(const HuffmanTable& huffmanTable)
-{
-	/*
-	 * Zero coding LUTs, and in particular codeLengthLut. A zero length code is used to
-	 * indicate an invalid symbol i.e. not in the Huffman table. An exception is thrown
-	 * if a zero length code is attempted to be output.
-	 */
-    for (int n = 0; n < HUFF_MAX_NUMBER_SYMBOLS; n++) {
-        codeLut[n] = 0;
-        codeLengthLut[n] = 0;
-    }
+static constexpr HuffmanCoderLuts BUILTIN_CODER_LUTS[NUM_BUILTIN_HUFFMAN_TABLES] = {
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[0]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[1]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[2]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[3]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[4]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[5]),
+	makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[6])
+};
 
-    /*
-     * Generate an array of code lengths and of codes, both in code "value" order.
-     */
-    int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1];
-    uint8_t codeLen[HUFF_MAX_NUMBER_SYMBOLS + 1];
-    int numSymbols = makeCodeAndLengthTables(huffCode, codeLen, huffmanTable);
-
-    /*
-     * Currently we have a mapping from n, where n is the nth symbol ordered
-     * according to code value, to code and code length ((huffCode[n] and codeLen[n]).
-     * Now we create a mapping from symbol s (where s is the symbol (value), symbol = 0,1,...)
-     * to code and code length ((codeLut[i]) and codeLengthLut[i])
-     */
-    int maxsymbol = HUFF_MAX_NUMBER_SYMBOLS - 1;
-    for (int p = 0; p < numSymbols; p++) {
-        int s = huffmanTable.symbol[p]; // symbol s is the pth symbol according to code value
-        if (s < 0 || s > maxsymbol || codeLengthLut[s]) {
-            std::ostringstream oss;
-            oss<<"HuffmanCoder(generateLuts): symbol "<<s<<" is out of range or code length "
-            		<<codeLengthLut[s]<<" is invalid";
-            throw std::logic_error(oss.str());
-        }
-        codeLut[s] = huffCode[p];
-        codeLengthLut[s] = codeLen[p];
-    }
+HuffmanCoder::HuffmanCoder(const HuffmanTable& huffmanTable)
+{
+	int id = findBuiltinHuffmanTable(huffmanTable);
+	if (id >= 0)
+		luts = &BUILTIN_CODER_LUTS[id];
+	else {
+		ownLuts.reset(new HuffmanCoderLuts(makeHuffmanCoderLuts(huffmanTable)));
+		luts = ownLuts.get();
+	}
 }
 
-void HuffmanCoder::code(BitSink& bitSink, int symbol)
+void HuffmanCoder::code(BitSink& bitSink, int symbol) const
 {
 	if (symbol < 0 || symbol > HUFF_MAX_NUMBER_SYMBOLS) {
 		throw std::logic_error("HuffmanCoder(encodeSymbol): Invalid symbol");
 	}
-	if (codeLengthLut[symbol] == 0) {
+	if (luts->codeLengthLut[symbol] == 0) {
 		std::ostringstream oss;
 		oss<<"HuffmanCoder symbol="<<symbol<<" is not in Huffman table";
 		throw std::logic_error(oss.str());
 	}
-	bitSink.receive(codeLut[symbol], codeLengthLut[symbol]);
+	bitSink.receive(luts->codeLut[symbol], luts->codeLengthLut[symbol]);
 }
 
 
@@ -88,4 +66,44 @@ void HuffmanCoder::flush(BitSink& bitSink)
 	bitSink.receive(0xFF, 7);
 }
 
+void writeHuffmanTable(BitSink& bitSink, const HuffmanTable& table)
+{
+	int numSymbols = 0;
+	for (int len = 1; len <= HUFF_MAX_CODE_LENGTH; ++len) {
+		bitSink.receive(table.numCodes[len], 8);
+		numSymbols += table.numCodes[len];
+	}
+	if (numSymbols > HUFF_MAX_NUMBER_SYMBOLS)
+		throw std::logic_error("writeHuffmanTable: too many symbols");
+	for (int n = 0; n < numSymbols; ++n)
+		bitSink.receive(table.symbol[n], 8);
+}
+
+void writeCompactHuffmanTable(BitSink& bitSink, const HuffmanTable& table)
+{
+	int maxCodeLength = HUFF_MAX_CODE_LENGTH;
+	while (maxCodeLength > 1 && table.numCodes[maxCodeLength] == 0)
+		maxCodeLength--;
+	bitSink.receive(maxCodeLength - 1, 4);
+	int numSymbols = 0;
+	for (int len = 1; len <= maxCodeLength; ++len) {
+		int countBits = len < 8 ? len : 8;
+		if (table.numCodes[len] >> countBits)
+			throw std::logic_error("writeCompactHuffmanTable: numCodes out of range");
+		bitSink.receive(table.numCodes[len], countBits);
+		numSymbols += table.numCodes[len];
+	}
+	if (numSymbols > HUFF_MAX_NUMBER_SYMBOLS)
+		throw std::logic_error("writeCompactHuffmanTable: too many symbols");
+	int maxSymbol = 0;
+	for (int n = 0; n < numSymbols; ++n)
+		maxSymbol = maxSymbol > table.symbol[n] ? maxSymbol : table.symbol[n];
+	int symbolBits = bitLength(maxSymbol);
+	bitSink.receive(symbolBits, 4);
+	if (symbolBits) {
+		for (int n = 0; n < numSymbols; ++n)
+			bitSink.receive(table.symbol[n], symbolBits);
+	}
+}
+
 } // namespace qs
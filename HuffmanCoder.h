@@ -10,26 +10,78 @@
 
 #include "HuffmanTable.h"
 
+#include <stdint.h>
+
+#include <memory>
+
 namespace qs {
 
 class BitSink;
 
+// Never thrown at compile time, so it needn't be constexpr
+[[noreturn]] void throwInvalidHuffmanSymbol(int symbol);
+
+/*
+ * HuffmanCoderLuts
+ *
+ * codeLut[s] is the code for symbol s, and codeLengthLut[s] its length, 0 if s is not in the
+ * table. makeHuffmanCoderLuts is constexpr, so the LUTs of the built-in tables are made at compile
+ * time (and are in read only data).
+ */
+struct HuffmanCoderLuts
+{
+	unsigned int codeLut[HUFF_MAX_NUMBER_SYMBOLS];
+	uint8_t codeLengthLut[HUFF_MAX_NUMBER_SYMBOLS];
+};
+
+constexpr HuffmanCoderLuts makeHuffmanCoderLuts(const HuffmanTable& huffmanTable)
+{
+	HuffmanCoderLuts luts = {{0}, {0}};
+	int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1] = {0};
+	uint8_t codeLen[HUFF_MAX_NUMBER_SYMBOLS + 1] = {0};
+	int numSymbols = makeCodeAndLengthTables(huffCode, codeLen, huffmanTable);
+	// huffCode[p] and codeLen[p] are the code and length of the pth symbol in code value order
+	for (int p = 0; p < numSymbols; p++) {
+		int s = huffmanTable.symbol[p];
+		if (luts.codeLengthLut[s])
+			throwInvalidHuffmanSymbol(s);
+		luts.codeLut[s] = huffCode[p];
+		luts.codeLengthLut[s] = codeLen[p];
+	}
+	return luts;
+}
+
+/*
+ * HuffmanCoder
+ *
+ * Codes symbols with the LUTs of a table: the compile time LUTs of a built-in table, or its own.
+ */
 class HuffmanCoder
 {
 public:
 	HuffmanCoder(const HuffmanTable& huffmanTable);
-	void code(BitSink& bitSink, int symbol);
+	void code(BitSink& bitSink, int symbol) const;
 	// We could put flush outside of HuffmanCoder - particularly if we use the codeword that is all 1's
 	void flush(BitSink& bitSink);
 
-private:
-	void generateLUTs(const HuffmanTable& huffmanTable);
+	// Code and code length for symbol. Code length 0 means symbol is not in the Huffman table.
+	unsigned int getCode(int symbol) const { return luts->codeLut[symbol]; }
+	int getCodeLength(int symbol) const { return luts->codeLengthLut[symbol]; }
 
 private:
-	unsigned int codeLut[HUFF_MAX_NUMBER_SYMBOLS]; // LUT mapping coding symbols to (Huffman) codes
-	char codeLengthLut[HUFF_MAX_NUMBER_SYMBOLS]; // LUT mapping symbols to code length (number bits)
+	std::shared_ptr<const HuffmanCoderLuts> ownLuts; // NULL for a built-in table
+	const HuffmanCoderLuts* luts; // A built-in table's or ownLuts
 };
 
+/*
+ * Writes table to bitSink as in a JPEG DHT segment: numCodes[1], numCodes[2],..,
+ * numCodes[HUFF_MAX_CODE_LENGTH] then the symbols, 8 bits each. See readHuffmanTable.
+ */
+void writeHuffmanTable(BitSink& bitSink, const HuffmanTable& table);
+
+// Writes table in the compact representation (see compactHuffmanTableBits)
+void writeCompactHuffmanTable(BitSink& bitSink, const HuffmanTable& table);
+
 } // namespace qs
 
 #endif /* TNZ_HUFFMANCODER_H_ */
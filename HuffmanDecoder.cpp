@@ -1,3 +1,4 @@
+#include "BuiltinHuffmanTables.h"
 #include "HuffmanDecoder.h"
 #include "qs_BitSource.h"
 
@@ -7,10 +8,29 @@
 
 namespace qs {
 
+const int HuffmanDecoder::HUFF_NEED_MORE_BITS;
+const int HuffmanDecoder::HUFF_DECODING_OK;
+
+static constexpr HuffmanDecoderLuts BUILTIN_DECODER_LUTS[NUM_BUILTIN_HUFFMAN_TABLES] = {
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[0]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[1]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[2]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[3]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[4]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[5]),
+    makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[6])
+};
+
 HuffmanDecoder::HuffmanDecoder(const HuffmanTable& huffTable)
-	: huffTable(huffTable)
+	: multiLookahead(0)
 {
-    generateLuts(huffTable);
+    int id = findBuiltinHuffmanTable(huffTable);
+    if (id >= 0)
+        luts = &BUILTIN_DECODER_LUTS[id];
+    else {
+        ownLuts.reset(new HuffmanDecoderLuts(makeHuffmanDecoderLuts(huffTable)));
+        luts = ownLuts.get();
+    }
 }
 
 /*
@@ -18,13 +38,16 @@ HuffmanDecoder::HuffmanDecoder(const HuffmanTable& huffTable)
  *
  * Decodes a symbol from bitSource, removing the decoded bits.
  */
-int HuffmanDecoder::decode(BitSource& bitSource)
+int HuffmanDecoder::decode(BitSource& bitSource) const
 {
 
     /*
      * Try to do a lookup decoding, and if this fails use the slower (but
      * complete) decoding method.
      */
+    if (bitSource.refill() >= HUFF_MAX_CODE_LENGTH)
+        return decodeFast(bitSource);
+
     register int avail = bitSource.getAvailableBits();
     if (avail == 0)
         return HUFF_NEED_MORE_BITS;
@@ -33,13 +56,13 @@ int HuffmanDecoder::decode(BitSource& bitSource)
     register int look = 0;
     if (avail >= HUFF_LOOKAHEAD) {
         look = bitSource.peek(HUFF_LOOKAHEAD);
-        numBits = numBitsLut[look];
+        numBits = luts->numBitsLut[look];
     }
-    if (numBits == 0) { // avail < HUFF_LOOKAHEAD or numBitsLut[look] = 0
+    if (numBits == 0) { // avail < HUFF_LOOKAHEAD or luts->numBitsLut[look] = 0
     	if (avail <= HUFF_LOOKAHEAD) {
     		look = bitSource.peek(avail);
     		look <<= (HUFF_LOOKAHEAD - avail); // Fill with zeros from right, could fill with 1's
-            numBits = numBitsLut[look];
+            numBits = luts->numBitsLut[look];
     	}
     	else {
     		return decodeLongCode(bitSource);
@@ -48,7 +71,7 @@ int HuffmanDecoder::decode(BitSource& bitSource)
 
     // We have a valid short code.
     bitSource.consume(numBits);
-    return symbolLut[look];
+    return luts->symbolLut[look];
 }
 
 /*
@@ -57,13 +80,13 @@ int HuffmanDecoder::decode(BitSource& bitSource)
  * Decodes a symbol corresponding to a long code (whose code is longer than
  * HUFF_LOOKAHEAD) from bitSource. Throws an exception when an unknown code is found.
  */
-int HuffmanDecoder::decodeLongCode(BitSource& bitSource)
+int HuffmanDecoder::decodeLongCode(BitSource& bitSource) const
 {
     int len = HUFF_LOOKAHEAD + 1;
     if (bitSource.getAvailableBits() < len)
         return HUFF_NEED_MORE_BITS;  // Need more data
     int code = bitSource.peek(len);
-    while (code > maxCode[len]) {
+    while (code > luts->maxCode[len]) {
         len++;
         if (len > HUFF_MAX_CODE_LENGTH) {
             throw std::logic_error("HuffmanDecoder: Invalid code");
@@ -77,61 +100,119 @@ int HuffmanDecoder::decodeLongCode(BitSource& bitSource)
      * o.k. we have found a valid code. Remove bits and return symbol
      */
     bitSource.consume(len);
-    return huffTable.symbol[(int)(code + symOffset[len])];
+    return luts->huffTable.symbol[(int)(code + luts->symOffset[len])];
 }
 
-/*!
- * Generates the LUTs used for decoding (numBitsLut, symbolLut for codes that
- * are 8 numCodes or less, and symOffset and maxCode for decoding longer codes)
- * huffCodeLen[] and huffCode[] are filled in code-length order.
+/*
+ * decodeLongCodeFast method
+ *
+ * As decodeLongCode, but bitSource is known to hold at least HUFF_MAX_CODE_LENGTH bits.
  */
-void HuffmanDecoder::generateLuts(const HuffmanTable& huffTable)
+int HuffmanDecoder::decodeLongCodeFast(BitSource& bitSource) const
 {
-    uint8_t huffCodeLen[HUFF_MAX_NUMBER_SYMBOLS + 1];
-    int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1];
-    makeCodeAndLengthTables(huffCode, huffCodeLen, huffTable);
-
-   /*
-    * Figure F.15 of JPEG standard: generate decoding tables for bit-sequential
-    * decoding
-    */
-    const uint8_t* numCodes = huffTable.numCodes;
-    int p, i, len; // si, numsymbols;
-    p = 0;
-    for (len = 1; len <= HUFF_MAX_CODE_LENGTH; len++) {
-        if (numCodes[len]) {
-            // symOffset[len] = symbol[] index of 1st symbol of code length len minus the minimum code of length len
-            symOffset[len] = (int32_t) p - (int32_t) huffCode[p];
-            p += numCodes[len];
-            maxCode[len] = huffCode[p-1]; /* maximum code of length len */
-        }
-        else {
-            maxCode[len] = -1;	/* -1 if no codes of this length */
+    int len = HUFF_LOOKAHEAD + 1;
+    int code = (int)bitSource.peekFast(len);
+    while (code > luts->maxCode[len]) {
+        len++;
+        if (len > HUFF_MAX_CODE_LENGTH) {
+            throw std::logic_error("HuffmanDecoder: Invalid code");
         }
+        code = (int)bitSource.peekFast(len);
     }
-    maxCode[HUFF_MAX_CODE_LENGTH + 2] = 0xFFFFF; /* ensures decoding terminates - ToDo, handle codeword of all ones*/
+    bitSource.consumeFast(len);
+    return luts->huffTable.symbol[(int)(code + luts->symOffset[len])];
+}
 
-    /* Compute lookahead tables to speed up decoding.
-     * First we set all the table entries to 0, indicating "too long for lookup
-     * decoding"; then we iterate through the Huffman codes that are short
-     * enough and fill in all the entries that correspond to bit sequences
-     * starting with that code.
-     */
-    memset(numBitsLut, 0, sizeof(numBitsLut));
-    p = 0;
-    for (len = 1; len <= HUFF_LOOKAHEAD; len++) {
-        for (i = 1; i <= (int) numCodes[len]; i++, p++) {
-            /* len = current code's length, p = its index in huffCode[] & symbol[]. */
-            /* Generate left-justified code followed by all possible bit sequences */
-            int lutBits = huffCode[p] << (HUFF_LOOKAHEAD - len);
-            for (int ctr = 1 << (HUFF_LOOKAHEAD - len); ctr > 0; ctr--) {
-              	numBitsLut[lutBits] = len;
-              	symbolLut[lutBits] = huffTable.symbol[p];
-              	lutBits++;
+/*!
+ * Generates multiLut. For each multiLookahead bit pattern, codes are decoded (using maxCode and
+ * symOffset, as in decodeLongCode) from the front of the pattern while they fit in the pattern,
+ * up to HUFF_MULTI_MAX_SYMBOLS codes, stopping after a symbol that isn't chainable.
+ */
+void HuffmanDecoder::generateMultiSymbolLut(int lookahead, const bool* chainable)
+{
+    if (lookahead < 1 || lookahead > HUFF_MULTI_MAX_LOOKAHEAD)
+        throw std::logic_error("HuffmanDecoder: multi symbol lookahead out of range");
+    multiLookahead = lookahead;
+    multiLut.assign(1 << lookahead, 0);
+    for (int look = 0; look < (1 << lookahead); look++) {
+        int pos = 0;
+        int numSymbols = 0;
+        uint32_t entry = 0;
+        while (numSymbols < HUFF_MULTI_MAX_SYMBOLS) {
+            int len = 0;
+            int code = 0;
+            bool found = false;
+            while (!found && pos + len < lookahead) {
+                len++;
+                code = (look >> (lookahead - pos - len)) & ((1 << len) - 1);
+                found = code <= luts->maxCode[len];
             }
+            if (!found)
+                break; // Next code doesn't fit
+            int symbol = luts->huffTable.symbol[code + luts->symOffset[len]];
+            entry |= (uint32_t)symbol << (8 + 8*numSymbols);
+            numSymbols++;
+            pos += len;
+            if (chainable && !chainable[symbol])
+                break;
         }
+        multiLut[look] = entry | (numSymbols << 5) | pos;
+    }
+}
+
+HuffmanTable readHuffmanTable(BitSource& bitSource)
+{
+    HuffmanTable table = {{0}, {0}};
+    if (bitSource.getAvailableBits() < 8*HUFF_MAX_CODE_LENGTH)
+        throw std::logic_error("readHuffmanTable: bitstream ends in table");
+    int numSymbols = 0;
+    for (int len = 1; len <= HUFF_MAX_CODE_LENGTH; ++len) {
+        table.numCodes[len] = (uint8_t)bitSource.pop(8);
+        numSymbols += table.numCodes[len];
     }
-    // ToDo: We should validate symbols as being reasonable (as in IJG code) ...
+    if (numSymbols > HUFF_MAX_NUMBER_SYMBOLS)
+        throw std::logic_error("readHuffmanTable: too many symbols");
+    if (bitSource.getAvailableBits() < 8*numSymbols)
+        throw std::logic_error("readHuffmanTable: bitstream ends in table");
+    for (int n = 0; n < numSymbols; ++n)
+        table.symbol[n] = (uint8_t)bitSource.pop(8);
+
+    int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1];
+    uint8_t codeLen[HUFF_MAX_NUMBER_SYMBOLS + 1];
+    makeCodeAndLengthTables(huffCode, codeLen, table); // Throws if not a valid Huffman table
+    return table;
+}
+
+HuffmanTable readCompactHuffmanTable(BitSource& bitSource)
+{
+    HuffmanTable table = {{0}, {0}};
+    if (bitSource.getAvailableBits() < 4)
+        throw std::logic_error("readCompactHuffmanTable: bitstream ends in table");
+    int maxCodeLength = bitSource.pop(4) + 1;
+    int numSymbols = 0;
+    for (int len = 1; len <= maxCodeLength; ++len) {
+        int countBits = len < 8 ? len : 8;
+        if (bitSource.getAvailableBits() < countBits)
+            throw std::logic_error("readCompactHuffmanTable: bitstream ends in table");
+        table.numCodes[len] = (uint8_t)bitSource.pop(countBits);
+        numSymbols += table.numCodes[len];
+    }
+    if (numSymbols > HUFF_MAX_NUMBER_SYMBOLS)
+        throw std::logic_error("readCompactHuffmanTable: too many symbols");
+    if (bitSource.getAvailableBits() < 4)
+        throw std::logic_error("readCompactHuffmanTable: bitstream ends in table");
+    int symbolBits = bitSource.pop(4);
+    if (symbolBits > 8)
+        throw std::logic_error("readCompactHuffmanTable: symbol bits out of range");
+    if (bitSource.getAvailableBits() < numSymbols*symbolBits)
+        throw std::logic_error("readCompactHuffmanTable: bitstream ends in table");
+    for (int n = 0; n < numSymbols && symbolBits; ++n)
+        table.symbol[n] = (uint8_t)bitSource.pop(symbolBits);
+
+    int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1];
+    uint8_t codeLen[HUFF_MAX_NUMBER_SYMBOLS + 1];
+    makeCodeAndLengthTables(huffCode, codeLen, table); // Throws if not a valid Huffman table
+    return table;
 }
 
 } //namespace qs
@@ -9,11 +9,92 @@
 #define HUFFMANDECODER_H_
 
 #include "HuffmanTable.h"
+#include "qs_BitSource.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
 
 namespace qs {
 
-class BitSource;
+/*
+ * HuffmanDecoderLuts
+ *
+ * The decoding LUTs of a table: numBitsLut and symbolLut decode codes of up to LOOKAHEAD bits
+ * with one lookup, symOffset and maxCode decode longer codes. makeHuffmanDecoderLuts is
+ * constexpr, so the LUTs of the built-in tables are made at compile time (and are in read only
+ * data).
+ */
+struct HuffmanDecoderLuts
+{
+    static constexpr int LOOKAHEAD = 8;
+    HuffmanTable huffTable;
+    int numBitsLut[1 << LOOKAHEAD]; /* # bits, or 0 if too long */
+    uint8_t symbolLut[1 << LOOKAHEAD]; /* symbol, or unused */
+    int32_t symOffset[HUFF_MAX_CODE_LENGTH + 2];
+    int32_t maxCode[HUFF_MAX_CODE_LENGTH + 2];
+};
+
+/*!
+ * Generates the LUTs used for decoding (numBitsLut, symbolLut for codes that
+ * are LOOKAHEAD bits or less, and symOffset and maxCode for decoding longer codes)
+ * huffCodeLen[] and huffCode[] are filled in code-length order.
+ */
+constexpr HuffmanDecoderLuts makeHuffmanDecoderLuts(const HuffmanTable& huffTable)
+{
+    HuffmanDecoderLuts luts = {huffTable, {0}, {0}, {0}, {0}};
+    uint8_t huffCodeLen[HUFF_MAX_NUMBER_SYMBOLS + 1] = {0};
+    int huffCode[HUFF_MAX_NUMBER_SYMBOLS + 1] = {0};
+    makeCodeAndLengthTables(huffCode, huffCodeLen, huffTable);
 
+   /*
+    * Figure F.15 of JPEG standard: generate decoding tables for bit-sequential
+    * decoding
+    */
+    const uint8_t* numCodes = huffTable.numCodes;
+    int p = 0;
+    for (int len = 1; len <= HUFF_MAX_CODE_LENGTH; len++) {
+        if (numCodes[len]) {
+            // symOffset[len] = symbol[] index of 1st symbol of code length len minus the minimum code of length len
+            luts.symOffset[len] = (int32_t) p - (int32_t) huffCode[p];
+            p += numCodes[len];
+            luts.maxCode[len] = huffCode[p-1]; /* maximum code of length len */
+        }
+        else {
+            luts.maxCode[len] = -1;	/* -1 if no codes of this length */
+        }
+    }
+    luts.maxCode[HUFF_MAX_CODE_LENGTH + 1] = 0xFFFFF; /* ensures decoding terminates - ToDo, handle codeword of all ones*/
+
+    /* Compute lookahead tables to speed up decoding.
+     * All the numBitsLut entries start as 0, indicating "too long for lookup
+     * decoding"; then we iterate through the Huffman codes that are short
+     * enough and fill in all the entries that correspond to bit sequences
+     * starting with that code.
+     */
+    p = 0;
+    for (int len = 1; len <= HuffmanDecoderLuts::LOOKAHEAD; len++) {
+        for (int i = 1; i <= (int) numCodes[len]; i++, p++) {
+            /* len = current code's length, p = its index in huffCode[] & symbol[]. */
+            /* Generate left-justified code followed by all possible bit sequences */
+            int lutBits = huffCode[p] << (HuffmanDecoderLuts::LOOKAHEAD - len);
+            for (int ctr = 1 << (HuffmanDecoderLuts::LOOKAHEAD - len); ctr > 0; ctr--) {
+                luts.numBitsLut[lutBits] = len;
+                luts.symbolLut[lutBits] = huffTable.symbol[p];
+                lutBits++;
+            }
+        }
+    }
+    // ToDo: We should validate symbols as being reasonable (as in IJG code) ...
+    return luts;
+}
+
+/*
+ * HuffmanDecoder
+ *
+ * Decodes symbols with the LUTs of a table: the compile time LUTs of a built-in table, or its own.
+ */
 class HuffmanDecoder
 {
     public:
@@ -21,22 +102,73 @@ class HuffmanDecoder
 
         static const int HUFF_NEED_MORE_BITS = -1;
         static const int HUFF_DECODING_OK = 0;
-        int decode(BitSource& bitSource);
+        int decode(BitSource& bitSource) const;
+        // No checks: bitSource must have at least HUFF_MAX_CODE_LENGTH bits refilled
+        inline int decodeFast(BitSource& bitSource) const {
+            int look = (int)bitSource.peekFast(HUFF_LOOKAHEAD);
+            int numBits = luts->numBitsLut[look];
+            if (numBits == 0)
+                return decodeLongCodeFast(bitSource);
+            bitSource.consumeFast(numBits);
+            return luts->symbolLut[look];
+        }
+
+        /*
+         * Optional multi symbol LUT: decodeMulti looks ahead multiLookahead bits (e.g. 11 or 12)
+         * and decodes up to HUFF_MULTI_MAX_SYMBOLS whole codes from them in one lookup.
+         * chainable[s] (for s = 0,1,..,HUFF_MAX_NUMBER_SYMBOLS-1) false means symbol s is
+         * followed by other (non Huffman) bits in the bitstream, so a lookup stops after it.
+         * NULL means all symbols are chainable.
+         */
+        static const int HUFF_MULTI_MAX_SYMBOLS = 3;
+        static const int HUFF_MULTI_MAX_LOOKAHEAD = 16;
+        void generateMultiSymbolLut(int multiLookahead, const bool* chainable = NULL);
+        bool hasMultiSymbolLut() const { return !multiLut.empty(); }
+        // Decodes 1,2,..HUFF_MULTI_MAX_SYMBOLS symbols into symbols[0], symbols[1],.. and returns
+        // the number decoded, or HUFF_NEED_MORE_BITS. Needs generateMultiSymbolLut.
+        inline int decodeMulti(BitSource& bitSource, uint8_t* symbols) const {
+            if (bitSource.refill() >= HUFF_MAX_CODE_LENGTH) {
+                uint32_t entry = multiLut[bitSource.peekFast(multiLookahead)];
+                int numSymbols = (entry >> 5) & 0x03;
+                if (numSymbols > 0) {
+                    bitSource.consumeFast(entry & 0x1F);
+                    symbols[0] = (uint8_t)(entry >> 8);
+                    symbols[1] = (uint8_t)(entry >> 16);
+                    symbols[2] = (uint8_t)(entry >> 24);
+                    return numSymbols;
+                }
+                symbols[0] = (uint8_t)decodeFast(bitSource);
+                return 1;
+            }
+            int symbol = decode(bitSource);
+            if (symbol < 0)
+                return symbol;
+            symbols[0] = (uint8_t)symbol;
+            return 1;
+        }
 
       private:
-        int decodeLongCode(BitSource& bit_source);
-        void generateLuts(const HuffmanTable& huffTable);
-        void fillBitBuffer(BitSource& bitSource);
+        int decodeLongCode(BitSource& bit_source) const;
+        int decodeLongCodeFast(BitSource& bitSource) const;
 
       private:
-        HuffmanTable huffTable;
-        static const int HUFF_LOOKAHEAD=8;
-        int numBitsLut[1 << HUFF_LOOKAHEAD]; /* # bits, or 0 if too long */
-        uint8_t symbolLut[1 << HUFF_LOOKAHEAD]; /* symbol, or unused */
-        int32_t symOffset[HUFF_MAX_CODE_LENGTH + 2];
-        int32_t maxCode[HUFF_MAX_CODE_LENGTH + 2];
+        static const int HUFF_LOOKAHEAD = HuffmanDecoderLuts::LOOKAHEAD;
+        std::shared_ptr<const HuffmanDecoderLuts> ownLuts; // NULL for a built-in table
+        const HuffmanDecoderLuts* luts; // A built-in table's or ownLuts
+        int multiLookahead;
+        // multiLut entry: bits 0-4 total code bits, bits 5-6 number of symbols (0 if the first
+        // code is longer than multiLookahead) and symbols in bits 8-15, 16-23 and 24-31.
+        std::vector<uint32_t> multiLut;
 };
 
+/*
+ * Reads a table written by writeHuffmanTable. Throws std::logic_error if bitSource runs out of
+ * bits or the table is not a valid Huffman table.
+ */
+HuffmanTable readHuffmanTable(BitSource& bitSource);
+// Reads a table written by writeCompactHuffmanTable, throwing as readHuffmanTable does
+HuffmanTable readCompactHuffmanTable(BitSource& bitSource);
+
 } // namespace qs
 
 #endif /* HUFFMANDECODER_H_ */
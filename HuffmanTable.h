@@ -11,6 +11,8 @@
 #include <stdint.h>
 
 #include <ostream>
+#include <stdexcept>
+#include <vector>
 
 namespace qs {
 
@@ -44,9 +46,152 @@ struct HuffmanTable
     //ToDo: look for type errors because I had symbol as array of int (and not uint8_t).
 };
 
-HuffmanTable getDefaultHuffmanTable();
+const HuffmanTable& getDefaultHuffmanTable();
 
-int makeCodeAndLengthTables(int *huffCode, uint8_t *huffCodeLen, const HuffmanTable& huffTable);
+/*
+ * Makes the optimal (minimum total code length) canonical Huffman table for coding symbols
+ * s = 0,1,..,counts.size()-1 counts[s] times each, with no code longer than maxCodeLength.
+ * Only symbols with a non zero count are in the table. Uses the package-merge algorithm, with
+ * HUFFMAN_RESERVED_SYMBOL included as a symbol of weight 0 so that no symbol is given the all
+ * ones code. Throws std::logic_error if no count is non zero.
+ */
+HuffmanTable makeOptimalHuffmanTable(const std::vector<int>& counts,
+        int maxCodeLength = HUFF_MAX_CODE_LENGTH);
+
+/*
+ * Built-in tables, shared by coder and decoder so a stream can refer to one by its ID instead of
+ * carrying a table. ID 0 is getDefaultHuffmanTable(). IDs 1,2,..,NUM_BUILTIN_HUFFMAN_TABLES-1
+ * code residual sizes 0,1,..,31 (SizeIntCoder), each peaking at a different size. They are constant
+ * data (see BuiltinHuffmanTables.h), and their coding and decoding LUTs are made at compile time.
+ */
+static const int NUM_BUILTIN_HUFFMAN_TABLES = 7;
+const HuffmanTable& getBuiltinHuffmanTable(int id);
+// The ID of the built-in table equal to table, or -1 if there isn't one
+int findBuiltinHuffmanTable(const HuffmanTable& table);
+
+/*
+ * WindowedHuffmanTable
+ *
+ * Builds Huffman tables from the symbol counts of a sliding window, the last windowPeriods
+ * periods of period symbols. Counts are smoothed (1 is added to the count of every symbol
+ * 0,1,..,numSymbols-1), so the tables can code any of these symbols whatever the window held.
+ * A coder and a decoder that count the same symbols build the same tables.
+ */
+static const int DEFAULT_ADAPTIVE_PERIOD = 4096;
+static const int DEFAULT_ADAPTIVE_WINDOW_PERIODS = 4;
+class WindowedHuffmanTable
+{
+public:
+    WindowedHuffmanTable(int numSymbols, int period, int windowPeriods);
+
+    // Counts symbol (< numSymbols) in the current period. Returns true if that completes it.
+    inline bool count(int symbol) {
+        periodCounts[current][symbol]++;
+        return ++numInPeriod == period;
+    }
+    bool isPeriodComplete() const { return numInPeriod == period; }
+    // Adds the completed period to the window (dropping the oldest) and starts the next period
+    void nextPeriod();
+    // The optimal table for the window, which only changes with nextPeriod
+    HuffmanTable makeWindowTable() const;
+    // Counts of the last completed period (after nextPeriod)
+    const std::vector<int>& getLastPeriodCounts() const;
+
+private:
+    int numSymbols;
+    int period;
+    int numInPeriod;
+    int current; // Index of the current period in periodCounts
+    std::vector<std::vector<int> > periodCounts; // Ring of windowPeriods + 1 periods
+    std::vector<int> windowCounts;
+};
+
+/*
+ * Context of the next residual size, for context switched tables (see ContextSizeIntCoder),
+ * from the previous two sizes (prev1 the last). Sizes are autocorrelated (a jump in speed is
+ * usually followed by another) so each context's table can be fitted to the sizes that follow
+ * it. The contexts are classes of the (rounded up) mean of prev1 and prev2: 0, 1, 2-3, 4-6 and
+ * 7 or more.
+ */
+static const int NUM_SIZE_CONTEXTS = 5;
+inline int getSizeContext(int prev1, int prev2)
+{
+    static const uint8_t contexts[] = {0, 1, 2, 2, 3, 3, 3, 4};
+    int mean = (prev1 + prev2 + 1) >> 1;
+    return contexts[mean < 7 ? mean : 7];
+}
+
+// Number of bits coding symbol s counts[s] times with table takes, or UINT64_MAX if table has
+// no code for a symbol with a non zero count.
+uint64_t huffmanCodeBits(const std::vector<int>& counts, const HuffmanTable& table);
+
+// FNV-1a hash of the table's code lengths and symbols (equal tables have equal hashes)
+uint64_t hashHuffmanTable(const HuffmanTable& table);
+
+/*
+ * Compact table representation (see writeCompactHuffmanTable):
+ *   maxCodeLength - 1: 4 bits
+ *   numCodes[len] for len = 1,2,..,maxCodeLength: min(len, 8) bits each
+ *   symbolBits: 4 bits, the number of bits in the largest symbol
+ *   symbol[n] for each code: symbolBits bits each
+ * compactHuffmanTableBits returns its length in bits.
+ */
+int compactHuffmanTableBits(const HuffmanTable& table);
+
+/*!
+ * Makes values for two input arrays: huffCode and huffCodeLen. huffCode[n]
+ * is the code (bit pattern if you like) for symbol n, where the symbols
+ * are ordered according to code value (smallest code first). huffCodeLen[n]
+ * is the length of this code. constexpr, so LUTs of constant tables can be made at compile time.
+ */
+constexpr int makeCodeAndLengthTables(int *huffCode, uint8_t *huffCodeLen, const HuffmanTable& huffTable)
+{
+    /*
+     * Figure C.1 in JPEG standard: make table of Huffman code lengths for
+     * each symbol, in code value order
+     */
+    int p = 0;
+    for (int len = 1; len <= HUFF_MAX_CODE_LENGTH; len++) {
+        int i = (int)huffTable.numCodes[len];
+        if (i < 0 || p + i > HUFF_MAX_NUMBER_SYMBOLS)	/* protect against table overrun */
+            throw std::logic_error("HuffmanCoder: Huffman table numCodes values out of range");
+        while (i--)
+          huffCodeLen[p++] = (uint8_t) len;
+    }
+    if (p < 1)
+        throw std::logic_error("HuffmanCoder: Huffman table with no symbols");
+    int numSymbols = p;
+    huffCodeLen[numSymbols] = 0; // Terminate huffCodeLen array with a zero value
+
+    /*
+     * Generate the Huffman codes for each symbol in code value order - using
+     * that lovely property of the JPEG Canonical Huffman code. (See Figure C.2
+     * of the JPEG standard). Also validate that the counts represent a legal
+     * Huffman code tree.
+     */
+    int code = 0; //First code is all zeros!
+    int len = huffCodeLen[0]; // current code length
+    p = 0;
+    while (huffCodeLen[p] != 0) {
+        while (((int) huffCodeLen[p]) == len) {
+            huffCode[p++] = code;
+            code++;
+        }
+        /*
+         * code is now 1 more (in value) than the last code used for codes of
+         * length len; but it must still fit in len numCodes, since no code is
+         * allowed to be all ones. Note how it can't be a prefix of any previous code!
+         */
+        if (code >=  1 << len)
+            throw std::logic_error("HuffmanCoder: Huffman Table does not specify a valid Huffman code "
+            		"(not a prefix code,  or there is a code  word of all ones)");
+        // Increase code length by one, and shift code to left accordingly
+        // (Note how this provides the prefix free quality)
+        len++;
+        code <<= 1;
+    }
+    return numSymbols;
+}
 
 // Returns Kraft sum of code lengths, shifted left by maxCodeLen
 // kraftSum <= 1 << maxCodeLen is then the Kraft inequality.
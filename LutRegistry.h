@@ -0,0 +1,92 @@
+/*
+ * LutRegistry.h
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#ifndef LUTREGISTRY_H_
+#define LUTREGISTRY_H_
+
+#include "HuffmanTable.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace qs {
+
+/*
+ * LutRegistry
+ *
+ * Shares the (immutable) lookup tables built for a Huffman table, so coders and decoders of the
+ * same table, made one after another or side by side, build them once. Luts is constructed as
+ * Luts(table, param) (param e.g. fusedRange) and is found by hashHuffmanTable(table) and param,
+ * the table itself deciding on a hash collision. get is thread safe.
+ *
+ * The registry holds at most capacity Luts. When full, Luts no coder or decoder still holds are
+ * dropped, and if it's still full the new Luts aren't registered (so aren't shared).
+ */
+static const size_t DEFAULT_LUT_REGISTRY_CAPACITY = 64;
+
+template <class Luts>
+class LutRegistry
+{
+public:
+	LutRegistry(size_t capacity = DEFAULT_LUT_REGISTRY_CAPACITY) : capacity(capacity) {}
+
+	std::shared_ptr<const Luts> get(const HuffmanTable& table, int param) {
+		Key key(hashHuffmanTable(table), param);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto range = entries.equal_range(key);
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second.table == table)
+					return it->second.luts;
+			}
+		}
+		// Built unlocked, so other tables' lookups don't wait. If another thread registers the
+		// same table meanwhile, its Luts are used (and these dropped).
+		std::shared_ptr<const Luts> luts(new Luts(table, param));
+		std::lock_guard<std::mutex> lock(mutex);
+		auto range = entries.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second.table == table)
+				return it->second.luts;
+		}
+		if (entries.size() >= capacity) {
+			for (auto it = entries.begin(); it != entries.end(); ) {
+				if (it->second.luts.use_count() == 1)
+					it = entries.erase(it);
+				else
+					++it;
+			}
+		}
+		if (entries.size() < capacity)
+			entries.insert(std::make_pair(key, Entry{table, luts}));
+		return luts;
+	}
+
+	size_t size() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+private:
+	typedef std::pair<uint64_t, int> Key; // hashHuffmanTable(table), param
+	struct Entry {
+		HuffmanTable table;
+		std::shared_ptr<const Luts> luts;
+	};
+	size_t capacity;
+	std::mutex mutex;
+	std::multimap<Key, Entry> entries;
+};
+
+} // namespace qs
+
+#endif /* LUTREGISTRY_H_ */
@@ -0,0 +1,548 @@
+/*
+ * QuantizeKernels.cpp
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#include "QuantizeKernels.h"
+#include "utils.h"
+
+#if QS_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace qs {
+
+// Values a kernel quantizes into its buffer of x at a time
+static const size_t KERNEL_CHUNK = 256;
+
+template <int Order>
+static inline int predictFrom(int prev1, int prev2)
+{
+	return Order == 2 ? (int)(2*(uint32_t)prev1 - (uint32_t)prev2) : prev1;
+}
+
+/*
+ * Residuals, sizes and amps (unless sizes is null) of xs[2],..,xs[n+1] from n, where xs[0] and
+ * xs[1] are prev2 and prev1
+ */
+template <int Order>
+static inline void scalarResiduals(const int* xs, size_t from, size_t n, int* residuals,
+		uint8_t* sizes, uint32_t* amps)
+{
+	// In locals, as the stores to sizes might alias xs
+	int constant = xs[1];
+	int prev2 = xs[from];
+	int prev1 = xs[from + 1];
+	if (!sizes) {
+		for (size_t i = from; i < n; ++i) {
+			int x = xs[i + 2];
+			residuals[i] = (int)((uint32_t)x - (uint32_t)(Order == 0 ? constant : predictFrom<Order>(prev1, prev2)));
+			prev2 = prev1;
+			prev1 = x;
+		}
+		return;
+	}
+	for (size_t i = from; i < n; ++i) {
+		int x = xs[i + 2];
+		int r = (int)((uint32_t)x - (uint32_t)(Order == 0 ? constant : predictFrom<Order>(prev1, prev2)));
+		prev2 = prev1;
+		prev1 = x;
+		uint8_t size;
+		uint32_t amp;
+		residualSizeAmp(r, size, amp);
+		residuals[i] = r;
+		sizes[i] = size;
+		amps[i] = amp;
+	}
+}
+
+/*
+ * Runs Kernel<Order> over len values, a KERNEL_CHUNK at a time. Kernel quantizes (into xs[2],..)
+ * and writes the residuals, and unless sizes is null the sizes and amps, of a chunk.
+ */
+template <template <int> class Kernel>
+static void runKernel(const double* data, size_t len, double qf, int order, int& prev1,
+		int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps)
+{
+	if (order < 0 || order > 2)
+		throw std::logic_error("quantizeResiduals: order must be 0, 1 or 2");
+	int xs[KERNEL_CHUNK + 2];
+	for (size_t start = 0; start < len; start += KERNEL_CHUNK) {
+		size_t n = std::min(KERNEL_CHUNK, len - start);
+		uint8_t* chunkSizes = sizes ? sizes + start : nullptr;
+		uint32_t* chunkAmps = sizes ? amps + start : nullptr;
+		xs[0] = prev2;
+		xs[1] = prev1;
+		if (order == 0)
+			Kernel<0>::run(data + start, n, qf, xs, residuals + start, chunkSizes, chunkAmps);
+		else if (order == 1)
+			Kernel<1>::run(data + start, n, qf, xs, residuals + start, chunkSizes, chunkAmps);
+		else
+			Kernel<2>::run(data + start, n, qf, xs, residuals + start, chunkSizes, chunkAmps);
+		if (order) {
+			prev2 = xs[n];
+			prev1 = xs[n + 1];
+		}
+	}
+}
+
+/*
+ * Reconstructs xs[from],..,xs[n-1] (and vals, unless null) from the residuals, where prev1 and
+ * prev2 are the x before xs[from]
+ */
+template <int Order>
+static inline void scalarReconstruct(const int* residuals, size_t from, size_t n, double qStep,
+		int prev1, int prev2, int* xs, double* vals)
+{
+	int constant = prev1;
+	for (size_t i = from; i < n; ++i) {
+		int x = (int)((uint32_t)residuals[i] + (uint32_t)(Order == 0 ? constant : predictFrom<Order>(prev1, prev2)));
+		prev2 = prev1;
+		prev1 = x;
+		xs[i] = x;
+	}
+	if (vals) {
+		for (size_t i = from; i < n; ++i)
+			vals[i] = xs[i] * qStep;
+	}
+}
+
+/*
+ * Runs Kernel<Order>::reconstruct over len residuals, and updates prev1 and prev2 from xs.
+ * Kernel reconstructs (and dequantizes) the lot, its vector loops carrying the last x (and for
+ * order 2 the last difference) in registers.
+ */
+template <template <int> class Kernel>
+static void runReconstruct(const int* residuals, size_t len, double qStep, int order, int& prev1,
+		int& prev2, int* xs, double* vals)
+{
+	if (order == 0)
+		Kernel<0>::reconstruct(residuals, len, qStep, prev1, prev2, xs, vals);
+	else if (order == 1)
+		Kernel<1>::reconstruct(residuals, len, qStep, prev1, prev2, xs, vals);
+	else if (order == 2)
+		Kernel<2>::reconstruct(residuals, len, qStep, prev1, prev2, xs, vals);
+	else
+		throw std::logic_error("reconstructResiduals: order must be 0, 1 or 2");
+	if (order && len) {
+		prev2 = len >= 2 ? xs[len - 2] : prev1;
+		prev1 = xs[len - 1];
+	}
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Scalar
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+template <int Order>
+struct ScalarKernel
+{
+	static void run(const double* data, size_t n, double qf, int* xs, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		if (sizes) {
+			for (size_t i = 0; i < n; ++i)
+				xs[i + 2] = (int)lroundFast(data[i] * qf);
+			scalarResiduals<Order>(xs, 0, n, residuals, sizes, amps);
+			return;
+		}
+		// Residuals only: in one pass, leaving just the last two x in xs for runKernel
+		int constant = xs[1];
+		int prev2 = xs[0];
+		int prev1 = xs[1];
+		for (size_t i = 0; i < n; ++i) {
+			int x = (int)lroundFast(data[i] * qf);
+			residuals[i] = (int)((uint32_t)x - (uint32_t)(Order == 0 ? constant : predictFrom<Order>(prev1, prev2)));
+			prev2 = prev1;
+			prev1 = x;
+		}
+		xs[n] = prev2;
+		xs[n + 1] = prev1;
+	}
+
+	static void reconstruct(const int* residuals, size_t n, double qStep, int prev1, int prev2,
+			int* xs, double* vals) {
+		scalarReconstruct<Order>(residuals, 0, n, qStep, prev1, prev2, xs, vals);
+	}
+};
+
+void quantizeResidualsScalar(const double* data, size_t len, double qf, int order, int& prev1,
+		int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps)
+{
+	runKernel<ScalarKernel>(data, len, qf, order, prev1, prev2, residuals, sizes, amps);
+}
+
+void reconstructResidualsScalar(const int* residuals, size_t len, double qStep, int order,
+		int& prev1, int& prev2, int* xs, double* vals)
+{
+	runReconstruct<ScalarKernel>(residuals, len, qStep, order, prev1, prev2, xs, vals);
+}
+
+#if QS_HAVE_X86_KERNELS
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * SSE4.1
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * Rounds y to the nearest integer, halves away from zero: truncates, then adds the sign of the
+ * (exact) fraction when it is at least a half.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128d roundHalfAwaySse41(__m128d y)
+{
+	__m128d t = _mm_round_pd(y, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+	__m128d frac = _mm_sub_pd(y, t);
+	__m128d one = _mm_set1_pd(1.0);
+	t = _mm_add_pd(t, _mm_and_pd(_mm_cmpge_pd(frac, _mm_set1_pd(0.5)), one));
+	return _mm_sub_pd(t, _mm_and_pd(_mm_cmple_pd(frac, _mm_set1_pd(-0.5)), one));
+}
+
+/*
+ * Sizes and amps of 4 residuals. The bits below the leading 1 of |r| are smeared into mask, and
+ * the size read from the exponent of the leading 1 alone as a float (exactly converted).
+ */
+__attribute__((target("sse4.1")))
+static inline void sizeAmpSse41(__m128i r, uint8_t* sizes, uint32_t* amps)
+{
+	__m128i mag = _mm_abs_epi32(r);
+	__m128i mask = _mm_or_si128(mag, _mm_srli_epi32(mag, 1));
+	mask = _mm_or_si128(mask, _mm_srli_epi32(mask, 2));
+	mask = _mm_or_si128(mask, _mm_srli_epi32(mask, 4));
+	mask = _mm_or_si128(mask, _mm_srli_epi32(mask, 8));
+	mask = _mm_or_si128(mask, _mm_srli_epi32(mask, 16));
+	__m128i leading = _mm_xor_si128(mask, _mm_srli_epi32(mask, 1));
+	__m128i exponent = _mm_and_si128(_mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(leading)), 23),
+			_mm_set1_epi32(0xFF));
+	__m128i size = _mm_max_epi32(_mm_sub_epi32(exponent, _mm_set1_epi32(126)), _mm_setzero_si128());
+	__m128i amp = _mm_xor_si128(mag, _mm_and_si128(mask, _mm_srai_epi32(r, 31)));
+	_mm_storeu_si128((__m128i*)amps, amp);
+	__m128i size16 = _mm_packus_epi32(size, size);
+	uint32_t size8 = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(size16, size16));
+	memcpy(sizes, &size8, sizeof(size8));
+}
+
+template <int Order>
+__attribute__((target("sse4.1")))
+static inline __m128i residualsSse41(const int* xs, __m128i constant)
+{
+	__m128i x = _mm_loadu_si128((const __m128i*)(xs + 2));
+	if (Order == 0)
+		return _mm_sub_epi32(x, constant);
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(xs + 1));
+	if (Order == 1)
+		return _mm_sub_epi32(x, x1);
+	__m128i x2 = _mm_loadu_si128((const __m128i*)xs);
+	return _mm_sub_epi32(_mm_add_epi32(x, x2), _mm_slli_epi32(x1, 1));
+}
+
+// Inclusive prefix sum of the 4 ints of v
+__attribute__((target("sse4.1")))
+static inline __m128i scanSse41(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+	return _mm_add_epi32(v, _mm_slli_si128(v, 8));
+}
+
+/*
+ * The x of 4 residuals, given last (the previous x) and for order 2 lastDiff (the previous
+ * difference) broadcast, which are updated
+ */
+template <int Order>
+__attribute__((target("sse4.1")))
+static inline __m128i reconstructSse41(__m128i r, __m128i& last, __m128i& lastDiff)
+{
+	if (Order == 0)
+		return _mm_add_epi32(r, last);
+	if (Order == 2) {
+		r = _mm_add_epi32(scanSse41(r), lastDiff);
+		lastDiff = _mm_shuffle_epi32(r, 0xFF);
+	}
+	__m128i x = _mm_add_epi32(scanSse41(r), last);
+	last = _mm_shuffle_epi32(x, 0xFF);
+	return x;
+}
+
+template <int Order>
+struct Sse41Kernel
+{
+	__attribute__((target("sse4.1")))
+	static void run(const double* data, size_t n, double qf, int* xs, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		__m128d qfs = _mm_set1_pd(qf);
+		size_t i = 0;
+		for (; i + 2 <= n; i += 2) {
+			__m128d x = roundHalfAwaySse41(_mm_mul_pd(_mm_loadu_pd(data + i), qfs));
+			_mm_storel_epi64((__m128i*)(xs + i + 2), _mm_cvtpd_epi32(x));
+		}
+		for (; i < n; ++i)
+			xs[i + 2] = (int)lroundFast(data[i] * qf);
+
+		__m128i constant = _mm_set1_epi32(xs[1]);
+		if (!sizes) {
+			for (i = 0; i + 4 <= n; i += 4)
+				_mm_storeu_si128((__m128i*)(residuals + i), residualsSse41<Order>(xs + i, constant));
+		} else {
+			for (i = 0; i + 4 <= n; i += 4) {
+				__m128i r = residualsSse41<Order>(xs + i, constant);
+				_mm_storeu_si128((__m128i*)(residuals + i), r);
+				sizeAmpSse41(r, sizes + i, amps + i);
+			}
+		}
+		scalarResiduals<Order>(xs, i, n, residuals, sizes, amps);
+	}
+
+	__attribute__((target("sse4.1")))
+	static void reconstruct(const int* residuals, size_t n, double qStep, int prev1, int prev2,
+			int* xs, double* vals) {
+		__m128i last = _mm_set1_epi32(prev1);
+		__m128i lastDiff = _mm_set1_epi32((int)((uint32_t)prev1 - (uint32_t)prev2));
+		__m128d qSteps = _mm_set1_pd(qStep);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m128i x = reconstructSse41<Order>(_mm_loadu_si128((const __m128i*)(residuals + i)),
+					last, lastDiff);
+			_mm_storeu_si128((__m128i*)(xs + i), x);
+			if (vals) {
+				_mm_storeu_pd(vals + i, _mm_mul_pd(_mm_cvtepi32_pd(x), qSteps));
+				_mm_storeu_pd(vals + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), qSteps));
+			}
+		}
+		if (Order && i) {
+			prev1 = xs[i - 1];
+			prev2 = xs[i - 2];
+		}
+		scalarReconstruct<Order>(residuals, i, n, qStep, prev1, prev2, xs, vals);
+	}
+};
+
+void quantizeResidualsSse41(const double* data, size_t len, double qf, int order, int& prev1,
+		int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps)
+{
+	runKernel<Sse41Kernel>(data, len, qf, order, prev1, prev2, residuals, sizes, amps);
+}
+
+void reconstructResidualsSse41(const int* residuals, size_t len, double qStep, int order,
+		int& prev1, int& prev2, int* xs, double* vals)
+{
+	runReconstruct<Sse41Kernel>(residuals, len, qStep, order, prev1, prev2, xs, vals);
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * AVX2
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+// As roundHalfAwaySse41
+__attribute__((target("avx2")))
+static inline __m256d roundHalfAwayAvx2(__m256d y)
+{
+	__m256d t = _mm256_round_pd(y, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+	__m256d frac = _mm256_sub_pd(y, t);
+	__m256d one = _mm256_set1_pd(1.0);
+	t = _mm256_add_pd(t, _mm256_and_pd(_mm256_cmp_pd(frac, _mm256_set1_pd(0.5), _CMP_GE_OQ), one));
+	return _mm256_sub_pd(t, _mm256_and_pd(_mm256_cmp_pd(frac, _mm256_set1_pd(-0.5), _CMP_LE_OQ), one));
+}
+
+// As sizeAmpSse41, for 8 residuals
+__attribute__((target("avx2")))
+static inline void sizeAmpAvx2(__m256i r, uint8_t* sizes, uint32_t* amps)
+{
+	__m256i mag = _mm256_abs_epi32(r);
+	__m256i mask = _mm256_or_si256(mag, _mm256_srli_epi32(mag, 1));
+	mask = _mm256_or_si256(mask, _mm256_srli_epi32(mask, 2));
+	mask = _mm256_or_si256(mask, _mm256_srli_epi32(mask, 4));
+	mask = _mm256_or_si256(mask, _mm256_srli_epi32(mask, 8));
+	mask = _mm256_or_si256(mask, _mm256_srli_epi32(mask, 16));
+	__m256i leading = _mm256_xor_si256(mask, _mm256_srli_epi32(mask, 1));
+	__m256i exponent = _mm256_and_si256(
+			_mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(leading)), 23),
+			_mm256_set1_epi32(0xFF));
+	__m256i size = _mm256_max_epi32(_mm256_sub_epi32(exponent, _mm256_set1_epi32(126)),
+			_mm256_setzero_si256());
+	__m256i amp = _mm256_xor_si256(mag, _mm256_and_si256(mask, _mm256_srai_epi32(r, 31)));
+	_mm256_storeu_si256((__m256i*)amps, amp);
+	__m128i size16 = _mm_packus_epi32(_mm256_castsi256_si128(size), _mm256_extracti128_si256(size, 1));
+	_mm_storel_epi64((__m128i*)sizes, _mm_packus_epi16(size16, size16));
+}
+
+template <int Order>
+__attribute__((target("avx2")))
+static inline __m256i residualsAvx2(const int* xs, __m256i constant)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i*)(xs + 2));
+	if (Order == 0)
+		return _mm256_sub_epi32(x, constant);
+	__m256i x1 = _mm256_loadu_si256((const __m256i*)(xs + 1));
+	if (Order == 1)
+		return _mm256_sub_epi32(x, x1);
+	__m256i x2 = _mm256_loadu_si256((const __m256i*)xs);
+	return _mm256_sub_epi32(_mm256_add_epi32(x, x2), _mm256_slli_epi32(x1, 1));
+}
+
+// As scanSse41, for 8 ints: scans each 128 bit lane, then adds the low lane's sum to the high lane
+__attribute__((target("avx2")))
+static inline __m256i scanAvx2(__m256i v)
+{
+	v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+	v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+	__m256i lowSum = _mm256_shuffle_epi32(v, 0xFF);
+	return _mm256_add_epi32(v, _mm256_permute2x128_si256(lowSum, lowSum, 0x08));
+}
+
+// As reconstructSse41, for 8 residuals
+template <int Order>
+__attribute__((target("avx2")))
+static inline __m256i reconstructAvx2(__m256i r, __m256i& last, __m256i& lastDiff)
+{
+	if (Order == 0)
+		return _mm256_add_epi32(r, last);
+	__m256i top = _mm256_set1_epi32(7);
+	if (Order == 2) {
+		r = _mm256_add_epi32(scanAvx2(r), lastDiff);
+		lastDiff = _mm256_permutevar8x32_epi32(r, top);
+	}
+	__m256i x = _mm256_add_epi32(scanAvx2(r), last);
+	last = _mm256_permutevar8x32_epi32(x, top);
+	return x;
+}
+
+template <int Order>
+struct Avx2Kernel
+{
+	__attribute__((target("avx2")))
+	static void run(const double* data, size_t n, double qf, int* xs, int* residuals,
+			uint8_t* sizes, uint32_t* amps) {
+		__m256d qfs = _mm256_set1_pd(qf);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256d x = roundHalfAwayAvx2(_mm256_mul_pd(_mm256_loadu_pd(data + i), qfs));
+			_mm_storeu_si128((__m128i*)(xs + i + 2), _mm256_cvtpd_epi32(x));
+		}
+		for (; i < n; ++i)
+			xs[i + 2] = (int)lroundFast(data[i] * qf);
+
+		__m256i constant = _mm256_set1_epi32(xs[1]);
+		if (!sizes) {
+			for (i = 0; i + 8 <= n; i += 8)
+				_mm256_storeu_si256((__m256i*)(residuals + i), residualsAvx2<Order>(xs + i, constant));
+		} else {
+			for (i = 0; i + 8 <= n; i += 8) {
+				__m256i r = residualsAvx2<Order>(xs + i, constant);
+				_mm256_storeu_si256((__m256i*)(residuals + i), r);
+				sizeAmpAvx2(r, sizes + i, amps + i);
+			}
+		}
+		scalarResiduals<Order>(xs, i, n, residuals, sizes, amps);
+	}
+
+	__attribute__((target("avx2")))
+	static void reconstruct(const int* residuals, size_t n, double qStep, int prev1, int prev2,
+			int* xs, double* vals) {
+		__m256i last = _mm256_set1_epi32(prev1);
+		__m256i lastDiff = _mm256_set1_epi32((int)((uint32_t)prev1 - (uint32_t)prev2));
+		__m256d qSteps = _mm256_set1_pd(qStep);
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m256i x = reconstructAvx2<Order>(_mm256_loadu_si256((const __m256i*)(residuals + i)),
+					last, lastDiff);
+			_mm256_storeu_si256((__m256i*)(xs + i), x);
+			if (vals) {
+				_mm256_storeu_pd(vals + i, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), qSteps));
+				_mm256_storeu_pd(vals + i + 4,
+						_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), qSteps));
+			}
+		}
+		if (Order && i) {
+			prev1 = xs[i - 1];
+			prev2 = xs[i - 2];
+		}
+		scalarReconstruct<Order>(residuals, i, n, qStep, prev1, prev2, xs, vals);
+	}
+};
+
+void quantizeResidualsAvx2(const double* data, size_t len, double qf, int order, int& prev1,
+		int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps)
+{
+	runKernel<Avx2Kernel>(data, len, qf, order, prev1, prev2, residuals, sizes, amps);
+}
+
+void reconstructResidualsAvx2(const int* residuals, size_t len, double qStep, int order,
+		int& prev1, int& prev2, int* xs, double* vals)
+{
+	runReconstruct<Avx2Kernel>(residuals, len, qStep, order, prev1, prev2, xs, vals);
+}
+#endif // QS_HAVE_X86_KERNELS
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Dispatch
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+static std::vector<CodecKernels> detectCodecKernels()
+{
+	std::vector<CodecKernels> kernels = {
+			{"scalar", quantizeResidualsScalar, reconstructResidualsScalar}};
+#if QS_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		kernels.push_back({"sse4.1", quantizeResidualsSse41, reconstructResidualsSse41});
+	// Also checks the OS saves the AVX registers
+	if (__builtin_cpu_supports("avx2"))
+		kernels.push_back({"avx2", quantizeResidualsAvx2, reconstructResidualsAvx2});
+#endif
+	return kernels;
+}
+
+const std::vector<CodecKernels>& getSupportedCodecKernels()
+{
+	static const std::vector<CodecKernels> kernels = detectCodecKernels(); // Thread safe
+	return kernels;
+}
+
+const CodecKernels& getCodecKernels()
+{
+	static const CodecKernels& best = getSupportedCodecKernels().back();
+	return best;
+}
+
+} // namespace qs
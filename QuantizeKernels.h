@@ -0,0 +1,121 @@
+/*
+ * QuantizeKernels.h
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#ifndef QUANTIZEKERNELS_H_
+#define QUANTIZEKERNELS_H_
+
+#include "utils.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// The SSE4.1 and AVX2 kernels are compiled (with function target attributes) on x86 with gcc/clang
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QS_HAVE_X86_KERNELS 1
+#else
+#define QS_HAVE_X86_KERNELS 0
+#endif
+
+namespace qs {
+
+/*
+ * Size (bit length of |r|) and amplitude (the size lsbs of r, or of r - 1 for r < 0) of a residual,
+ * as SizeIntCoder codes them. INT_MIN has size 32 (which the coders reject).
+ */
+inline void residualSizeAmp(int r, uint8_t& size, uint32_t& amp)
+{
+	uint32_t sign = (uint32_t)(r >> 31); // No branch on the sign
+	uint32_t mag = ((uint32_t)r ^ sign) - sign;
+	size = bitLength(mag);
+	amp = mag ^ ((uint32_t)(((uint64_t)1 << size) - 1) & sign);
+}
+
+/*
+ * Quantize kernels
+ *
+ * Quantize data[0],..,data[len-1] (x = lround(data[n] * qf), which must fit in an int) and write
+ * each residual r = x - prediction to residuals[n], with its size and amplitude (see
+ * residualSizeAmp) to sizes[n] and amps[n]. The prediction is that of a ZeroOrderPredictor (order
+ * 0: prev1), FirstOrderPredictor (order 1: prev1) or SecondOrderPredictor (order 2:
+ * 2*prev1 - prev2), where prev1 and prev2 are the previous two x. For orders 1 and 2 prev1 and
+ * prev2 are updated to the last two x. Throw for any other order. If sizes is null only the
+ * residuals are written (for coders that don't code sizes and amplitudes).
+ *
+ * The SSE4.1 and AVX2 kernels quantize 2 and 4 doubles at a time (rounding halves away from zero
+ * as lround does), and predict and classify 4 and 8 residuals at a time. All the kernels give
+ * exactly the same output, so must only be called on CPUs that have their instruction set.
+ * quantizeResiduals runs the best kernel of the CPU (see getCodecKernels).
+ */
+typedef void QuantizeResidualsKernel(const double* data, size_t len, double qf, int order,
+		int& prev1, int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps);
+
+QuantizeResidualsKernel quantizeResidualsScalar;
+#if QS_HAVE_X86_KERNELS
+QuantizeResidualsKernel quantizeResidualsSse41;
+QuantizeResidualsKernel quantizeResidualsAvx2;
+#endif
+
+
+/*
+ * Reconstruct kernels
+ *
+ * The inverse of the quantize kernels: reconstruct x[n] = residuals[n] + prediction (the
+ * prediction of the same order and prev1, prev2 as the quantize kernels) to xs[n], and unless vals
+ * is null dequantize it to vals[n] = x[n] * qStep, for n = 0,..,len-1. For orders 1 and 2 prev1
+ * and prev2 are updated to the last two x. Throw for any other order. Integer arithmetic wraps,
+ * as the quantize kernels' does, so x[n] is the x residuals[n] was quantized from.
+ *
+ * Order 1 reconstruction is a prefix sum of the residuals and order 2 a prefix sum of a prefix
+ * sum, which the SSE4.1 and AVX2 kernels do 4 and 8 values at a time with log step scans. All
+ * the kernels give exactly the same output. reconstructResiduals runs the best kernel of the CPU
+ * (see getCodecKernels).
+ */
+typedef void ReconstructResidualsKernel(const int* residuals, size_t len, double qStep, int order,
+		int& prev1, int& prev2, int* xs, double* vals);
+
+ReconstructResidualsKernel reconstructResidualsScalar;
+#if QS_HAVE_X86_KERNELS
+ReconstructResidualsKernel reconstructResidualsSse41;
+ReconstructResidualsKernel reconstructResidualsAvx2;
+#endif
+
+
+/*
+ * Kernel dispatch
+ *
+ * The kernels of one instruction set. getCodecKernels returns those of the best instruction set
+ * the CPU has, read from cpuid on the first call, so one binary runs the AVX2 kernels where it
+ * can and the scalar ones on CPUs without SSE4.1. getSupportedCodecKernels returns every set the
+ * CPU can run, scalar first and getCodecKernels last (for tests and benchmarks).
+ */
+struct CodecKernels
+{
+	const char* name; // "scalar", "sse4.1" or "avx2"
+	QuantizeResidualsKernel* quantizeResiduals;
+	ReconstructResidualsKernel* reconstructResiduals;
+};
+
+const CodecKernels& getCodecKernels();
+const std::vector<CodecKernels>& getSupportedCodecKernels();
+
+inline void quantizeResiduals(const double* data, size_t len, double qf, int order, int& prev1,
+		int& prev2, int* residuals, uint8_t* sizes, uint32_t* amps)
+{
+	getCodecKernels().quantizeResiduals(data, len, qf, order, prev1, prev2, residuals, sizes, amps);
+}
+
+inline void reconstructResiduals(const int* residuals, size_t len, double qStep, int order,
+		int& prev1, int& prev2, int* xs, double* vals)
+{
+	getCodecKernels().reconstructResiduals(residuals, len, qStep, order, prev1, prev2, xs, vals);
+}
+
+} // namespace qs
+
+#endif /* QUANTIZEKERNELS_H_ */
@@ -0,0 +1,177 @@
+/*
+ * RangeCoder.h
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#ifndef RANGECODER_H_
+#define RANGECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace qs {
+
+/*
+ * An adaptive binary range coder, as in LZMA. Each bit is coded with an adaptive probability
+ * (of the bit being 0) out of RC_PROB_SCALE, which moves 1/2^RC_ADAPT_SHIFT of the way towards
+ * the coded bit after each bit. Direct bits are coded with probability 1/2 and no adaptation.
+ * The coder keeps low (33 bits, the carry in bit 32) and range; a byte is shifted out whenever
+ * range drops below RC_TOP. Bytes that a carry could still change (a run of 0xFF) are held
+ * back as cache/cacheSize until the carry is known.
+ */
+static const int RC_PROB_BITS = 11;
+static const uint32_t RC_PROB_SCALE = 1u << RC_PROB_BITS;
+static const int RC_ADAPT_SHIFT = 5;
+static const uint32_t RC_TOP = 1u << 24;
+// Bytes flush writes (the first byte written is always 0)
+static const int RC_FLUSH_BYTES = 5;
+
+// RangeCoder parameters of ArithIntCoder (see Coders.h)
+static const int DEFAULT_ARITH_BLOCK_SIZE = 16384;
+static const int MAX_ARITH_BLOCK_SIZE = 65535;
+
+typedef uint16_t RcProb;
+static const RcProb RC_PROB_INIT = RC_PROB_SCALE / 2;
+
+class RangeEncoder
+{
+public:
+    // Appends the bytes to out
+    RangeEncoder(std::vector<uint8_t>& out) : out(out) { reset(); }
+
+    // Starts a new code (after flush)
+    void reset() {
+        low = 0;
+        range = 0xFFFFFFFF;
+        cache = 0;
+        cacheSize = 1;
+    }
+
+    inline void encodeBit(RcProb& prob, int bit) {
+        uint32_t bound = (range >> RC_PROB_BITS) * prob;
+        if (bit == 0) {
+            range = bound;
+            prob += (RC_PROB_SCALE - prob) >> RC_ADAPT_SHIFT;
+        }
+        else {
+            low += bound;
+            range -= bound;
+            prob -= prob >> RC_ADAPT_SHIFT;
+        }
+        while (range < RC_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    // The numBits lsbs of bits, msb first
+    inline void encodeDirectBits(uint32_t bits, int numBits) {
+        for (int n = numBits - 1; n >= 0; --n) {
+            range >>= 1;
+            low += range & (0 - ((bits >> n) & 1));
+            while (range < RC_TOP) {
+                range <<= 8;
+                shiftLow();
+            }
+        }
+    }
+
+    // Writes RC_FLUSH_BYTES bytes, after which the encoder must be reset
+    void flush() {
+        for (int n = 0; n < RC_FLUSH_BYTES; ++n)
+            shiftLow();
+    }
+
+private:
+    inline void shiftLow() {
+        if ((uint32_t)low < 0xFF000000u || (low >> 32) != 0) {
+            uint8_t carry = (uint8_t)(low >> 32);
+            uint8_t temp = cache;
+            do {
+                out.push_back((uint8_t)(temp + carry));
+                temp = 0xFF;
+            } while (--cacheSize != 0);
+            cache = (uint8_t)(low >> 24);
+        }
+        cacheSize++;
+        low = (low & 0x00FFFFFF) << 8;
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache;
+    uint64_t cacheSize;
+};
+
+/*
+ * Decodes the bytes of a RangeEncoder. Reads at most one byte per bit past the RC_FLUSH_BYTES
+ * it starts with, and doesn't check for the end of the bytes, so callers check between values
+ * (see getPos) and pad the bytes.
+ */
+class RangeDecoder
+{
+public:
+    RangeDecoder() : ptr(NULL), range(0), code(0) {}
+
+    // Starts decoding the code at bytes
+    void start(const uint8_t* bytes) {
+        ptr = bytes;
+        range = 0xFFFFFFFF;
+        code = 0;
+        for (int n = 0; n < RC_FLUSH_BYTES; ++n)
+            code = (code << 8) | *ptr++;
+    }
+
+    inline int decodeBit(RcProb& prob) {
+        uint32_t bound = (range >> RC_PROB_BITS) * prob;
+        int bit;
+        if (code < bound) {
+            range = bound;
+            prob += (RC_PROB_SCALE - prob) >> RC_ADAPT_SHIFT;
+            bit = 0;
+        }
+        else {
+            code -= bound;
+            range -= bound;
+            prob -= prob >> RC_ADAPT_SHIFT;
+            bit = 1;
+        }
+        if (range < RC_TOP) {
+            range <<= 8;
+            code = (code << 8) | *ptr++;
+        }
+        return bit;
+    }
+
+    inline uint32_t decodeDirectBits(int numBits) {
+        uint32_t bits = 0;
+        for (int n = 0; n < numBits; ++n) {
+            range >>= 1;
+            uint32_t bit = code >= range;
+            code -= range & (0 - bit);
+            bits = (bits << 1) | bit;
+            if (range < RC_TOP) {
+                range <<= 8;
+                code = (code << 8) | *ptr++;
+            }
+        }
+        return bits;
+    }
+
+    const uint8_t* getPos() const { return ptr; }
+
+private:
+    const uint8_t* ptr;
+    uint32_t range;
+    uint32_t code;
+};
+
+} // namespace qs
+
+#endif /* RANGECODER_H_ */
@@ -0,0 +1,166 @@
+/*
+ * Rans.h
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#ifndef RANS_H_
+#define RANS_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace qs {
+
+/*
+ * rANS (range asymmetric numeral systems) primitives, see e.g. J. Duda, "Asymmetric numeral
+ * systems", and F. Giesen's ryg_rans. The state x is kept in [RANS_L, RANS_L << 16) and is
+ * renormalized 16 bits (a word) at a time. As RANS_PROB_BITS <= 15 one word always suffices, so
+ * renormalization is a single conditional step without a loop, which several interleaved states
+ * can do side by side without branching. Symbol s has frequency freq[s] out of RANS_PROB_SCALE,
+ * and cumulative frequency start[s] (the sum of freq[t] for t < s).
+ *
+ * The encoder codes symbols in reverse order, writing words backwards (from the end of a buffer),
+ * so the decoder can decode them in forward order reading words forwards.
+ */
+static const int RANS_PROB_BITS = 12;
+static const uint32_t RANS_PROB_SCALE = 1u << RANS_PROB_BITS;
+static const uint32_t RANS_L = 1u << 15; // So x < 1 << 31, as RansEncSymbol needs
+
+// RansIntCoder (see Coders.h) parameters
+static const int DEFAULT_RANS_BLOCK_SIZE = 4096;
+static const int MAX_RANS_BLOCK_SIZE = 65535;
+static const int DEFAULT_RANS_STATES = 4;
+
+/*
+ * A symbol's encoding parameters. Encoding divides x by freq, which RansEncSymbol replaces by a
+ * multiplication by a (fixed point) reciprocal, as in ryg_rans: q = x / freq is
+ * (x * rcpFreq) >> (32 + rcpShift), and x = ((x / freq) << RANS_PROB_BITS) + x % freq + start
+ * is x + bias + q * cmplFreq.
+ */
+struct RansEncSymbol {
+    uint32_t xMax;     // x is renormalized to below xMax before coding the symbol
+    uint32_t rcpFreq;
+    uint32_t bias;
+    uint16_t cmplFreq; // RANS_PROB_SCALE - freq
+    uint16_t rcpShift;
+};
+
+inline RansEncSymbol ransEncSymbol(uint32_t start, uint32_t freq)
+{
+    RansEncSymbol sym;
+    sym.xMax = ((RANS_L >> RANS_PROB_BITS) << 16) * freq;
+    sym.cmplFreq = (uint16_t)(RANS_PROB_SCALE - freq);
+    if (freq < 2) {
+        // q = x, so x + bias + x * (RANS_PROB_SCALE - 1) = (x << RANS_PROB_BITS) + start
+        sym.rcpFreq = ~0u;
+        sym.rcpShift = 0;
+        sym.bias = start + RANS_PROB_SCALE - 1;
+    }
+    else {
+        uint32_t shift = 0;
+        while (freq > (1u << shift))
+            shift++;
+        sym.rcpFreq = (uint32_t)(((1ull << (shift + 31)) + freq - 1) / freq);
+        sym.rcpShift = shift - 1;
+        sym.bias = start;
+    }
+    return sym;
+}
+
+// Codes a symbol. ptr points to the last word written, and moves backwards.
+inline void ransEncode(uint32_t& x, uint16_t*& ptr, const RansEncSymbol& sym)
+{
+    if (x >= sym.xMax) {
+        *--ptr = (uint16_t)x;
+        x >>= 16;
+    }
+    uint32_t q = (uint32_t)(((uint64_t)x * sym.rcpFreq) >> 32) >> sym.rcpShift;
+    x += sym.bias + q * sym.cmplFreq;
+}
+
+// Writes the final state (2 words, high word first in decode order)
+inline void ransEncodeFlush(uint32_t x, uint16_t*& ptr)
+{
+    *--ptr = (uint16_t)x;
+    *--ptr = (uint16_t)(x >> 16);
+}
+
+inline uint32_t ransDecodeInit(const uint16_t*& ptr)
+{
+    uint32_t x = ((uint32_t)ptr[0] << 16) | ptr[1];
+    ptr += 2;
+    return x;
+}
+
+// The slot (cumulative frequency) of the next symbol, which identifies it
+inline uint32_t ransDecodeSlot(uint32_t x)
+{
+    return x & (RANS_PROB_SCALE - 1);
+}
+
+/*
+ * Removes the symbol with start and freq (found from ransDecodeSlot) from x and renormalizes.
+ * Reads *ptr whether or not it is needed (so the compiler can use a conditional move), so the
+ * words must be followed by at least one word of padding.
+ */
+inline void ransDecodeAdvance(uint32_t& x, const uint16_t*& ptr, uint32_t start, uint32_t freq)
+{
+    x = freq * (x >> RANS_PROB_BITS) + (x & (RANS_PROB_SCALE - 1)) - start;
+    uint32_t renorm = x < RANS_L;
+    uint32_t word = *ptr;
+    x = renorm ? (x << 16) | word : x;
+    ptr += renorm;
+}
+
+/*
+ * Scales counts to frequencies summing to RANS_PROB_SCALE, keeping every non zero count non
+ * zero. The rounding error is taken from (or given to) the most frequent symbol. counts must
+ * have at least one and at most RANS_PROB_SCALE non zero counts.
+ */
+inline std::vector<uint32_t> ransNormalize(const std::vector<uint32_t>& counts)
+{
+    uint64_t total = 0;
+    size_t maxSymbol = 0;
+    for (size_t s = 0; s < counts.size(); ++s) {
+        total += counts[s];
+        if (counts[s] > counts[maxSymbol])
+            maxSymbol = s;
+    }
+    if (total == 0)
+        throw std::logic_error("ransNormalize: no counts");
+    std::vector<uint32_t> freqs(counts.size(), 0);
+    int64_t sum = 0;
+    for (size_t s = 0; s < counts.size(); ++s) {
+        if (counts[s] == 0)
+            continue;
+        freqs[s] = (uint32_t)((counts[s] * (uint64_t)RANS_PROB_SCALE) / total);
+        if (freqs[s] == 0)
+            freqs[s] = 1;
+        sum += freqs[s];
+    }
+    int64_t excess = sum - RANS_PROB_SCALE;
+    // The most frequent symbol has at least RANS_PROB_SCALE/counts.size() before the adjustment,
+    // more than the excess when counts.size() is small (as here, sizes). Otherwise take the
+    // excess off all symbols with more than 1.
+    for (size_t s = maxSymbol; excess != 0; s = (s + 1) % counts.size()) {
+        if (excess < 0) {
+            freqs[s] += (uint32_t)-excess;
+            excess = 0;
+        }
+        else if (freqs[s] > 1) {
+            uint32_t take = (uint32_t)std::min<int64_t>(excess, freqs[s] - 1);
+            freqs[s] -= take;
+            excess -= take;
+        }
+    }
+    return freqs;
+}
+
+} // namespace qs
+
+#endif /* RANS_H_ */
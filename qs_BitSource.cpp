@@ -7,87 +7,108 @@
 
 #include "qs_BitSource.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
 #include <vector>
 
 using std::vector;
 
 namespace qs {
 
-BitSource::BitSource(std::shared_ptr<ByteSource> byteSource)
+const size_t BitSource::DEFAULT_BUFFER_SIZE;
+const size_t BitSource::MIN_BUFFER_SIZE;
+
+BitSource::BitSource(std::shared_ptr<ByteSource> byteSource, size_t bufferSize)
 	: byteSource(byteSource),
-	  byteBuf(vector<uint8_t>(4,0)), // Needs to be at least 4 bytes long so that updateBitBuf doens't access invalid memory.
+	  byteBuf(vector<uint8_t>(std::max(bufferSize, MIN_BUFFER_SIZE), 0)),
+	  bytes(&byteBuf[0]),
 	  bitBuf(0),
-	  bitOffset(0),
-	  availableBits(0),
+	  bitCount(0),
 	  byteOffset(0),  // Start of used part of byteBuf
 	  endOffset(0)
 {
+	size_t len;
+	const uint8_t* span = byteSource->getSpan(len);
+	if (span) {
+		spanSource = byteSource;
+		this->byteSource.reset();
+		bytes = span;
+		endOffset = len;
+		vector<uint8_t>().swap(byteBuf);
+	}
 	getBytes();
+	refill();
+}
+
+BitSource::BitSource(const uint8_t* data, size_t len)
+	: bytes(data),
+	  bitBuf(0),
+	  bitCount(0),
+	  byteOffset(0),
+	  endOffset(len)
+{
+	refill();
+}
+
+/*
+ * Refill bitBuf a byte at a time, as there are less than 8 bytes left in bytes, first topping up
+ * bytes from byteSource.
+ */
+void BitSource::refillTail()
+{
+	getBytes();
+	if (endOffset - byteOffset >= 8) {
+		refill();
+		return;
+	}
+	while (bitCount <= 56 && byteOffset < endOffset) {
+		bitBuf |= (uint64_t)bytes[byteOffset++] << (56 - bitCount);
+		bitCount += 8;
+	}
 }
 
 // Put any remaining bytes in byteBuf at the start
 void BitSource::rotateRemainingBytes()
 {
-	int remainingBytes = endOffset - byteOffset;
-	int n = 0;
-	while(remainingBytes > 0) {
-		byteBuf[n] = byteBuf[endOffset - remainingBytes];
-		n++;
-		remainingBytes--;
-	}
+	size_t remainingBytes = endOffset - byteOffset;
+	if (remainingBytes > 0 && byteOffset > 0)
+		memmove(&byteBuf[0], &byteBuf[byteOffset], remainingBytes);
 	byteOffset = 0;
-	endOffset = n;
+	endOffset = remainingBytes;
 }
 
 /*!
+ * Tops up byteBuf from byteSource, reading until byteBuf is full or byteSource has no more
+ * bytes (for now).
  */
 void BitSource::getBytes()
 {
+	if (!byteSource) // Reading from a span: there are no more bytes to get
+		return;
 	rotateRemainingBytes();
-	const vector<uint8_t>& bytes = byteSource->getBytes();
-	byteBuf.insert(byteBuf.begin() + endOffset, bytes.begin(), bytes.end());
-	endOffset += bytes.size();
-    if (availableBits < 32)
-        updateBitBuf();
-    availableBits = ((endOffset - byteOffset) << 3) - bitOffset;
-
-    // If this fails, then the caller has probably consumed beyond the available bits.
-    if (availableBits < 0)
-        throw std::logic_error("availableBits < 0");
+	size_t numRead;
+	while (endOffset < byteBuf.size() &&
+		   (numRead = byteSource->read(&byteBuf[endOffset], byteBuf.size() - endOffset)) > 0) {
+		endOffset += numRead;
+	}
 }
 
-/*!
- * Consume the specified number of bits, updating the bit byteBuf.
- */
-void BitSource::consume(int size)
+size_t ByteSource::read(uint8_t* dst, size_t maxLen)
 {
-    if (size > availableBits) {
-        getBytes();
-    }
-    if (size > 25) {
-    	int extra = size - 25;
-    	consume(extra);
-    	size = 25;
-    }
-    bitOffset += size;
-	availableBits -= size;
-    int byteAdvance = bitOffset >> 3;
-    if (byteAdvance != 0) {
-        bitOffset &= 0x07; // Keep bitOffset in range [0,7]
-        byteOffset += byteAdvance;
-        // Ensure we are looking ahead at least 4 bytes, if possible, so we can fully populate our bit byteBuf.
-        int lookingAhead = (int)endOffset - byteOffset;
-        if (lookingAhead < 4) {
-        	getBytes(); // pull model
-        }
-		updateBitBuf();
-    }
-    else {
-        bitBuf <<= size;
-    }
-	// Caller must make sure not consuming more bits than are actually available otherwise this assertion will fail.
-	if (availableBits < 0)
-		throw std::logic_error("availableBits < 0");
+	if (pendingLen == 0) {
+		const vector<uint8_t>& chunk = getBytes();
+		if (chunk.empty())
+			return 0;
+		pending = &chunk[0];
+		pendingLen = chunk.size();
+	}
+	size_t len = std::min(maxLen, pendingLen);
+	memcpy(dst, pending, len);
+	pending += len;
+	pendingLen -= len;
+	return len;
 }
 
 } // namespace qs
@@ -8,9 +8,14 @@
 #ifndef TNZ_BITSOURCE_H_
 #define TNZ_BITSOURCE_H_
 
+#include "utils.h"
+
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include <memory>
+#include <stdexcept>
 #include <vector>
 
 namespace qs {
@@ -20,80 +25,148 @@ class ByteSource;
 /*
  * BitSource
  *
- * A cache of the next bytes in the bitstream are stored in byteBuf. A cache of the next (up to 32)
- * bits in the bitstream are (also) stored in bitBuf. The bits are stored
+ * A cache of the next bytes in the bitstream are pointed to by bytes. A reservoir of the next
+ * bitCount bits in the bitstream are (also) stored in the 64 bit bitBuf. The bits are stored
  * in order from the msb in bitBuf: that is the 0th (next) bit in the bitstream
  * is in the msb of bifBuf, the 1st bit in msb-1, the 2nd bit in msb-2 etc.
- * byteOffset is a pointer into byteBuf to the first (remaining) byte in byteBuf and endOffset
- * one past the last byte. bitOffset is a pointer to the first (remaining) bit in the first byte
- * (byteOffset in byteBuf) - noting some bits in this byte may be stale - that is already consumed.
+ * byteOffset is a pointer into bytes to the first byte not yet (fully) loaded into bitBuf and
+ * endOffset one past the last byte. Bits in bitBuf after the first bitCount bits are either zero
+ * or (partly loaded) bits of bytes[byteOffset], so reloading that byte can just OR it in again.
+ *
+ * refill tops bitBuf up to at least FAST_ZONE_BITS bits (when the bitstream has them) with a
+ * single unaligned big endian load of 8 bytes, falling back to byte at a time loads near the end
+ * of bytes. Inner decode loops can call refill once per value and, when it returns at least
+ * FAST_ZONE_BITS, use peekFast and consumeFast without any further checks. peek and consume do
+ * their own (lazy) refill.
+ *
+ * When constructed from a ByteSource, bytes points at byteBuf, a fixed size buffer holding the
+ * bytes pulled from the ByteSource. Refills move the (few) unconsumed bytes to the start of
+ * byteBuf and then read as many bytes as fit after them, so memory use does not grow with the
+ * length of the stream. When constructed from a (data, len) span bytes points straight at the
+ * caller's memory (e.g. an mmapped region) and nothing is copied. The 8 byte load is only used
+ * when there are at least 8 bytes before endOffset, so refill never reads past endOffset.
  */
 class BitSource
 {
 public:
-	BitSource(std::shared_ptr<ByteSource> byteSource);
+	static const size_t DEFAULT_BUFFER_SIZE = 64*1024;
+	static const size_t MIN_BUFFER_SIZE = 8;
+	// byteBuf is allocated once with bufferSize bytes, which is the most memory the BitSource uses.
+	// If byteSource has a span (see ByteSource::getSpan) it is read in place instead.
+	BitSource(std::shared_ptr<ByteSource> byteSource, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+	// data[0], data[1],..,data[len-1] must stay valid (and unchanged) for the life of the BitSource
+	BitSource(const uint8_t* data, size_t len);
+
+	// Number of bits that may be peeked/consumed at once
+	static const int FAST_ZONE_BITS = 57;
 
     inline int getAvailableBits() {
-        return availableBits;
+        if (endOffset - byteOffset < 8)
+            getBytes();
+        int64_t availableBits = bitCount + ((int64_t)(endOffset - byteOffset) << 3);
+        return availableBits > INT_MAX ? INT_MAX : (int)availableBits;
+    }
+
+    // Returns the number of bits in bitBuf, which is at least FAST_ZONE_BITS unless near the end
+    // of the bitstream.
+    inline int refill() {
+        if (bitCount <= 56) {
+            if (endOffset - byteOffset >= 8) {
+                bitBuf |= loadBigEndian64(bytes + byteOffset) >> bitCount;
+                int byteAdvance = (64 - bitCount) >> 3;
+                byteOffset += byteAdvance;
+                bitCount += byteAdvance << 3;
+            }
+            else {
+                refillTail();
+            }
+        }
+        return bitCount;
+    }
+
+    // No checks: size <= the number of bits returned by the last refill (less those consumed since)
+    inline uint64_t peekFast(int size) {
+        return (bitBuf >> 1) >> (63 - size); // Next bit is bit 63 (the msb) in bitBuf
     }
-    void consume(int numBits);
-    // peek up to 25 bits
-    inline uint32_t peek(int size) {
-    	assert(size <= 25); // bitBuf may not hold more than 25 valid bits - see updateBitBuf
-        if (size == 0)
-            return 0;
-        else
-            return bitBuf >> (32-size); // Next bit is bit 31 (the msb) in bitBuf
+    inline void consumeFast(int size) {
+        bitBuf <<= size;
+        bitCount -= size;
     }
+
+    // peek up to FAST_ZONE_BITS bits, zero padded past the end of the bitstream
+    inline uint64_t peek(int size) {
+    	assert(size >= 0 && size <= FAST_ZONE_BITS);
+        if (size > bitCount)
+            refill();
+        return peekFast(size);
+    }
+    // Consume up to FAST_ZONE_BITS bits
+    inline void consume(int size) {
+    	assert(size >= 0 && size <= FAST_ZONE_BITS);
+        if (size > bitCount) {
+            // Caller must make sure not consuming more bits than are actually available
+            if (size > refill())
+                throw std::logic_error("availableBits < 0");
+        }
+        consumeFast(size);
+    }
+
     inline uint32_t pop25(int size)
     {
         assert(size <= 25);
-        uint32_t value = peek(size);
-        consume(size);
-        return value;
+        return pop(size);
     }
 
+    // pop up to 32 bits
     uint32_t pop(int size)
     {
-        if (size <= 25)
-            return pop25(size);
-        else {
-            int extra = size - 25;
-            uint32_t value = pop25(25) << extra;
-            return value | pop25(extra);
-        }
+        assert(size <= 32);
+        uint32_t value = (uint32_t)peek(size);
+        consume(size);
+        return value;
     }
 
 private:
-	// updateBitBuf fills at least 25 valid bits into bitBuff (assuming bitOffset <= 7)
-    inline void updateBitBuf()
-    {
-        bitBuf =
-            (((uint32_t)byteBuf[byteOffset]   << 24) |
-             ((uint32_t)byteBuf[byteOffset+1] << 16) |
-             ((uint32_t)byteBuf[byteOffset+2] <<  8) |
-              (uint32_t)byteBuf[byteOffset+3] <<  0) << bitOffset;
-    }
+    void refillTail();
     void getBytes();
     void rotateRemainingBytes();
 
 private:
-	std::shared_ptr<ByteSource> byteSource;
-	std::vector<uint8_t> byteBuf; // byte buffer
-    uint32_t bitBuf;   // 4 byte cache of next bits
-    int bitOffset;     // Offset of the next bit in the first byte in byteBuf
-    int availableBits; // Number of bits left in bitstream
-    int byteOffset;    // Pointer to first (current) byte in byteBuf
-    int endOffset;     // Pointer to one past the last byte in byteBuf
-    // (i.e. byteBuf[byteOffset], byteBuf[byteOffset+1],.., byteBuf[endOffset-1] are the current bytes in byteBuf
+	std::shared_ptr<ByteSource> byteSource; // null when reading from a span
+	std::shared_ptr<ByteSource> spanSource; // keeps a ByteSource's span alive
+	std::vector<uint8_t> byteBuf; // fixed size byte buffer
+	const uint8_t* bytes; // byteBuf.data() or the caller owned span
+    uint64_t bitBuf;   // 8 byte reservoir of next bits
+    int bitCount;      // Number of valid bits in bitBuf
+    size_t byteOffset;    // Pointer to first byte in bytes not loaded into bitBuf
+    size_t endOffset;     // Pointer to one past the last byte in bytes
+    // (i.e. bytes[byteOffset], bytes[byteOffset+1],.., bytes[endOffset-1] are the current bytes
 };
 
 class ByteSource
 {
 public:
+	ByteSource() : pending(NULL), pendingLen(0) {}
 	virtual ~ByteSource() {}
 
+	// Returns the next chunk of bytes (empty if none are available yet). The returned vector
+	// need only stay valid until the next call.
     virtual const std::vector<uint8_t>& getBytes() = 0;
+    /*
+     * Copies up to maxLen of the next bytes into dst, returning the number of bytes copied (0 if
+     * no bytes are available yet). The default implementation hands out the getBytes() chunks
+     * piece by piece, so chunks can be bigger than the reader's buffer.
+     */
+    virtual size_t read(uint8_t* dst, size_t maxLen);
+    /*
+     * Sources that hold the whole bitstream in (stable) memory, e.g. a memory mapped file, return
+     * it here so a BitSource can read it in place. Returns NULL (the default) otherwise.
+     */
+    virtual const uint8_t* getSpan(size_t& len) { len = 0; return NULL; }
+
+private:
+    const uint8_t* pending; // Remaining bytes of the last getBytes() chunk
+    size_t pendingLen;
 };
 
 class ByteBuffer : public ByteSource
@@ -0,0 +1,197 @@
+/*
+ * qs_MappedFile.cpp
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#include "qs_MappedFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace qs {
+
+static void throwErrno(const string& what, const string& path)
+{
+	std::ostringstream oss;
+	oss<<what<<" "<<path<<": "<<strerror(errno);
+	throw std::logic_error(oss.str());
+}
+
+/********************************************************************************
+ *
+ *
+ *
+ *
+ * MappedFileByteSink
+ *
+ *
+ *
+ *
+ *
+ ********************************************************************************/
+const size_t MappedFileByteSink::DEFAULT_INITIAL_SIZE;
+
+MappedFileByteSink::MappedFileByteSink(const std::string& path, size_t initialSize, bool sequential)
+	: path(path),
+	  fd(-1),
+	  mapped(NULL),
+	  capacity(0),
+	  size(0),
+	  sequential(sequential)
+{
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throwErrno("MappedFileByteSink: can't open", path);
+	map(std::max(initialSize, (size_t)1));
+}
+
+// Closes an unclosed sink. A failure is only reported by an explicit close()
+MappedFileByteSink::~MappedFileByteSink()
+{
+	try {
+		close();
+	}
+	catch (const std::exception&) {
+	}
+}
+
+/*
+ * Grows the file to newCapacity bytes and (re)maps it. On Linux mremap can usually extend the
+ * mapping in place, and if it fails the old mapping (and the bytes received) stays.
+ */
+void MappedFileByteSink::map(size_t newCapacity)
+{
+	if (ftruncate(fd, newCapacity) != 0)
+		throwErrno("MappedFileByteSink: can't size", path);
+	void* p;
+#ifdef MREMAP_MAYMOVE
+	if (mapped)
+		p = mremap(mapped, capacity, newCapacity, MREMAP_MAYMOVE);
+	else
+		p = mmap(NULL, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#else
+	if (mapped) {
+		munmap(mapped, capacity);
+		mapped = NULL;
+		capacity = 0;
+	}
+	p = mmap(NULL, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+	if (p == MAP_FAILED)
+		throwErrno("MappedFileByteSink: can't map", path);
+	mapped = (uint8_t*)p;
+	capacity = newCapacity;
+	if (sequential)
+		madvise(mapped, capacity, MADV_SEQUENTIAL);
+}
+
+void MappedFileByteSink::receive(const uint8_t* data, int len)
+{
+	if (fd < 0)
+		throw std::logic_error("MappedFileByteSink: receive after close");
+	if (size + len > capacity) {
+		size_t newCapacity = std::max(capacity, (size_t)1); // 0 after a failed (re)map
+		while (size + len > newCapacity)
+			newCapacity *= 2;
+		map(newCapacity);
+	}
+	memcpy(mapped + size, data, len);
+	size += len;
+}
+
+void MappedFileByteSink::close()
+{
+	if (fd < 0)
+		return;
+	if (mapped)
+		munmap(mapped, capacity);
+	mapped = NULL;
+	int err = ftruncate(fd, size);
+	::close(fd);
+	fd = -1;
+	if (err != 0)
+		throwErrno("MappedFileByteSink: can't truncate", path);
+}
+
+/********************************************************************************
+ *
+ *
+ *
+ *
+ * MappedFileByteSource
+ *
+ *
+ *
+ *
+ *
+ ********************************************************************************/
+const size_t MappedFileByteSource::DEFAULT_CHUNK_SIZE;
+
+MappedFileByteSource::MappedFileByteSource(const std::string& path, bool sequential, size_t chunkSize)
+	: path(path),
+	  mapped(NULL),
+	  size(0),
+	  offset(0),
+	  chunkSize(std::max(chunkSize, (size_t)1))
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throwErrno("MappedFileByteSource: can't open", path);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		throwErrno("MappedFileByteSource: can't stat", path);
+	}
+	size = st.st_size;
+	if (size > 0) { // Can't map an empty file
+		void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			throwErrno("MappedFileByteSource: can't map", path);
+		}
+		mapped = (const uint8_t*)p;
+		if (sequential)
+			madvise(p, size, MADV_SEQUENTIAL);
+	}
+	::close(fd); // The mapping stays valid
+}
+
+MappedFileByteSource::~MappedFileByteSource()
+{
+	if (mapped)
+		munmap((void*)mapped, size);
+}
+
+const std::vector<uint8_t>& MappedFileByteSource::getBytes()
+{
+	size_t len = std::min(chunkSize, size - offset);
+	chunk.assign(mapped + offset, mapped + offset + len);
+	offset += len;
+	return chunk;
+}
+
+size_t MappedFileByteSource::read(uint8_t* dst, size_t maxLen)
+{
+	size_t len = std::min(maxLen, size - offset);
+	if (len > 0)
+		memcpy(dst, mapped + offset, len);
+	offset += len;
+	return len;
+}
+
+} // namespace qs
@@ -0,0 +1,90 @@
+/*
+ * qs_MappedFile.h
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+
+#ifndef QS_MAPPEDFILE_H_
+#define QS_MAPPEDFILE_H_
+
+#include "BitSink.h"
+#include "qs_BitSource.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace qs {
+
+/*
+ * MappedFileByteSink
+ *
+ * A ByteSink that writes straight into a memory mapped file. The file is pre-sized to
+ * initialSize bytes and grown (by doubling) by remapping when full. close() truncates the file
+ * to the number of bytes received. The destructor closes an unclosed sink but can't report a
+ * failure, so call close() to find out whether the file was written.
+ */
+class MappedFileByteSink : public ByteSink
+{
+public:
+	static const size_t DEFAULT_INITIAL_SIZE = 1024*1024;
+
+	MappedFileByteSink(const std::string& path, size_t initialSize = DEFAULT_INITIAL_SIZE,
+			bool sequential = true);
+	virtual ~MappedFileByteSink();
+
+	virtual void receive(const uint8_t* data, int len);
+	virtual void close();
+
+	size_t getSize() const { return size; }
+
+private:
+	void map(size_t newCapacity);
+
+private:
+	std::string path;
+	int fd;
+	uint8_t* mapped;
+	size_t capacity; // mapped (and file) size
+	size_t size;     // bytes received
+	bool sequential; // madvise(MADV_SEQUENTIAL) hint
+};
+
+/*
+ * MappedFileByteSource
+ *
+ * A ByteSource over a memory mapped file. getData() and getSize() give the whole file, so it can
+ * be read without any copying with BitSource(getData(), getSize()). A BitSource constructed with
+ * the MappedFileByteSource itself does the same (see ByteSource::getSpan). getBytes() and read()
+ * copy the file out a chunk at a time.
+ */
+class MappedFileByteSource : public ByteSource
+{
+public:
+	static const size_t DEFAULT_CHUNK_SIZE = 64*1024;
+
+	MappedFileByteSource(const std::string& path, bool sequential = true,
+			size_t chunkSize = DEFAULT_CHUNK_SIZE);
+	virtual ~MappedFileByteSource();
+
+	virtual const std::vector<uint8_t>& getBytes();
+	virtual size_t read(uint8_t* dst, size_t maxLen);
+	virtual const uint8_t* getSpan(size_t& len) { len = size; return mapped; }
+
+	const uint8_t* getData() const { return mapped; }
+	size_t getSize() const { return size; }
+
+private:
+	std::string path;
+	const uint8_t* mapped;
+	size_t size;
+	size_t offset; // Next byte for getBytes/read
+	size_t chunkSize;
+	std::vector<uint8_t> chunk;
+};
+
+} // namespace qs
+
+#endif /* QS_MAPPEDFILE_H_ */
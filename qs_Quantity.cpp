@@ -7,16 +7,24 @@
 
 #include "BitSink.h"
 #include "Coders.h"
+#include "Decoders.h"
+#include "HuffmanCoder.h"
+#include "HuffmanDecoder.h"
 #include "HuffmanTable.h"
+#include "qs_BitSource.h"
 #include "qs_Quantity.h"
+#include "qs_StdQuantityTables.h"
 #include "utils.h"
 
 #include "math.h"
 #include "stdint.h"
 
+#include <algorithm>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -137,7 +145,7 @@ const char** getStdQuantities()
             "acceleration.z",
             "distance",
             "gps_speed",
-			"wheel_based_speed"
+			"wheel_based_speed",
             "ignition",
             "rpm",
             "fuel",
@@ -165,7 +173,7 @@ const char** getStdQuantities()
 }
 
 const uint8_t STD_QUANTITY_NOT_PRESENT=255;
-uint8_t getStdChannelIdx(const std::string& name)
+uint8_t getStdQuantityIdx(const std::string& name)
 {
     const char** channelZip = getStdQuantities();
     uint8_t idx = STD_QUANTITY_NOT_PRESENT;
@@ -180,6 +188,18 @@ uint8_t getStdChannelIdx(const std::string& name)
     return idx;
 }
 
+const HuffmanTable* getStdQuantityHuffmanTable(uint8_t stdIdx)
+{
+    if (stdIdx >= NUM_STD_QUANTITY_TABLES || STD_QUANTITY_TRAINING_VALUES[stdIdx] == 0)
+        return NULL;
+    return &STD_QUANTITY_HUFFMAN_TABLES[stdIdx];
+}
+
+uint8_t getStdQuantityTablesVersion()
+{
+    return STD_QUANTITY_TABLES_VERSION;
+}
+
 /*
  * ToDo.
  *   1. Adapt default QStep's to standard quantities
@@ -253,7 +273,7 @@ QStep getDefaultQStep(uint8_t defIdx)
 //    return QStep(0, -1);
 //}
 
-static double qStepToDouble(const QStep& qStep)
+double qStepToDouble(const QStep& qStep)
 {
     return (double)(1 + qStep.sig/256.0) * pow(2.0,qStep.exp);
 }
@@ -315,17 +335,34 @@ extern std::ostream& operator<<(std::ostream& os, const std::vector<QuantityInfo
  *
  *
  ********************************************************************************/
-QuantitiesSequence::QuantitiesSequence(const std::vector<QuantityInfo>& qInfos)
+const int QuantitiesSequence::BLOCK_SIZE;
+const int QuantitiesSequence::EXPLICIT_TABLE;
+const int QuantitiesSequence::ADAPTIVE_TABLE;
+const int QuantitiesSequence::CONTEXT_TABLES;
+const int QuantitiesSequence::SELECTED_PREDICTORS;
+
+QuantitiesSequence::QuantitiesSequence(const std::vector<QuantityInfo>& qInfos, Mode mode,
+		bool selectPredictors)
 	: qInfos(qInfos),
-	  numVals(0)
+	  mode(mode),
+	  selectPredictors(selectPredictors),
+	  intCoders(qInfos.size()),
+	  intPredictors(qInfos.size()),
+	  blocks(qInfos.size()),
+	  numVals(0),
+	  finished(false)
 {
-	HuffmanTable table = getDefaultHuffmanTable();
-	for (const auto& i : qInfos) {
-		qMuls.push_back(qStepToDouble(i.qStep));
-		intCoders.push_back(shared_ptr<IntCoder>(getSizeIntCoder(table)));
-		intPredictors.push_back(shared_ptr<IntPredictor>(getIntPredictor(2, 0, 0)));
+	// BitSinks flush when destroyed, so all are made (and copied) before any are written to
+	bitSinks.reserve(qInfos.size());
+	for (unsigned n = 0; n < qInfos.size(); ++n) {
+		qFactors.push_back(1.0/qStepToDouble(qInfos[n].qStep));
 		byteSinks.push_back(shared_ptr<ByteBufferSink>(new ByteBufferSink()));
 		bitSinks.push_back(BitSink(byteSinks.back()));
+		blocks[n].reserve(BLOCK_SIZE);
+	}
+	if (mode != OPTIMIZE) {
+		for (unsigned n = 0; n < qInfos.size(); ++n)
+			startQuantity(n, mode == ADAPTIVE ? ADAPTIVE_TABLE : 0, {getBuiltinHuffmanTable(0)});
 	}
 }
 
@@ -333,30 +370,265 @@ QuantitiesSequence::~QuantitiesSequence()
 {
 }
 
+// Writes the table field (and tables) of quantity n's bitstream and makes its coder
+void QuantitiesSequence::startQuantity(unsigned n, int tableId, const std::vector<HuffmanTable>& tables)
+{
+	if (selectPredictors)
+		bitSinks[n].receive(SELECTED_PREDICTORS, 8);
+	bitSinks[n].receive(tableId, 8);
+	if (tableId == EXPLICIT_TABLE || tableId == CONTEXT_TABLES) {
+		for (const auto& table : tables)
+			writeCompactHuffmanTable(bitSinks[n], table);
+	}
+	if (tableId == ADAPTIVE_TABLE)
+		intCoders[n].reset(getAdaptiveSizeIntCoder(tables[0]));
+	else if (tableId == CONTEXT_TABLES)
+		intCoders[n].reset(getContextSizeIntCoder(tables));
+	else
+		intCoders[n].reset(getSizeIntCoder(tables[0]));
+	intPredictors[n].reset(selectPredictors ? new SelectablePredictor() : getIntPredictor(2, 0, 0));
+}
+
 void QuantitiesSequence::push(const std::vector<double>& quantities)
 {
-	for (unsigned n = 0; n < quantities.size(); ++n) {
-        int x = lround(quantities[n] * qMuls[n]);
-        intCoders[n]->code(bitSinks[n], x - intPredictors[n]->predict());
-        intPredictors[n]->update(x);
+	if (finished)
+		throw std::logic_error("QuantitiesSequence::push: push after getCode");
+	if (quantities.size() != qInfos.size())
+		throw std::logic_error("QuantitiesSequence::push: wrong number of quantities");
+	for (unsigned n = 0; n < quantities.size(); ++n)
+		blocks[n].push_back(quantities[n]);
+	numVals++;
+	if (mode != OPTIMIZE && blocks[0].size() == (size_t)BLOCK_SIZE)
+		codeBlocks();
+}
+
+/*
+ * Codes len values a QuantitiesSequence::BLOCK_SIZE block at a time, each with the order
+ * predictor selects for it, written before the block unless writeOrders is false (for a counter)
+ */
+static void selectAndCode(const double* data, size_t len, double qf, SelectablePredictor& predictor,
+		IntCoder& coder, BitSink& bitSink, bool writeOrders)
+{
+	for (size_t start = 0; start < len; start += QuantitiesSequence::BLOCK_SIZE) {
+		int blockLen = (int)std::min(len - start, (size_t)QuantitiesSequence::BLOCK_SIZE);
+		int order = predictor.selectOrder(data + start, blockLen, qf);
+		predictor.setOrder(order);
+		if (writeOrders)
+			bitSink.receive(order, SelectablePredictor::ORDER_BITS);
+		predictiveCode(data + start, blockLen, qf, predictor, coder, bitSink);
+	}
+}
+
+void QuantitiesSequence::codeBlocks()
+{
+	for (unsigned n = 0; n < qInfos.size(); ++n) {
+		std::vector<double>& block = blocks[n];
+		if (!block.empty() && selectPredictors)
+			selectAndCode(&block[0], block.size(), qFactors[n],
+					static_cast<SelectablePredictor&>(*intPredictors[n]), *intCoders[n], bitSinks[n], true);
+		else if (!block.empty())
+			predictiveCode(&block[0], block.size(), qFactors[n], *intPredictors[n], *intCoders[n],
+					bitSinks[n]);
+		block.clear();
+	}
+}
+
+/*
+ * Returns the ID of the table (QuantitiesSequence::EXPLICIT_TABLE, CONTEXT_TABLES or a built-in
+ * table) that codes the sizes counter counted in the fewest bits, including explicit tables' own
+ * bits, and sets tables to it (or them).
+ */
+static int chooseTable(const ContextSizeCounter& counter, vector<HuffmanTable>& tables)
+{
+	const vector<int>& counts = counter.getCounts();
+	tables.resize(1);
+	HuffmanTable& table = tables[0];
+	int bestId = 0;
+	uint64_t bestBits = huffmanCodeBits(counts, getBuiltinHuffmanTable(0));
+	for (int id = 1; id < NUM_BUILTIN_HUFFMAN_TABLES; ++id) {
+		uint64_t bits = huffmanCodeBits(counts, getBuiltinHuffmanTable(id));
+		if (bits < bestBits) {
+			bestId = id;
+			bestBits = bits;
+		}
+	}
+	table = getBuiltinHuffmanTable(bestId);
+	bool anyCounts = false;
+	for (auto count : counts)
+		anyCounts = anyCounts || count > 0;
+	if (anyCounts) {
+		int tableId = bestId;
+		HuffmanTable optimal = makeOptimalHuffmanTable(counts);
+		uint64_t bits = huffmanCodeBits(counts, optimal) + compactHuffmanTableBits(optimal);
+		if (bits < bestBits) {
+			table = optimal;
+			tableId = QuantitiesSequence::EXPLICIT_TABLE;
+			bestBits = bits;
+		}
+		// A context with no sizes gets the smallest table (size 0 only)
+		vector<HuffmanTable> contextTables;
+		uint64_t contextBits = 0;
+		for (const auto& contextCounts : counter.getContextCounts()) {
+			bool anyContextCounts = false;
+			for (auto count : contextCounts)
+				anyContextCounts = anyContextCounts || count > 0;
+			contextTables.push_back(makeOptimalHuffmanTable(anyContextCounts ? contextCounts :
+					vector<int>(1, 1)));
+			contextBits += huffmanCodeBits(contextCounts, contextTables.back()) +
+					compactHuffmanTableBits(contextTables.back());
+		}
+		if (contextBits < bestBits) {
+			tables = contextTables;
+			tableId = QuantitiesSequence::CONTEXT_TABLES;
+		}
+		return tableId;
 	}
+	return bestId;
 }
 
-std::vector<uint8_t> QuantitiesSequence::getCode() const
+static void appendBigEndian32(vector<uint8_t>& code, uint32_t val)
 {
+	for (int shift = 24; shift >= 0; shift -= 8)
+		code.push_back((uint8_t)(val >> shift));
+}
+
+std::vector<uint8_t> QuantitiesSequence::getCode()
+{
+	if (!finished) {
+		if (mode == OPTIMIZE) {
+			for (unsigned n = 0; n < qInfos.size(); ++n) {
+				ContextSizeCounter counter;
+				if (!blocks[n].empty() && selectPredictors) {
+					// Same predictors as codeBlocks will select
+					SelectablePredictor predictor;
+					selectAndCode(&blocks[n][0], blocks[n].size(), qFactors[n], predictor, counter,
+							bitSinks[n], false);
+				}
+				else if (!blocks[n].empty()) {
+					// Same predictor as startQuantity
+					SecondOrderPredictor predictor(0, 0);
+					predictiveCode(&blocks[n][0], blocks[n].size(), qFactors[n], predictor, counter,
+							bitSinks[n]);
+				}
+				vector<HuffmanTable> tables;
+				int tableId = chooseTable(counter, tables);
+				startQuantity(n, tableId, tables);
+			}
+		}
+		codeBlocks();
+		for (unsigned n = 0; n < qInfos.size(); ++n) {
+			intCoders[n]->flush(bitSinks[n]);
+			bitSinks[n].close();
+		}
+		finished = true;
+	}
+
 	vector<uint8_t> code;
+	appendBigEndian32(code, numVals);
 	for (unsigned n = 0; n < qInfos.size(); ++n) {
-		//ToDo: why do I have to cast away const ness for intCoders[n]->flush, but not e.g. with the line
-		// "intCoders[n]->code(bitSinks[n], x - intPredictors[n]->predict());" ?
-		// Is this a stupid bug on my behalf!!
-		BitSink& bitSink = (BitSink&)bitSinks[n];
-		intCoders[n]->flush(bitSink);
 		const std::vector<uint8_t>& buf = byteSinks[n]->getBuf();
+		appendBigEndian32(code, buf.size());
 		code.insert(code.end(), buf.begin(), buf.end());
 	}
 	return code;
 }
 
+/********************************************************************************
+ *
+ *
+ *
+ *
+ * QuantitiesSequenceDecoder
+ *
+ *
+ *
+ *
+ *
+ ********************************************************************************/
+static uint32_t getBigEndian32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+QuantitiesSequenceDecoder::QuantitiesSequenceDecoder(const std::vector<QuantityInfo>& qInfos,
+		const uint8_t* code, size_t len)
+	: qInfos(qInfos),
+	  numVals(0)
+{
+	if (len < 4)
+		throw std::logic_error("QuantitiesSequenceDecoder: code too short");
+	numVals = getBigEndian32(code);
+	size_t offset = 4;
+	for (unsigned n = 0; n < qInfos.size(); ++n) {
+		if (len - offset < 4)
+			throw std::logic_error("QuantitiesSequenceDecoder: code too short");
+		size_t streamLen = getBigEndian32(code + offset);
+		offset += 4;
+		if (len - offset < streamLen)
+			throw std::logic_error("QuantitiesSequenceDecoder: code too short");
+		// Every value costs at least one (Huffman) bit, so a bigger numVals is corrupt, and would
+		// have decode allocate its rows for nothing
+		if (numVals > 8 * (uint64_t)streamLen)
+			throw std::logic_error("QuantitiesSequenceDecoder: numVals too big for the code");
+		streams.push_back(code + offset);
+		streamLens.push_back(streamLen);
+		offset += streamLen;
+	}
+	if (qInfos.empty() && numVals != 0)
+		throw std::logic_error("QuantitiesSequenceDecoder: numVals without quantities");
+}
+
+std::vector<std::vector<double> > QuantitiesSequenceDecoder::decode() const
+{
+	vector<vector<double> > rows(numVals, vector<double>(qInfos.size()));
+	for (unsigned n = 0; n < qInfos.size(); ++n) {
+		BitSource bitSource(streams[n], streamLens[n]);
+		if (bitSource.getAvailableBits() < 8)
+			throw std::logic_error("QuantitiesSequenceDecoder: quantity stream too short");
+		int tableId = bitSource.pop(8);
+		bool selectPredictors = tableId == QuantitiesSequence::SELECTED_PREDICTORS;
+		if (selectPredictors) {
+			if (bitSource.getAvailableBits() < 8)
+				throw std::logic_error("QuantitiesSequenceDecoder: quantity stream too short");
+			tableId = bitSource.pop(8);
+		}
+		shared_ptr<IntDecoder> intDecoder;
+		if (tableId == QuantitiesSequence::EXPLICIT_TABLE)
+			intDecoder.reset(getSizeIntDecoder(readCompactHuffmanTable(bitSource)));
+		else if (tableId == QuantitiesSequence::CONTEXT_TABLES) {
+			vector<HuffmanTable> tables;
+			for (int context = 0; context < NUM_SIZE_CONTEXTS; ++context)
+				tables.push_back(readCompactHuffmanTable(bitSource));
+			intDecoder.reset(getContextSizeIntDecoder(tables));
+		}
+		else if (tableId == QuantitiesSequence::ADAPTIVE_TABLE)
+			intDecoder.reset(getAdaptiveSizeIntDecoder(getBuiltinHuffmanTable(0)));
+		else if (tableId < NUM_BUILTIN_HUFFMAN_TABLES)
+			intDecoder.reset(getSizeIntDecoder(getBuiltinHuffmanTable(tableId)));
+		else
+			throw std::logic_error("QuantitiesSequenceDecoder: unknown table " + to_string(tableId));
+		SelectablePredictor predictor(2); // QuantitiesSequence's predictor unless selectPredictors
+		double qStep = qStepToDouble(qInfos[n].qStep);
+		int residuals[QuantitiesSequence::BLOCK_SIZE];
+		int xs[QuantitiesSequence::BLOCK_SIZE];
+		double vals[QuantitiesSequence::BLOCK_SIZE];
+		for (uint32_t start = 0; start < numVals; start += QuantitiesSequence::BLOCK_SIZE) {
+			size_t blockLen = std::min(numVals - start, (uint32_t)QuantitiesSequence::BLOCK_SIZE);
+			if (selectPredictors) {
+				if (bitSource.getAvailableBits() < SelectablePredictor::ORDER_BITS)
+					throw std::logic_error("QuantitiesSequenceDecoder: quantity stream too short");
+				predictor.setOrder(bitSource.pop(SelectablePredictor::ORDER_BITS));
+			}
+			if (intDecoder->decodeBlock(bitSource, residuals, blockLen) != blockLen)
+				throw std::logic_error("QuantitiesSequenceDecoder: quantity stream too short");
+			predictor.reconstructBlock(residuals, blockLen, qStep, xs, vals);
+			for (size_t i = 0; i < blockLen; ++i)
+				rows[start + i][n] = vals[i];
+		}
+	}
+	return rows;
+}
+
 } // namespace qs
 
 
@@ -41,31 +41,119 @@ struct QuantityInfo {
     QuantityInfo(const std::string& name="", const std::string& unit="", const QStep& qStep=QStep())
         : name(name), unit(unit), qStep(qStep) {}
 };
+class HuffmanTable;
 class IntCoder;
 class IntPredictor;
+/*
+ * QuantitiesSequence
+ *
+ * Values are buffered per quantity and coded a block (BLOCK_SIZE values) at a time with
+ * predictiveCode, which selects the inlined coding loop for the quantity's predictor and coder
+ * once per block.
+ *
+ * Each quantity is coded with a second order predictor and a SizeIntCoder. With DEFAULT_TABLE
+ * the SizeIntCoder uses getDefaultHuffmanTable(). OPTIMIZE keeps all the values until getCode,
+ * which counts the residual sizes (first pass) and codes the values (second pass) with the
+ * table that gives the fewest bits for those counts: one of the built-in tables (see
+ * getBuiltinHuffmanTable), or the quantity's optimal table (see makeOptimalHuffmanTable) plus the
+ * bits to carry it in the stream, or a table per context of the previous sizes (see
+ * ContextSizeIntCoder) plus the bits to carry them. So each quantity can have its own table,
+ * while short streams that don't gain from one don't pay for it.
+ * ADAPTIVE is for long running streams: it codes as values are pushed, starting with the default
+ * table, and the table follows the data (see AdaptiveSizeIntCoder).
+ *
+ * With selectPredictors each block (of BLOCK_SIZE values) is coded with the predictor order, 0 to 3,
+ * that suits it (see SelectablePredictor), e.g. order 0 for noise and 3 for smooth signals,
+ * signalled in 2 bits before the block's codes. In OPTIMIZE mode the table is chosen for the
+ * residuals of the selected predictors.
+ *
+ * Stream format (multi byte numbers big endian):
+ *   numVals: 32 bits
+ *   for each quantity:
+ *     numBytes: 32 bits, the length of the quantity's bitstream:
+ *       SELECTED_PREDICTORS: 8 bits, only with selectPredictors
+ *       table: 8 bits, a built-in table ID, EXPLICIT_TABLE followed by the table (see
+ *         writeCompactHuffmanTable), CONTEXT_TABLES followed by NUM_SIZE_CONTEXTS tables
+ *         (ContextSizeIntCoder codes), or ADAPTIVE_TABLE (AdaptiveSizeIntCoder codes, default
+ *         period and window, starting with the default table)
+ *       numVals SizeIntCoder codes, padded to a whole byte with 1's. With selectPredictors each
+ *         block's codes follow its predictor order: 2 bits
+ */
 class QuantitiesSequence
 {
     public:
-        QuantitiesSequence(const std::vector<QuantityInfo>& qInfos);
+        static const int BLOCK_SIZE = 256;
+        static const int EXPLICIT_TABLE = 0xFF;
+        static const int ADAPTIVE_TABLE = 0xFE;
+        static const int CONTEXT_TABLES = 0xFD;
+        // 0xFC is reserved for the standard quantity tables, once there are any (see
+        // getStdQuantityHuffmanTable)
+        static const int SELECTED_PREDICTORS = 0xFB;
+        enum Mode { DEFAULT_TABLE, OPTIMIZE, ADAPTIVE };
+
+        QuantitiesSequence(const std::vector<QuantityInfo>& qInfos, Mode mode = DEFAULT_TABLE,
+                bool selectPredictors = false);
         ~QuantitiesSequence();
 
         void push(const std::vector<double>& quantities);
 
-        std::vector<uint8_t> getCode() const;
+        // Codes any buffered values and finishes the stream, so no values can be pushed after it
+        std::vector<uint8_t> getCode();
+
+    private:
+        // tables: one table, or one per context for CONTEXT_TABLES
+        void startQuantity(unsigned n, int tableId, const std::vector<HuffmanTable>& tables);
+        void codeBlocks();
 
     private:
         std::vector<QuantityInfo> qInfos;
+        Mode mode;
+        bool selectPredictors;
         std::vector<std::shared_ptr<IntCoder> > intCoders;
         std::vector<std::shared_ptr<ByteBufferSink> > byteSinks;
         std::vector<BitSink> bitSinks;
-        std::vector<std::shared_ptr<IntPredictor> > intPredictors;
-        std::vector<double> qMuls;
+        std::vector<std::shared_ptr<IntPredictor> > intPredictors; // SelectablePredictors with selectPredictors
+        std::vector<double> qFactors; // 1/qStep
+        std::vector<std::vector<double> > blocks; // Values not yet coded, per quantity
+        uint32_t numVals;
+        bool finished;
+};
+
+/*
+ * QuantitiesSequenceDecoder
+ *
+ * Decodes the output of QuantitiesSequence::getCode. Each quantity's bitstream is read in place,
+ * so code[0], code[1],..,code[len-1] must stay valid for the life of the decoder.
+ */
+class QuantitiesSequenceDecoder
+{
+    public:
+        QuantitiesSequenceDecoder(const std::vector<QuantityInfo>& qInfos, const uint8_t* code,
+                size_t len);
+
+        uint32_t getNumVals() const { return numVals; }
+        // Row n is the nth quantities vector passed to QuantitiesSequence::push (quantized)
+        std::vector<std::vector<double> > decode() const;
+
+    private:
+        std::vector<QuantityInfo> qInfos;
         uint32_t numVals;
+        std::vector<const uint8_t*> streams;
+        std::vector<size_t> streamLens;
 };
 
 extern const char** getStdQuantities(); // Table with up to 255 standard (enumerated) channel names
 extern const uint8_t STD_QUANTITY_NOT_PRESENT; // Value indicating quantity not in standard quantities list
 extern uint8_t getStdQuantityIdx(const std::string& name);
+// The table trained for standard quantity stdIdx (see qstrain), or NULL if it has none. The tables
+// aren't in the stream format until they are trained on a corpus: then a stream will select them
+// with table ID 0xFC followed by their 8 bit version, so streams aren't decoded with retrained
+// tables.
+extern const HuffmanTable* getStdQuantityHuffmanTable(uint8_t stdIdx);
+// The version of the trained tables, which qstrain bumps each time it retrains them
+extern uint8_t getStdQuantityTablesVersion();
+
+extern double qStepToDouble(const QStep& qStep);
 
 extern std::ostream& operator<<(std::ostream& os, const QStep& qStep);
 extern std::ostream& operator<<(std::ostream& os, const QuantityInfo& ci);
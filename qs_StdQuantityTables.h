@@ -0,0 +1,115 @@
+/*
+ * qs_StdQuantityTables.h
+ *
+ * Generated by qstrain - do not edit. Regenerate with
+ *   qstrain -o qs_StdQuantityTables.h
+ * STD_QUANTITY_HUFFMAN_TABLES[stdIdx] codes the residual sizes (see SizeIntCoder) of
+ * getStdQuantities()[stdIdx] quantized with the step given in its comment. A quantity
+ * trained with 0 values has no table (see getStdQuantityHuffmanTable).
+ */
+
+#ifndef QS_STDQUANTITYTABLES_H_
+#define QS_STDQUANTITYTABLES_H_
+
+#include "HuffmanTable.h"
+
+#include <stdint.h>
+
+namespace qs {
+
+// Bumped by each retrain, so streams coded with these tables can be told from streams coded
+// with others (see getStdQuantityHuffmanTable)
+static constexpr uint8_t STD_QUANTITY_TABLES_VERSION = 1;
+
+static constexpr int NUM_STD_QUANTITY_TABLES = 27;
+
+static constexpr uint64_t STD_QUANTITY_TRAINING_VALUES[NUM_STD_QUANTITY_TABLES] = {
+    0, // acceleration.x
+    0, // acceleration.y
+    0, // acceleration.z
+    0, // distance
+    0, // gps_speed
+    0, // wheel_based_speed
+    0, // ignition
+    0, // rpm
+    0, // fuel
+    0, // fuel_rate
+    0, // temperature
+    0, // voltage
+    0, // altitude
+    0, // latitude
+    0, // longitude
+    0, // track
+    0, // gyro.x
+    0, // gyro.y
+    0, // gyro.z
+    0, // magnetic.x
+    0, // magnetic.y
+    0, // magnetic.z
+    0, // id
+    0, // enginehours
+    0, // idlinghours
+    0, // movinghours
+    0 // unixtime
+};
+
+static constexpr HuffmanTable STD_QUANTITY_HUFFMAN_TABLES[NUM_STD_QUANTITY_TABLES] = {
+    // acceleration.x
+    {{0}, {0}},
+    // acceleration.y
+    {{0}, {0}},
+    // acceleration.z
+    {{0}, {0}},
+    // distance
+    {{0}, {0}},
+    // gps_speed
+    {{0}, {0}},
+    // wheel_based_speed
+    {{0}, {0}},
+    // ignition
+    {{0}, {0}},
+    // rpm
+    {{0}, {0}},
+    // fuel
+    {{0}, {0}},
+    // fuel_rate
+    {{0}, {0}},
+    // temperature
+    {{0}, {0}},
+    // voltage
+    {{0}, {0}},
+    // altitude
+    {{0}, {0}},
+    // latitude
+    {{0}, {0}},
+    // longitude
+    {{0}, {0}},
+    // track
+    {{0}, {0}},
+    // gyro.x
+    {{0}, {0}},
+    // gyro.y
+    {{0}, {0}},
+    // gyro.z
+    {{0}, {0}},
+    // magnetic.x
+    {{0}, {0}},
+    // magnetic.y
+    {{0}, {0}},
+    // magnetic.z
+    {{0}, {0}},
+    // id
+    {{0}, {0}},
+    // enginehours
+    {{0}, {0}},
+    // idlinghours
+    {{0}, {0}},
+    // movinghours
+    {{0}, {0}},
+    // unixtime
+    {{0}, {0}}
+};
+
+} // namespace qs
+
+#endif /* QS_STDQUANTITYTABLES_H_ */
@@ -0,0 +1,520 @@
+/*
+ * qsbench.cpp
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ *
+ * Micro benchmarks for the bit I/O and coding paths. Usage e.g.:
+ *   ./qsbench bitsource-rss 10 64
+ * Built with optimization (see the qsbench target in the Makefile).
+ */
+
+#include "BitSink.h"
+#include "Coders.h"
+#include "Decoders.h"
+#include "HuffmanCoder.h"
+#include "HuffmanDecoder.h"
+#include "HuffmanTable.h"
+#include "qs_BitSource.h"
+#include "qs_Quantity.h"
+#include "QuantizeKernels.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using namespace qs;
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Helpers
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+// Resident set size in kB, from /proc/self/status (0 if not available)
+static long getRssKB()
+{
+	std::ifstream status("/proc/self/status");
+	string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return strtol(line.c_str() + 6, NULL, 10);
+	}
+	return 0;
+}
+
+static double secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Generates totalBytes of pseudo random bytes, a chunk at a time. The chunk is reused so the
+ * source itself has constant memory use.
+ */
+class SyntheticByteSource : public ByteSource
+{
+public:
+	SyntheticByteSource(uint64_t totalBytes, size_t chunkSize)
+		: remaining(totalBytes), chunk(chunkSize), state(0x9E3779B97F4A7C15ull) {}
+	virtual ~SyntheticByteSource() {}
+
+	virtual const vector<uint8_t>& getBytes() {
+		if (remaining == 0) {
+			chunk.clear();
+			return chunk;
+		}
+		size_t len = remaining < chunk.capacity() ? (size_t)remaining : chunk.capacity();
+		chunk.resize(len);
+		for (size_t n = 0; n + 8 <= len; n += 8) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			memcpy(&chunk[n], &state, 8);
+		}
+		remaining -= len;
+		return chunk;
+	}
+
+private:
+	uint64_t remaining;
+	vector<uint8_t> chunk;
+	uint64_t state;
+};
+
+/*
+ * Residual size symbols, mostly 2-4 bits long, from a fixed distribution
+ */
+static vector<uint8_t> getSizeSymbols(size_t numSymbols)
+{
+	static const int percent[] = {5, 10, 25, 30, 18, 6, 3, 1, 1, 1};
+	static const int numSizes = sizeof(percent)/sizeof(percent[0]);
+	vector<uint8_t> sizes;
+	for (int size = 0; size < numSizes; ++size)
+		sizes.insert(sizes.end(), percent[size], (uint8_t)size);
+	vector<uint8_t> symbols(numSymbols);
+	uint32_t lcg = 1;
+	for (size_t n = 0; n < numSymbols; ++n) {
+		lcg = lcg * 1664525 + 1013904223;
+		symbols[n] = sizes[(lcg >> 8) % sizes.size()];
+	}
+	return symbols;
+}
+
+/*
+ * A smooth (GPS track like) signal: a random walk in the second difference, quantized to
+ * qStep = 1/qf with small residuals.
+ */
+static vector<double> getSmoothSignal(size_t numSamples, double qf, uint32_t seed)
+{
+	vector<double> signal(numSamples);
+	double val = 1000.0;
+	double slope = 0.0;
+	uint32_t lcg = seed;
+	for (size_t n = 0; n < numSamples; ++n) {
+		lcg = lcg * 1664525 + 1013904223;
+		slope += ((int)(lcg >> 24) - 128) / (64.0 * qf);
+		slope *= 0.99;
+		val += slope;
+		signal[n] = val;
+	}
+	return signal;
+}
+
+// The optimal table for getSizeSymbols
+static HuffmanTable getTrainedSizeTable()
+{
+	vector<int> counts(HUFF_MAX_NUMBER_SYMBOLS, 0);
+	for (auto symbol : getSizeSymbols(100000))
+		counts[symbol]++;
+	return makeOptimalHuffmanTable(counts);
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Benchmarks
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * Reads a gigaBytes long synthetic stream through a BitSource with a bufferKB byte buffer,
+ * reporting the RSS every GB. The RSS should stay flat.
+ */
+static int benchBitSourceRss(double gigaBytes, size_t bufferKB)
+{
+	const uint64_t GB = 1ull << 30;
+	uint64_t totalBytes = (uint64_t)(gigaBytes * GB);
+	shared_ptr<ByteSource> byteSource(new SyntheticByteSource(totalBytes, 1 << 20));
+	BitSource bitSource(byteSource, bufferKB * 1024);
+
+	cout<<"bitsource-rss: "<<gigaBytes<<" GB stream, "<<bufferKB<<" kB buffer"<<endl;
+	cout<<"start RSS="<<getRssKB()<<" kB"<<endl;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t bitsRead = 0;
+	uint32_t checksum = 0;
+	uint64_t nextReport = GB * 8;
+	long maxRss = 0;
+	while (bitSource.getAvailableBits() >= 25) {
+		checksum += bitSource.pop(25);
+		bitsRead += 25;
+		if (bitsRead >= nextReport) {
+			long rss = getRssKB();
+			maxRss = rss > maxRss ? rss : maxRss;
+			cout<<(bitsRead >> 33)<<" GB read, RSS="<<rss<<" kB"<<endl;
+			nextReport += GB * 8;
+		}
+	}
+	double secs = secondsSince(start);
+	long rss = getRssKB();
+	maxRss = rss > maxRss ? rss : maxRss;
+	cout<<"end RSS="<<rss<<" kB, max RSS="<<maxRss<<" kB, checksum="<<checksum<<endl;
+	cout<<(bitsRead >> 3)/secs/1e6<<" MB/s"<<endl;
+	return 0;
+}
+
+/*
+ * Decodes numSymbols size symbols with HuffmanDecoder::decode and with decodeMulti (multi symbol
+ * LUT with 11 and 12 bit lookahead), for the default and a trained table.
+ */
+static int benchHuffmanDecode(size_t numSymbols)
+{
+	vector<uint8_t> symbols = getSizeSymbols(numSymbols);
+	vector<HuffmanTable> tables = {getDefaultHuffmanTable(), getTrainedSizeTable()};
+	const char* tableNames[] = {"default", "trained"};
+	for (unsigned t = 0; t < tables.size(); ++t) {
+		shared_ptr<ByteBufferSink> byteSink(new ByteBufferSink());
+		{
+			BitSink bitSink(byteSink);
+			HuffmanCoder huffCoder(tables[t]);
+			for (auto symbol : symbols)
+				huffCoder.code(bitSink, symbol);
+			bitSink.close();
+		}
+		const vector<uint8_t>& code = byteSink->getBuf();
+		cout<<tableNames[t]<<" table: "<<code.size()*8.0/numSymbols<<" bits/symbol"<<endl;
+
+		for (int lookahead = 0; lookahead <= 12; lookahead += lookahead ? 1 : 11) {
+			HuffmanDecoder huffDecoder(tables[t]);
+			if (lookahead)
+				huffDecoder.generateMultiSymbolLut(lookahead);
+			BitSource bitSource(&code[0], code.size());
+			uint32_t checksum = 0;
+			size_t numDecoded = 0;
+			auto start = std::chrono::steady_clock::now();
+			if (lookahead == 0) {
+				for (; numDecoded < numSymbols; ++numDecoded)
+					checksum += huffDecoder.decode(bitSource);
+			}
+			else {
+				uint8_t syms[HuffmanDecoder::HUFF_MULTI_MAX_SYMBOLS];
+				while (numDecoded < numSymbols) {
+					int num = huffDecoder.decodeMulti(bitSource, syms);
+					for (int n = 0; n < num && numDecoded < numSymbols; ++n, ++numDecoded)
+						checksum += syms[n];
+				}
+			}
+			double secs = secondsSince(start);
+			cout<<"  "<<(lookahead ? "decodeMulti lookahead=" + std::to_string(lookahead) : "decode")
+				<<": "<<numSymbols/secs/1e6<<" Msymbols/s (checksum="<<checksum<<")"<<endl;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Codes numSamples samples with DoublesCoder (second order predictor, SizeIntCoder), and the same
+ * samples as three quantities with QuantitiesSequence, with the default, optimized and adaptive
+ * tables, and optimized tables with per block predictor selection.
+ */
+static int benchEncode(size_t numSamples)
+{
+	const double qStep = 1.0/1024;
+	vector<double> signal = getSmoothSignal(numSamples, 1.0/qStep, 1);
+	{
+		shared_ptr<ByteBufferSink> byteSink(new ByteBufferSink());
+		shared_ptr<BitSink> bitSink(new BitSink(byteSink));
+		DoublesCoder coder(qStep, shared_ptr<IntPredictor>(getIntPredictor(2)),
+				shared_ptr<IntCoder>(getSizeIntCoder(getDefaultHuffmanTable())), bitSink);
+		auto start = std::chrono::steady_clock::now();
+		coder.code(&signal[0], signal.size());
+		bitSink->close();
+		double secs = secondsSince(start);
+		cout<<"DoublesCoder: "<<numSamples/secs/1e6<<" Msamples/s, "
+			<<byteSink->getBuf().size()*8.0/numSamples<<" bits/sample"<<endl;
+	}
+	vector<QuantityInfo> qInfos = {QuantityInfo("a", "", QStep(0, -10)),
+			QuantityInfo("b", "", QStep(0, -10)), QuantityInfo("c", "", QStep(0, -10))};
+	const char* modeNames[] = {"default table", "optimize", "adaptive"};
+	for (int run = 0; run < 4; ++run) {
+		// The three modes, then optimize with per block predictor selection
+		QuantitiesSequence::Mode mode = run < 3 ? (QuantitiesSequence::Mode)run : QuantitiesSequence::OPTIMIZE;
+		bool selectPredictors = run == 3;
+		QuantitiesSequence qs(qInfos, mode, selectPredictors);
+		vector<double> quantities(qInfos.size());
+		auto start = std::chrono::steady_clock::now();
+		for (size_t n = 0; n < numSamples; ++n) {
+			for (unsigned m = 0; m < quantities.size(); ++m)
+				quantities[m] = signal[n] + m;
+			qs.push(quantities);
+		}
+		vector<uint8_t> code = qs.getCode();
+		double secs = secondsSince(start);
+		cout<<"QuantitiesSequence "<<modeNames[mode]<<(selectPredictors ? ", selected predictors" : "")<<": "<<numSamples*qInfos.size()/secs/1e6<<" Msamples/s, "
+			<<code.size()*8.0/(numSamples*qInfos.size())<<" bits/sample"<<endl;
+	}
+	return 0;
+}
+
+/*
+ * Runs each kernel set the CPU supports (see getSupportedCodecKernels) over numSamples samples of
+ * a smooth signal, a block at a time: quantize (residuals only, and with sizes and amplitudes) and
+ * reconstruct, with a second order predictor.
+ */
+static int benchKernels(size_t numSamples)
+{
+	const double qStep = 1.0/1024;
+	vector<double> signal = getSmoothSignal(numSamples, 1.0/qStep, 1);
+	vector<int> residuals(numSamples);
+	vector<uint8_t> sizes(numSamples);
+	vector<uint32_t> amps(numSamples);
+	vector<int> xs(numSamples);
+	vector<double> vals(numSamples);
+	const size_t blockSize = PREDICTIVE_CODE_BLOCK_SIZE;
+	cout<<"best: "<<getCodecKernels().name<<endl;
+	for (auto& kernels : getSupportedCodecKernels()) {
+		for (int withSizes = 0; withSizes <= 1; ++withSizes) {
+			int prev1 = 0, prev2 = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t n = 0; n < numSamples; n += blockSize) {
+				size_t len = std::min(blockSize, numSamples - n);
+				kernels.quantizeResiduals(&signal[n], len, 1/qStep, 2, prev1, prev2, &residuals[n],
+						withSizes ? &sizes[n] : NULL, &amps[n]);
+			}
+			double secs = secondsSince(start);
+			cout<<kernels.name<<" quantize"<<(withSizes ? " with sizes: " : ": ")<<numSamples/secs/1e6
+				<<" Msamples/s"<<endl;
+		}
+		int prev1 = 0, prev2 = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t n = 0; n < numSamples; n += blockSize) {
+			size_t len = std::min(blockSize, numSamples - n);
+			kernels.reconstructResiduals(&residuals[n], len, qStep, 2, prev1, prev2, &xs[n], &vals[n]);
+		}
+		double secs = secondsSince(start);
+		cout<<kernels.name<<" reconstruct: "<<numSamples/secs/1e6<<" Msamples/s (last="
+			<<vals[numSamples - 1]<<")"<<endl;
+	}
+	return 0;
+}
+
+/*
+ * Codes and decodes numSamples residuals with SizeIntCoder (default and trained Huffman tables)
+ * with RansIntCoder (1, 4 and 8 interleaved states) and with ArithIntCoder, for a smooth signal (second order prediction residuals) and a nearly
+ * constant one.
+ */
+static int benchEntropyCoders(size_t numSamples)
+{
+	vector<vector<int> > residuals(2);
+	const double qf = 1024;
+	vector<double> signal = getSmoothSignal(numSamples, qf, 1);
+	SecondOrderPredictor predictor(0, 0);
+	for (auto val : signal) {
+		int x = lround(val * qf);
+		residuals[0].push_back(x - predictor.predict());
+		predictor.update(x);
+	}
+	uint32_t lcg = 3;
+	for (size_t n = 0; n < numSamples; ++n) {
+		lcg = lcg * 1664525 + 1013904223;
+		residuals[1].push_back((lcg >> 24) == 0 ? (int)(lcg >> 8 & 3) - 2 : 0);
+	}
+	const char* signalNames[] = {"smooth", "nearly constant"};
+
+	for (unsigned r = 0; r < residuals.size(); ++r) {
+		cout<<signalNames[r]<<":"<<endl;
+		vector<int> counts(HUFF_MAX_NUMBER_SYMBOLS, 0);
+		for (auto val : residuals[r])
+			counts[bitLength(val < 0 ? -(uint32_t)val : val)]++;
+		HuffmanTable trainedTable = makeOptimalHuffmanTable(counts);
+		const char* coderNames[] = {"SizeIntCoder default table", "SizeIntCoder trained table",
+				"RansIntCoder 1 state", "RansIntCoder 4 states", "RansIntCoder 8 states", "ArithIntCoder"};
+		const int ransStates[] = {0, 0, 1, 4, 8, 0};
+		const int ARITH = 5;
+		for (int c = 0; c <= ARITH; ++c) {
+			shared_ptr<IntCoder> coder(c == ARITH ? getArithIntCoder() : ransStates[c] ?
+					getRansIntCoder(DEFAULT_RANS_BLOCK_SIZE, ransStates[c]) :
+					getSizeIntCoder(c == 0 ? getDefaultHuffmanTable() : trainedTable));
+			shared_ptr<ByteBufferSink> byteSink(new ByteBufferSink());
+			auto start = std::chrono::steady_clock::now();
+			{
+				BitSink bitSink(byteSink);
+				for (auto val : residuals[r])
+					coder->code(bitSink, val);
+				coder->flush(bitSink);
+				bitSink.close();
+			}
+			double encodeSecs = secondsSince(start);
+			const vector<uint8_t>& code = byteSink->getBuf();
+
+			shared_ptr<IntDecoder> decoder(c == ARITH ? getArithIntDecoder() :
+					ransStates[c] ? getRansIntDecoder(ransStates[c]) :
+					getSizeIntDecoder(c == 0 ? getDefaultHuffmanTable() : trainedTable));
+			BitSource bitSource(&code[0], code.size());
+			int checksum = 0;
+			start = std::chrono::steady_clock::now();
+			for (size_t n = 0; n < numSamples; ++n) {
+				IntDecoder::Run run;
+				decoder->decode(bitSource, run);
+				checksum += run.val;
+			}
+			double decodeSecs = secondsSince(start);
+
+			decoder.reset(c == ARITH ? getArithIntDecoder() :
+					ransStates[c] ? getRansIntDecoder(ransStates[c]) :
+					getSizeIntDecoder(c == 0 ? getDefaultHuffmanTable() : trainedTable));
+			BitSource blockBitSource(&code[0], code.size());
+			vector<int> block(PREDICTIVE_CODE_BLOCK_SIZE);
+			int blockChecksum = 0;
+			start = std::chrono::steady_clock::now();
+			for (size_t n = 0; n < numSamples; n += block.size()) {
+				size_t len = std::min(block.size(), numSamples - n);
+				decoder->decodeBlock(blockBitSource, &block[0], len);
+				for (size_t i = 0; i < len; ++i)
+					blockChecksum += block[i];
+			}
+			double decodeBlockSecs = secondsSince(start);
+			if (blockChecksum != checksum)
+				cerr<<"decodeBlock decoded differently from decode"<<endl;
+			cout<<"  "<<coderNames[c]<<": "<<code.size()*8.0/numSamples<<" bits/sample, encode "
+				<<numSamples/encodeSecs/1e6<<" Msamples/s, decode "<<numSamples/decodeSecs/1e6
+				<<" Msamples/s ("<<numSamples*sizeof(int)/decodeSecs/1e6<<" MB/s of ints, checksum="
+				<<checksum<<"), decodeBlock "<<numSamples/decodeBlockSecs/1e6<<" Msamples/s"<<endl;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Codes and decodes numSnippets short QuantitiesSequences (snippetLen values of 3 quantities),
+ * each with its own coders and decoders, as a server handling device snippets does.
+ */
+static int benchSnippets(size_t numSnippets, size_t snippetLen)
+{
+	const double qStep = 1.0/1024;
+	vector<double> signal = getSmoothSignal(snippetLen, 1.0/qStep, 1);
+	vector<QuantityInfo> qInfos = {QuantityInfo("a", "", QStep(0, -10)),
+			QuantityInfo("b", "", QStep(0, -10)), QuantityInfo("c", "", QStep(0, -10))};
+	vector<uint8_t> code;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t s = 0; s < numSnippets; ++s) {
+		QuantitiesSequence qs(qInfos);
+		vector<double> quantities(qInfos.size());
+		for (size_t n = 0; n < snippetLen; ++n) {
+			for (unsigned m = 0; m < quantities.size(); ++m)
+				quantities[m] = signal[n] + m;
+			qs.push(quantities);
+		}
+		code = qs.getCode();
+	}
+	double secs = secondsSince(start);
+	cout<<"snippets of "<<snippetLen<<" values: encode "<<numSnippets/secs<<" snippets/s";
+	size_t checksum = 0;
+	start = std::chrono::steady_clock::now();
+	for (size_t s = 0; s < numSnippets; ++s) {
+		QuantitiesSequenceDecoder decoder(qInfos, &code[0], code.size());
+		checksum += decoder.decode().size();
+	}
+	secs = secondsSince(start);
+	cout<<", decode "<<numSnippets/secs<<" snippets/s (checksum="<<checksum<<")"<<endl;
+	return 0;
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * main
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+static void usage(char* argv[])
+{
+	cerr<<argv[0]<<" bitsource-rss [gigaBytes=10] [bufferKB=64]"<<endl;
+	cerr<<argv[0]<<" huffman-decode [numSymbols=10000000]"<<endl;
+	cerr<<argv[0]<<" encode [numSamples=10000000]"<<endl;
+	cerr<<argv[0]<<" kernels [numSamples=10000000]"<<endl;
+	cerr<<argv[0]<<" entropy-coders [numSamples=10000000]"<<endl;
+	cerr<<argv[0]<<" snippets [numSnippets=100000] [snippetLen=60]"<<endl;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		usage(argv);
+		return 1;
+	}
+	string bench = argv[1];
+	if (bench == "bitsource-rss") {
+		double gigaBytes = argc > 2 ? strtod(argv[2], NULL) : 10.0;
+		size_t bufferKB = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+		return benchBitSourceRss(gigaBytes, bufferKB);
+	}
+	if (bench == "huffman-decode") {
+		size_t numSymbols = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+		return benchHuffmanDecode(numSymbols);
+	}
+	if (bench == "encode") {
+		size_t numSamples = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+		return benchEncode(numSamples);
+	}
+	if (bench == "kernels") {
+		size_t numSamples = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+		return benchKernels(numSamples);
+	}
+	if (bench == "entropy-coders") {
+		size_t numSamples = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+		return benchEntropyCoders(numSamples);
+	}
+	if (bench == "snippets") {
+		size_t numSnippets = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+		size_t snippetLen = argc > 3 ? strtoul(argv[3], NULL, 10) : 60;
+		return benchSnippets(numSnippets, snippetLen);
+	}
+	usage(argv);
+	return 1;
+}
@@ -0,0 +1,355 @@
+/*
+ * qstrain.cpp
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ *
+ * Trains the standard quantity Huffman tables (qs_StdQuantityTables.h) from a corpus. Usage e.g.:
+ *   ./qstrain -q latitude:-13,longitude:-13,gps_speed:-4 -o qs_StdQuantityTables.h trip1.csv trip2.csv
+ * A .csv file has a header row of quantity names, then a row of values per sample. Any other file
+ * is a QuantitiesSequence stream (see QuantitiesSequence::getCode) of the quantities -q lists, in
+ * order. -q gives each quantity's quantization step as its exponent (step 2^exp); CSV columns it
+ * doesn't list have step 1. Quantities that aren't standard quantities (see getStdQuantities)
+ * are ignored. The tables written with -o get the next version after those of the file replaced.
+ */
+
+#include "BitSink.h"
+#include "Coders.h"
+#include "HuffmanTable.h"
+#include "qs_Quantity.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::ostream;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using namespace qs;
+
+// Sizes of 32 bit residuals, every one of which a trained table can code
+static const int NUM_SIZES = 33;
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * StdQuantityTrainer
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+/*
+ * Counts the residual sizes QuantitiesSequence codes for each standard quantity, over all the
+ * sequences added. A standard quantity's table is only good for one quantization step, so all
+ * its sequences must have the same step.
+ */
+class StdQuantityTrainer
+{
+public:
+	StdQuantityTrainer() : numStd(0) {
+		while (getStdQuantities()[numStd] != NULL)
+			numStd++;
+		counts.assign(numStd, vector<uint64_t>(NUM_SIZES, 0));
+		numVals.assign(numStd, 0);
+		qSteps.resize(numStd);
+	}
+
+	// Counts vals (one quantity's values, in order). Returns false if qInfo isn't standard.
+	bool add(const QuantityInfo& qInfo, const vector<double>& vals) {
+		uint8_t stdIdx = getStdQuantityIdx(qInfo.name);
+		if (stdIdx == STD_QUANTITY_NOT_PRESENT)
+			return false;
+		if (numVals[stdIdx] != 0 && (qSteps[stdIdx].sig != qInfo.qStep.sig ||
+				qSteps[stdIdx].exp != qInfo.qStep.exp))
+			throw std::logic_error("StdQuantityTrainer: " + qInfo.name + " has two qSteps");
+		qSteps[stdIdx] = qInfo.qStep;
+		if (vals.empty())
+			return true;
+		// As QuantitiesSequence codes each quantity
+		SizeCounter counter;
+		SecondOrderPredictor predictor(0, 0);
+		BitSink bitSink(shared_ptr<ByteSink>(new ByteBufferSink()));
+		predictiveCode(&vals[0], vals.size(), 1.0/qStepToDouble(qInfo.qStep), predictor, counter,
+				bitSink);
+		for (int size = 0; size < NUM_SIZES; ++size)
+			counts[stdIdx][size] += counter.getCounts()[size];
+		numVals[stdIdx] += vals.size();
+		return true;
+	}
+
+	// Writes qs_StdQuantityTables.h, the optimal table for each trained quantity's counts. Counts
+	// are scaled down to fit makeOptimalHuffmanTable's ints (see scaleCounts) and smoothed (1
+	// added to every size) so a table can code any residual. version identifies the tables (see
+	// STD_QUANTITY_TABLES_VERSION).
+	void writeTables(ostream& os, const string& commandLine, int version) const {
+		os<<"/*\n"
+			" * qs_StdQuantityTables.h\n"
+			" *\n"
+			" * Generated by qstrain - do not edit. Regenerate with\n"
+			" *   "<<commandLine<<"\n"
+			" * STD_QUANTITY_HUFFMAN_TABLES[stdIdx] codes the residual sizes (see SizeIntCoder) of\n"
+			" * getStdQuantities()[stdIdx] quantized with the step given in its comment. A quantity\n"
+			" * trained with 0 values has no table (see getStdQuantityHuffmanTable).\n"
+			" */\n"
+			"\n"
+			"#ifndef QS_STDQUANTITYTABLES_H_\n"
+			"#define QS_STDQUANTITYTABLES_H_\n"
+			"\n"
+			"#include \"HuffmanTable.h\"\n"
+			"\n"
+			"#include <stdint.h>\n"
+			"\n"
+			"namespace qs {\n"
+			"\n"
+			"// Bumped by each retrain, so streams coded with these tables can be told from streams coded\n"
+			"// with others (see getStdQuantityHuffmanTable)\n"
+			"static constexpr uint8_t STD_QUANTITY_TABLES_VERSION = "<<version<<";\n"
+			"\n"
+			"static constexpr int NUM_STD_QUANTITY_TABLES = "<<numStd<<";\n"
+			"\n"
+			"static constexpr uint64_t STD_QUANTITY_TRAINING_VALUES[NUM_STD_QUANTITY_TABLES] = {\n";
+		for (int n = 0; n < numStd; ++n)
+			os<<"    "<<numVals[n]<<(n + 1 < numStd ? "," : "")<<" // "<<getStdQuantities()[n]<<"\n";
+		os<<"};\n"
+			"\n"
+			"static constexpr HuffmanTable STD_QUANTITY_HUFFMAN_TABLES[NUM_STD_QUANTITY_TABLES] = {\n";
+		for (int n = 0; n < numStd; ++n) {
+			const char* separator = n + 1 < numStd ? "," : "";
+			os<<"    // "<<getStdQuantities()[n];
+			if (numVals[n] == 0) {
+				os<<"\n    {{0}, {0}}"<<separator<<"\n";
+				continue;
+			}
+			HuffmanTable table = makeOptimalHuffmanTable(scaleCounts(counts[n]));
+			os<<", qStep="<<qSteps[n]<<"\n    {{";
+			int numSymbols = 0;
+			for (int len = 0; len <= HUFF_MAX_CODE_LENGTH; ++len) {
+				os<<(len ? ", " : "")<<(int)table.numCodes[len];
+				numSymbols += table.numCodes[len];
+			}
+			os<<"},\n     {";
+			for (int s = 0; s < numSymbols; ++s)
+				os<<(s == 0 ? "" : s % 16 ? ", " : ",\n      ")<<(int)table.symbol[s];
+			os<<"}}"<<separator<<"\n";
+		}
+		os<<"};\n"
+			"\n"
+			"} // namespace qs\n"
+			"\n"
+			"#endif /* QS_STDQUANTITYTABLES_H_ */\n";
+	}
+
+private:
+	// counts shifted right until their total, smoothed, fits comfortably in an int, then smoothed.
+	// Scaling keeps the sizes' proportions (and so the table) except for the rarest sizes.
+	static vector<int> scaleCounts(const vector<uint64_t>& counts) {
+		uint64_t total = 0;
+		for (auto count : counts)
+			total += count;
+		int shift = 0;
+		while ((total >> shift) + counts.size() > (uint64_t)1 << 30)
+			shift++;
+		vector<int> smoothed;
+		for (auto count : counts)
+			smoothed.push_back((int)(count >> shift) + 1);
+		return smoothed;
+	}
+
+private:
+	int numStd;
+	vector<vector<uint64_t> > counts; // counts[stdIdx][size], NUM_SIZES sizes
+	vector<uint64_t> numVals;
+	vector<QStep> qSteps;
+};
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * Corpus readers
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+static vector<string> split(const string& str, char delim)
+{
+	vector<string> fields;
+	std::istringstream iss(str);
+	string field;
+	while (std::getline(iss, field, delim)) {
+		size_t first = field.find_first_not_of(" \t\r\"");
+		size_t last = field.find_last_not_of(" \t\r\"");
+		fields.push_back(first == string::npos ? "" : field.substr(first, last - first + 1));
+	}
+	return fields;
+}
+
+// name:exp,name:exp,.. as a QuantityInfo (with qStep 2^exp) per quantity
+static vector<QuantityInfo> getQuantsSpec(const string& quantsSpecStr)
+{
+	vector<QuantityInfo> qInfos;
+	for (const auto& spec : split(quantsSpecStr, ',')) {
+		size_t colon = spec.find(':');
+		int exp = colon == string::npos ? 0 : atoi(spec.c_str() + colon + 1);
+		qInfos.push_back(QuantityInfo(spec.substr(0, colon), "", QStep(0, exp)));
+	}
+	return qInfos;
+}
+
+// Reads a CSV file's columns into columns, and their names (with qSteps from quantsSpec) into qInfos
+static void readCsv(const string& fileName, const vector<QuantityInfo>& quantsSpec,
+		vector<QuantityInfo>& qInfos, vector<vector<double> >& columns)
+{
+	std::ifstream is(fileName.c_str());
+	string line;
+	if (!std::getline(is, line))
+		throw std::logic_error(fileName + ": no header row");
+	qInfos.clear();
+	for (const auto& name : split(line, ',')) {
+		QuantityInfo qInfo(name);
+		for (const auto& spec : quantsSpec) {
+			if (spec.name == name)
+				qInfo.qStep = spec.qStep;
+		}
+		qInfos.push_back(qInfo);
+	}
+	columns.assign(qInfos.size(), vector<double>());
+	while (std::getline(is, line)) {
+		if (line.find_first_not_of(" \t\r") == string::npos)
+			continue;
+		vector<string> fields = split(line, ',');
+		if (fields.size() != qInfos.size())
+			throw std::logic_error(fileName + ": row with the wrong number of values: " + line);
+		for (unsigned n = 0; n < fields.size(); ++n) {
+			char* end;
+			columns[n].push_back(strtod(fields[n].c_str(), &end));
+			if (end == fields[n].c_str())
+				throw std::logic_error(fileName + ": not a number: " + fields[n]);
+		}
+	}
+}
+
+// Decodes a QuantitiesSequence stream of the quantities qInfos into columns
+static void readQs(const string& fileName, const vector<QuantityInfo>& qInfos,
+		vector<vector<double> >& columns)
+{
+	std::ifstream is(fileName.c_str(), std::ios::binary);
+	vector<uint8_t> code((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	QuantitiesSequenceDecoder decoder(qInfos, code.empty() ? NULL : &code[0], code.size());
+	vector<vector<double> > rows = decoder.decode();
+	columns.assign(qInfos.size(), vector<double>());
+	for (const auto& row : rows) {
+		for (unsigned n = 0; n < row.size(); ++n)
+			columns[n].push_back(row[n]);
+	}
+}
+
+// The version of the tables fileName (qs_StdQuantityTables.h) holds, or 0 if there are none
+static int readTablesVersion(const string& fileName)
+{
+	std::ifstream is(fileName.c_str());
+	string line;
+	const string versionDef = "STD_QUANTITY_TABLES_VERSION = ";
+	while (std::getline(is, line)) {
+		size_t pos = line.find(versionDef);
+		if (pos != string::npos)
+			return atoi(line.c_str() + pos + versionDef.size());
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ *
+ *
+ *
+ *
+ *
+ * main
+ *
+ *
+ *
+ *
+ *
+ ******************************************************************************/
+static void usage(int argc, char* argv[])
+{
+	(void)argc;
+	cerr<<argv[0]<<" [-q name:exp,name:exp,..] [-o qs_StdQuantityTables.h] corpusFile.."<<endl;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	string quantsSpecStr;
+	string outFileName;
+	while ((opt = getopt(argc, argv, "q:o:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quantsSpecStr = optarg;
+				break;
+			case 'o':
+				outFileName = optarg;
+				break;
+			default:
+				usage(argc, argv);
+				return 1;
+		}
+	}
+	vector<QuantityInfo> quantsSpec = getQuantsSpec(quantsSpecStr);
+	string commandLine = "qstrain";
+	for (int n = 1; n < argc; ++n)
+		commandLine += string(" ") + argv[n];
+
+	StdQuantityTrainer trainer;
+	try {
+		for (int n = optind; n < argc; ++n) {
+			string fileName = argv[n];
+			vector<QuantityInfo> qInfos = quantsSpec;
+			vector<vector<double> > columns;
+			if (fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".csv") == 0)
+				readCsv(fileName, quantsSpec, qInfos, columns);
+			else
+				readQs(fileName, qInfos, columns);
+			for (unsigned m = 0; m < qInfos.size(); ++m) {
+				if (!trainer.add(qInfos[m], columns[m]))
+					cerr<<fileName<<": "<<qInfos[m].name<<" isn't a standard quantity, ignored"<<endl;
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		cerr<<e.what()<<endl;
+		return 1;
+	}
+
+	// Versions go 1 to 255 and round again: a stream is only checked against the current tables
+	if (outFileName.empty())
+		trainer.writeTables(std::cout, commandLine, 1);
+	else {
+		int version = readTablesVersion(outFileName) % 255 + 1;
+		std::ofstream os(outFileName.c_str());
+		trainer.writeTables(os, commandLine, version);
+	}
+	return 0;
+}
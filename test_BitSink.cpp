@@ -5,7 +5,12 @@
 
 #include "BitSink.h"
 #include "qs_BitSource.h"
+#include "qs_MappedFile.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -29,6 +34,34 @@ private:
 	vector<uint8_t> buf;
 };
 
+// Hands out buf in chunks of 1, 2,.., maxChunk bytes
+class ChunkedByteSource : public ByteSource
+{
+public:
+	ChunkedByteSource(const vector<uint8_t>& buf, size_t maxChunk)
+		: buf(buf), maxChunk(maxChunk), offset(0), chunkSize(0) {}
+	virtual ~ChunkedByteSource() {}
+
+	virtual const vector<uint8_t>& getBytes() {
+		if (offset >= buf.size()) {
+			chunk.clear();
+			return chunk;
+		}
+		chunkSize = chunkSize % maxChunk + 1;
+		size_t len = std::min(chunkSize, buf.size() - offset);
+		chunk.assign(buf.begin() + offset, buf.begin() + offset + len);
+		offset += len;
+		return chunk;
+	}
+
+private:
+	vector<uint8_t> buf;
+	vector<uint8_t> chunk;
+	size_t maxChunk;
+	size_t offset;
+	size_t chunkSize;
+};
+
 TEST_CASE( "BitSink", "[bitsink]" ) {
 	shared_ptr<TestingByteSink> testingByteSink(new TestingByteSink);
 	BitSink bitSink(testingByteSink);
@@ -75,6 +108,178 @@ TEST_CASE( "BitSink", "[bitsink]" ) {
     		REQUIRE(word == shouldBe);
     	}
     }
+
+    SECTION( "WORDWISE and BYTEWISE bit sinks produce the same stream" ) {
+    	shared_ptr<TestingByteSink> byteSink(new TestingByteSink);
+    	BitSink byteBitSink(byteSink, BitSink::BYTEWISE);
+    	vector<uint64_t> codes;
+    	vector<int> sizes;
+    	uint64_t lcg = 12345;
+    	for (int n = 0; n < 5000; ++n) {
+    		lcg = lcg * 6364136223846793005ull + 1442695040888963407ull;
+    		codes.push_back(lcg);
+    		sizes.push_back(1 + (int)((lcg >> 58) % BitSink::MAX_CODE_SIZE));
+    		bitSink.receive(codes.back(), sizes.back());
+    		byteBitSink.receive(codes.back(), sizes.back());
+    	}
+    	bitSink.close();
+    	byteBitSink.close();
+    	REQUIRE(testingByteSink->getBuf() == byteSink->getBuf());
+
+    	shared_ptr<ByteSource> byteSource(new ByteBuffer(testingByteSink->getBuf()));
+    	BitSource bitSource(byteSource);
+    	for (unsigned n = 0; n < codes.size(); ++n) {
+    		uint64_t shouldBe = codes[n] & ((((uint64_t)1) << sizes[n]) - 1);
+    		uint64_t word = 0;
+    		int size = sizes[n];
+    		if (size > 32) {
+    			word = (uint64_t)bitSource.pop(size - 32) << 32;
+    			size = 32;
+    		}
+    		word |= bitSource.pop(size);
+    		REQUIRE(word == shouldBe);
+    	}
+    }
+
+    SECTION( "BlockWriter and receive produce the same stream" ) {
+    	for (auto mode : {BitSink::WORDWISE, BitSink::BYTEWISE}) {
+    		shared_ptr<TestingByteSink> refByteSink(new TestingByteSink);
+    		shared_ptr<TestingByteSink> blockByteSink(new TestingByteSink);
+    		BitSink refBitSink(refByteSink, mode);
+    		BitSink blockBitSink(blockByteSink, mode);
+    		uint64_t lcg = 54321;
+    		for (int block = 0; block < 200; ++block) {
+    			// Blocks of 0,1,..,49 codes through a BlockWriter, then a code received directly
+    			{
+    				BitSink::BlockWriter writer(blockBitSink);
+    				for (int n = 0; n < block % 50; ++n) {
+    					lcg = lcg * 6364136223846793005ull + 1442695040888963407ull;
+    					int size = 1 + (int)((lcg >> 58) % BitSink::MAX_CODE_SIZE);
+    					uint64_t code = lcg & ((((uint64_t)1) << size) - 1);
+    					writer.receive(code, size);
+    					refBitSink.receive(code, size);
+    				}
+    			}
+    			blockBitSink.receive(block, 9);
+    			refBitSink.receive(block, 9);
+    		}
+    		refBitSink.close();
+    		blockBitSink.close();
+    		REQUIRE(refByteSink->getBuf().size() > 2*1024); // Flushed from within BlockWriters
+    		REQUIRE(blockByteSink->getBuf() == refByteSink->getBuf());
+    	}
+    }
+
+    SECTION( "BitSource fast zone" ) {
+    	vector<uint64_t> codes;
+    	vector<int> sizes;
+    	uint64_t lcg = 777;
+    	for (int n = 0; n < 3000; ++n) {
+    		lcg = lcg * 6364136223846793005ull + 1442695040888963407ull;
+    		sizes.push_back(1 + (int)((lcg >> 58) % BitSource::FAST_ZONE_BITS));
+    		codes.push_back(lcg & ((((uint64_t)1) << sizes.back()) - 1));
+    		bitSink.receive(codes.back(), sizes.back());
+    	}
+    	bitSink.close();
+    	vector<uint8_t> code = testingByteSink->getBuf();
+    	BitSource bitSource(&code[0], code.size());
+    	for (unsigned n = 0; n < codes.size(); ++n) {
+    		if (bitSource.refill() >= BitSource::FAST_ZONE_BITS) {
+    			REQUIRE(bitSource.peekFast(sizes[n]) == codes[n]);
+    			bitSource.consumeFast(sizes[n]);
+    		}
+    		else {
+    			// Only the last few bytes are outside the fast zone
+    			REQUIRE(bitSource.getAvailableBits() < 8 * 8 + BitSource::FAST_ZONE_BITS);
+    			REQUIRE(bitSource.peek(sizes[n]) == codes[n]);
+    			bitSource.consume(sizes[n]);
+    		}
+    	}
+    	REQUIRE(bitSource.getAvailableBits() <= 8);
+    }
+
+    SECTION( "BitSource over a caller owned span" ) {
+    	for (int n = 1; n <= 32; ++n) {
+    		bitSink.receive(0x12345678, n);
+    	}
+    	bitSink.close();
+    	vector<uint8_t> code = testingByteSink->getBuf();
+    	BitSource bitSource(&code[0], code.size());
+    	REQUIRE(bitSource.getAvailableBits() == (int)code.size() * 8);
+    	for (int n = 1; n <= 32; ++n) {
+    		uint32_t mask = n < 32 ? ((1u<<n) - 1) : 0xFFFFFFFF;
+    		REQUIRE(bitSource.pop(n) == (0x12345678 & mask));
+    	}
+    	// Only the (all ones) padding bits remain, read right up to the end of the span
+    	int padBits = bitSource.getAvailableBits();
+    	REQUIRE(padBits > 0);
+    	REQUIRE(padBits <= 8);
+    	REQUIRE(bitSource.pop(padBits) == (1u << padBits) - 1);
+    	REQUIRE(bitSource.getAvailableBits() == 0);
+    	REQUIRE_THROWS(bitSource.consume(1));
+    }
+
+    SECTION( "BitSource with a small fixed size buffer" ) {
+    	for (int n = 0; n < 2000; ++n) {
+    		bitSink.receive(n, 1 + n % 25);
+    	}
+    	bitSink.close();
+    	for (size_t bufferSize = BitSource::MIN_BUFFER_SIZE; bufferSize <= 64; bufferSize *= 2) {
+    		shared_ptr<ByteSource> byteSource(new ChunkedByteSource(testingByteSink->getBuf(), 23));
+    		BitSource bitSource(byteSource, bufferSize);
+    		for (int n = 0; n < 2000; ++n) {
+    			int size = 1 + n % 25;
+    			REQUIRE(bitSource.pop(size) == (uint32_t)(n & ((1 << size) - 1)));
+    		}
+    	}
+    }
+
+    SECTION( "Memory mapped file ByteSink and ByteSource" ) {
+    	char path[] = "/tmp/qs_test_XXXXXX";
+    	int fd = mkstemp(path);
+    	REQUIRE(fd >= 0);
+    	close(fd);
+    	{
+    		// Small initial size so the file is grown (remapped) a few times
+    		shared_ptr<MappedFileByteSink> fileSink(new MappedFileByteSink(path, 16));
+    		BitSink fileBitSink(fileSink);
+    		for (int n = 0; n < 3000; ++n) {
+    			fileBitSink.receive(n, 1 + n % 32);
+    			bitSink.receive(n, 1 + n % 32);
+    		}
+    		fileBitSink.close();
+    		bitSink.close();
+    		fileSink->close();
+    	}
+    	shared_ptr<MappedFileByteSource> fileSource(new MappedFileByteSource(path));
+    	REQUIRE(fileSource->getSize() == testingByteSink->getBuf().size());
+    	vector<uint8_t> fileBytes(fileSource->getData(), fileSource->getData() + fileSource->getSize());
+    	REQUIRE(fileBytes == testingByteSink->getBuf());
+
+    	BitSource spanSource(fileSource); // Reads the mapping in place
+    	BitSource chunkSource(shared_ptr<ByteSource>(new MappedFileByteSource(path, true, 100)), 64);
+    	for (int n = 0; n < 3000; ++n) {
+    		int size = 1 + n % 32;
+    		uint32_t shouldBe = (uint32_t)n & (size < 32 ? ((1u << size) - 1) : 0xFFFFFFFF);
+    		REQUIRE(spanSource.pop(size) == shouldBe);
+    		REQUIRE(chunkSource.pop(size) == shouldBe);
+    	}
+    	unlink(path);
+    }
+
+    SECTION( "BitSource over short spans" ) {
+    	const uint8_t data[3] = {0xA5, 0x0F, 0xC3};
+    	for (size_t len = 1; len <= 3; ++len) {
+    		BitSource bitSource(data, len);
+    		REQUIRE(bitSource.getAvailableBits() == (int)len * 8);
+    		for (size_t n = 0; n < len; ++n) {
+    			REQUIRE(bitSource.peek(8) == data[n]);
+    			REQUIRE(bitSource.pop(4) == (uint32_t)(data[n] >> 4));
+    			REQUIRE(bitSource.pop(4) == (uint32_t)(data[n] & 0x0F));
+    		}
+    		REQUIRE(bitSource.getAvailableBits() == 0);
+    	}
+    }
 }
 
 } // namespace qs
@@ -10,7 +10,14 @@
 #include "HuffmanTable.h"
 #include "HuffmanCoder.h"
 #include "HuffmanDecoder.h"
+#include "LutRegistry.h"
+#include "qs_Quantity.h"
+#include "Rans.h"
 
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -43,6 +50,745 @@ TEST_CASE( "IntCoder tests", "[intcoder]" ) {
     		REQUIRE(run.val == val);
     	}
 	}
+
+	SECTION( "SizeIntCoder and SizeIntDecoder with and without fused tables" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		shared_ptr<IntCoder> intCoder(getSizeIntCoder(table));
+		vector<int> seq;
+		uint32_t lcg = 5;
+		for (int n = 0; n < 5000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			int shift = (lcg >> 27) % 4 == 0 ? (lcg >> 16) % 31 : (lcg >> 16) % 6;
+			int val = (int)(lcg >> 1) >> (30 - shift); // mostly small, some large residuals
+			seq.push_back(val);
+			intCoder->code(bitSink, val);
+		}
+		bitSink.close();
+
+		// Coding with any fusedRange gives the same bitstream
+		for (int fusedRange = 0; fusedRange <= MAX_FUSED_RANGE; fusedRange = fusedRange * 16 + 15) {
+			shared_ptr<ByteBufferSink> rangeByteSink(new ByteBufferSink());
+			BitSink rangeBitSink(rangeByteSink);
+			shared_ptr<IntCoder> rangeCoder(getSizeIntCoder(table, fusedRange));
+			for (auto val : seq)
+				rangeCoder->code(rangeBitSink, val);
+			rangeBitSink.close();
+			REQUIRE(rangeByteSink->getBuf() == byteSink->getBuf());
+			REQUIRE(rangeCoder->getCounts() == intCoder->getCounts());
+		}
+
+		for (int fusedLookahead = 1; fusedLookahead <= MAX_FUSED_LOOKAHEAD; fusedLookahead += 5) {
+			qs::BitSource bitSource(&byteSink->getBuf()[0], byteSink->getBuf().size());
+			shared_ptr<IntDecoder> intDecoder(getSizeIntDecoder(table, fusedLookahead));
+			for (auto val: seq) {
+				IntDecoder::Run run;
+				REQUIRE(intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_DECODING_OK);
+				REQUIRE(run.val == val);
+			}
+		}
+
+		// decodeBlock, in uneven blocks, from a span and through a small buffer (so the
+		// available bits often hold less than a block)
+		const vector<uint8_t>& code = byteSink->getBuf();
+		for (size_t bufferSize : {(size_t)0, (size_t)8, (size_t)64}) {
+			shared_ptr<IntDecoder> intDecoder(getSizeIntDecoder(table));
+			shared_ptr<qs::BitSource> bitSource(bufferSize ? new qs::BitSource(
+					shared_ptr<ByteSource>(new qs::ByteBuffer(code)), bufferSize) :
+					new qs::BitSource(&code[0], code.size()));
+			vector<int> decoded(seq.size());
+			size_t numDecoded = 0;
+			for (size_t blockLen = 1; numDecoded < seq.size(); blockLen = blockLen % 300 + 37) {
+				size_t end = std::min(numDecoded + blockLen, seq.size());
+				while (numDecoded < end)
+					numDecoded += intDecoder->decodeBlock(*bitSource, &decoded[numDecoded], end - numDecoded);
+			}
+			REQUIRE(decoded == seq);
+		}
+		// A truncated stream decodes as far as it goes
+		shared_ptr<IntDecoder> intDecoder(getSizeIntDecoder(table));
+		qs::BitSource bitSource(&code[0], code.size() / 2);
+		vector<int> decoded(seq.size());
+		size_t numDecoded = intDecoder->decodeBlock(bitSource, &decoded[0], seq.size());
+		REQUIRE(numDecoded < seq.size());
+		REQUIRE(numDecoded > seq.size() / 4);
+		decoded.resize(numDecoded);
+		REQUIRE(decoded == vector<int>(seq.begin(), seq.begin() + numDecoded));
+	}
+
+	SECTION( "predictiveCode instantiations and QuantitiesSequence blocks code the same" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		const double qStep = 1.0/64;
+		vector<double> data;
+		double val = 3.0;
+		uint32_t lcg = 7;
+		for (int n = 0; n < 1000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			val += ((int)(lcg >> 20) - 2048) / 256.0;
+			data.push_back(val);
+		}
+
+		for (int order = 0; order <= 3; ++order) {
+			// Reference: one virtual call per predict, update and code
+			shared_ptr<ByteBufferSink> refByteSink(new ByteBufferSink());
+			{
+				BitSink refBitSink(refByteSink);
+				shared_ptr<IntPredictor> predictor(getIntPredictor(order));
+				shared_ptr<IntCoder> coder(getSizeIntCoder(table));
+				for (auto d : data) {
+					int x = lround(d / qStep);
+					coder->code(refBitSink, x - predictor->predict());
+					predictor->update(x);
+				}
+				refBitSink.close();
+			}
+			// Dispatched from the interfaces, in uneven blocks
+			shared_ptr<ByteBufferSink> blockByteSink(new ByteBufferSink());
+			{
+				BitSink blockBitSink(blockByteSink);
+				shared_ptr<IntPredictor> predictor(getIntPredictor(order));
+				shared_ptr<IntCoder> coder(getSizeIntCoder(table));
+				for (int n = 0; n < (int)data.size(); n += 77) {
+					int len = std::min(77, (int)data.size() - n);
+					predictiveCode(&data[n], len, 1/qStep, *predictor, *coder, blockBitSink);
+				}
+				blockBitSink.close();
+			}
+			REQUIRE(blockByteSink->getBuf() == refByteSink->getBuf());
+		}
+		REQUIRE_THROWS(getIntPredictor(4));
+
+		// SelectablePredictor carries its last three values over order changes, blocks shorter
+		// than that included
+		SelectablePredictor refPredictor, blockPredictor, decodePredictor;
+		int blockOrder = 0;
+		for (int n = 0, len = 1; n < (int)data.size(); n += len, len = len*5 % 37 + 1) {
+			len = std::min(len, (int)data.size() - n);
+			blockOrder = (blockOrder + len) % (SelectablePredictor::MAX_ORDER + 1);
+			refPredictor.setOrder(blockOrder);
+			blockPredictor.setOrder(blockOrder);
+			decodePredictor.setOrder(blockOrder);
+			vector<int> refResiduals, residuals(len), xs(len);
+			vector<double> vals(len);
+			for (int i = 0; i < len; ++i) {
+				int x = lround(data[n + i] / qStep);
+				refResiduals.push_back(x - refPredictor.predict());
+				refPredictor.update(x);
+			}
+			blockPredictor.quantizeBlock(&data[n], len, 1/qStep, &residuals[0], NULL, NULL);
+			REQUIRE(residuals == refResiduals);
+			decodePredictor.reconstructBlock(&residuals[0], len, qStep, &xs[0], &vals[0]);
+			for (int i = 0; i < len; ++i)
+				REQUIRE(vals[i] == lround(data[n + i] / qStep) * qStep);
+		}
+
+		// QuantitiesSequence (second order predictor, default table) codes each quantity like
+		// DoublesCoder, after its 4 byte length and 1 byte (default) table field
+		vector<QuantityInfo> qInfos = {QuantityInfo("a", "", QStep(0, -6)),
+				QuantityInfo("b", "", QStep(128, -3))};
+		QuantitiesSequence qs(qInfos);
+		for (auto d : data)
+			qs.push({d, -2*d});
+		vector<uint8_t> shouldBe = {0, 0, 1000 >> 8, 1000 & 0xFF};
+		for (unsigned m = 0; m < qInfos.size(); ++m) {
+			shared_ptr<ByteBufferSink> mByteSink(new ByteBufferSink());
+			shared_ptr<BitSink> mBitSink(new BitSink(mByteSink));
+			DoublesCoder coder(m == 0 ? 1.0/64 : 1.5/8, shared_ptr<IntPredictor>(getIntPredictor(2)),
+					shared_ptr<IntCoder>(getSizeIntCoder(table)), mBitSink);
+			vector<double> mData;
+			for (auto d : data)
+				mData.push_back(m == 0 ? d : -2*d);
+			coder.code(&mData[0], mData.size());
+			mBitSink->close();
+			uint32_t numBytes = mByteSink->getBuf().size() + 1;
+			for (int shift = 24; shift >= 0; shift -= 8)
+				shouldBe.push_back((uint8_t)(numBytes >> shift));
+			shouldBe.push_back(0);
+			shouldBe.insert(shouldBe.end(), mByteSink->getBuf().begin(), mByteSink->getBuf().end());
+		}
+		REQUIRE(qs.getCode() == shouldBe);
+	}
+
+	SECTION( "codeBlock codes and counts as code does" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		vector<int> vals;
+		uint32_t lcg = 9;
+		for (int n = 0; n < 3000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			vals.push_back((int)(lcg >> (8 + lcg % 23)) - (int)(lcg >> (9 + lcg % 23)));
+		}
+		vals.push_back(INT_MAX);
+		vals.push_back(-INT_MAX);
+		// A small fusedRange, so many values take the slow path from within blocks
+		for (int fusedRange : {0, 15, DEFAULT_FUSED_RANGE}) {
+			vector<shared_ptr<IntCoder> > refCoders = {shared_ptr<IntCoder>(getSizeIntCoder(table,
+					fusedRange)), shared_ptr<IntCoder>(new SizeCounter()),
+					shared_ptr<IntCoder>(new ContextSizeCounter()),
+					shared_ptr<IntCoder>(getAdaptiveSizeIntCoder(table, 256, 4, fusedRange))};
+			vector<shared_ptr<IntCoder> > blockCoders = {shared_ptr<IntCoder>(getSizeIntCoder(table,
+					fusedRange)), shared_ptr<IntCoder>(new SizeCounter()),
+					shared_ptr<IntCoder>(new ContextSizeCounter()),
+					shared_ptr<IntCoder>(getAdaptiveSizeIntCoder(table, 256, 4, fusedRange))};
+			for (unsigned c = 0; c < refCoders.size(); ++c) {
+				shared_ptr<ByteBufferSink> refByteSink(new ByteBufferSink());
+				shared_ptr<ByteBufferSink> blockByteSink(new ByteBufferSink());
+				{
+					BitSink refBitSink(refByteSink);
+					BitSink blockBitSink(blockByteSink);
+					for (auto val : vals)
+						refCoders[c]->code(refBitSink, val);
+					for (size_t n = 0; n < vals.size(); n += 101)
+						blockCoders[c]->codeBlock(blockBitSink, &vals[n], std::min((size_t)101, vals.size() - n));
+					refBitSink.close();
+					blockBitSink.close();
+				}
+				REQUIRE(blockByteSink->getBuf() == refByteSink->getBuf());
+				REQUIRE(blockCoders[c]->getCounts() == refCoders[c]->getCounts());
+			}
+		}
+		// The slow path throws from within a block as code does
+		shared_ptr<IntCoder> intCoder(getSizeIntCoder(table));
+		vector<int> withMin = {1, 2, INT_MIN, 3};
+		REQUIRE_THROWS(intCoder->codeBlock(bitSink, &withMin[0], withMin.size()));
+	}
+
+	SECTION( "Quantize kernels quantize, predict and size as the predictors and coders do" ) {
+		vector<double> data;
+		double val = -5.0;
+		uint32_t lcg = 11;
+		for (int n = 0; n < 1500; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			val += ((int)(lcg >> (12 + lcg % 13)) - (int)(lcg >> (13 + lcg % 13))) / 64.0;
+			data.push_back(n % 97 == 3 ? val + 0.5/64 : val); // Some halves
+		}
+		data.push_back(-0.5);
+		data.push_back(2.5);
+		data.push_back(1e6);
+		data.push_back(-1e6);
+		data.push_back(0.0);
+
+		vector<QuantizeResidualsKernel*> kernels;
+		for (auto& codecKernels : getSupportedCodecKernels())
+			kernels.push_back(codecKernels.quantizeResiduals);
+		for (int order = 0; order <= 2; ++order) {
+			vector<int> refResiduals;
+			vector<uint8_t> refSizes;
+			vector<uint32_t> refAmps;
+			shared_ptr<IntPredictor> predictor(getIntPredictor(order));
+			for (auto d : data) {
+				int x = lround(d * 64);
+				int r = x - predictor->predict();
+				predictor->update(x);
+				int size = bitLength(r < 0 ? -(uint32_t)r : r);
+				refResiduals.push_back(r);
+				refSizes.push_back(size);
+				refAmps.push_back((uint32_t)(r < 0 ? r - 1 : r) & (uint32_t)(((uint64_t)1 << size) - 1));
+			}
+			for (auto kernel : kernels) {
+				vector<int> residuals(data.size());
+				vector<uint8_t> sizes(data.size());
+				vector<uint32_t> amps(data.size());
+				int prev1 = 0, prev2 = 0;
+				// In uneven lengths, carrying prev1 and prev2 over
+				for (size_t n = 0; n < data.size(); n += 301) {
+					size_t len = std::min((size_t)301, data.size() - n);
+					kernel(&data[n], len, 64, order, prev1, prev2, &residuals[n], &sizes[n], &amps[n]);
+				}
+				REQUIRE(residuals == refResiduals);
+				REQUIRE(sizes == refSizes);
+				REQUIRE(amps == refAmps);
+
+				// Residuals only
+				vector<int> onlyResiduals(data.size());
+				prev1 = prev2 = 0;
+				kernel(&data[0], data.size(), 64, order, prev1, prev2, &onlyResiduals[0], nullptr, nullptr);
+				REQUIRE(onlyResiduals == refResiduals);
+				int unused = 0;
+				REQUIRE_THROWS(kernel(&data[0], data.size(), 64, 3, prev1, unused, &residuals[0], &sizes[0], &amps[0]));
+			}
+		}
+
+		// predictiveCode codes sizes and amps for the coders that use them as code does
+		for (int c = 0; c < 3; ++c) {
+			shared_ptr<IntCoder> refCoder(c == 0 ? new SizeCounter() : c == 1 ?
+					(IntCoder*)new ContextSizeCounter() : getRansIntCoder(1003));
+			shared_ptr<IntCoder> blockCoder(c == 0 ? new SizeCounter() : c == 1 ?
+					(IntCoder*)new ContextSizeCounter() : getRansIntCoder(1003));
+			REQUIRE(blockCoder->usesSizeAmps());
+			shared_ptr<ByteBufferSink> refByteSink(new ByteBufferSink());
+			shared_ptr<ByteBufferSink> blockByteSink(new ByteBufferSink());
+			{
+				BitSink refBitSink(refByteSink);
+				BitSink blockBitSink(blockByteSink);
+				shared_ptr<IntPredictor> refPredictor(getIntPredictor(2));
+				for (auto d : data) {
+					int x = lround(d * 64);
+					refCoder->code(refBitSink, x - refPredictor->predict());
+					refPredictor->update(x);
+				}
+				shared_ptr<IntPredictor> blockPredictor(getIntPredictor(2));
+				predictiveCode(&data[0], data.size(), 64, *blockPredictor, *blockCoder, blockBitSink);
+				refCoder->flush(refBitSink);
+				blockCoder->flush(blockBitSink);
+				refBitSink.close();
+				blockBitSink.close();
+			}
+			REQUIRE(blockByteSink->getBuf() == refByteSink->getBuf());
+			REQUIRE(blockCoder->getCounts() == refCoder->getCounts());
+		}
+	}
+
+	SECTION( "Reconstruct kernels invert the quantize kernels" ) {
+		vector<int> residuals;
+		uint32_t lcg = 13;
+		for (int n = 0; n < 2000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			residuals.push_back((int)(lcg >> (8 + lcg % 23)) - (int)(lcg >> (9 + lcg % 23)));
+		}
+		residuals.insert(residuals.begin() + 500, {INT_MAX, INT_MAX, INT_MIN, 1, -INT_MAX}); // Wrap
+
+		vector<ReconstructResidualsKernel*> kernels;
+		for (auto& codecKernels : getSupportedCodecKernels())
+			kernels.push_back(codecKernels.reconstructResiduals);
+		const double qStep = 1.5/8;
+		for (int order = 0; order <= 2; ++order) {
+			vector<int> refXs;
+			vector<double> refVals;
+			shared_ptr<IntPredictor> predictor(getIntPredictor(order, 5, -3));
+			for (auto r : residuals) {
+				int x = (int)((uint32_t)r + (uint32_t)predictor->predict());
+				predictor->update(x);
+				refXs.push_back(x);
+				refVals.push_back(x * qStep);
+			}
+			for (auto kernel : kernels) {
+				vector<int> xs(residuals.size());
+				vector<double> vals(residuals.size());
+				int prev1 = 5, prev2 = -3;
+				// In lengths shorter and longer than a vector, carrying prev1 and prev2 over
+				size_t len = 1;
+				for (size_t n = 0; n < residuals.size(); n += len, len = len*3 % 61 + 1) {
+					len = std::min(len, residuals.size() - n);
+					kernel(&residuals[n], len, qStep, order, prev1, prev2, &xs[n], &vals[n]);
+				}
+				REQUIRE(xs == refXs);
+				REQUIRE(vals == refVals);
+
+				// Ints only
+				vector<int> onlyXs(residuals.size());
+				prev1 = 5;
+				prev2 = -3;
+				kernel(&residuals[0], residuals.size(), qStep, order, prev1, prev2, &onlyXs[0], nullptr);
+				REQUIRE(onlyXs == refXs);
+				REQUIRE_THROWS(kernel(&residuals[0], residuals.size(), qStep, -1, prev1, prev2, &xs[0], &vals[0]));
+			}
+
+			// The predictors' reconstructBlock inverts their quantizeBlock
+			vector<double> data;
+			for (int n = 0; n < 1000; ++n)
+				data.push_back(refVals[n] + (n % 3 - 1) * qStep / 4);
+			shared_ptr<IntPredictor> encodePredictor(getIntPredictor(order, 5, -3));
+			shared_ptr<IntPredictor> decodePredictor(getIntPredictor(order, 5, -3));
+			int blockResiduals[300], xs[300];
+			uint8_t sizes[300];
+			uint32_t amps[300];
+			double vals[300];
+			for (int n = 0; n < (int)data.size(); n += 300) {
+				int len = std::min(300, (int)data.size() - n);
+				encodePredictor->quantizeBlock(&data[n], len, 1/qStep, blockResiduals, sizes, amps);
+				decodePredictor->reconstructBlock(blockResiduals, len, qStep, xs, vals);
+				for (int i = 0; i < len; ++i)
+					REQUIRE(vals[i] == refVals[n + i]);
+			}
+		}
+	}
+
+	SECTION( "Every supported kernel set gives the scalar kernels' output" ) {
+		const vector<CodecKernels>& kernels = getSupportedCodecKernels();
+		REQUIRE(std::string(kernels[0].name) == "scalar");
+		REQUIRE(&getCodecKernels() == &kernels.back());
+#if QS_HAVE_X86_KERNELS
+		REQUIRE(std::string(getCodecKernels().name) == (__builtin_cpu_supports("avx2") ? "avx2" :
+				__builtin_cpu_supports("sse4.1") ? "sse4.1" : "scalar"));
+#endif
+		// Values of all magnitudes, many at or next to halves
+		vector<double> data;
+		uint32_t lcg = 17;
+		for (int n = 0; n < 20000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			double val = ldexp((double)(int)lcg, -(int)(lcg % 31) - 2);
+			if (n % 4 == 1)
+				val = round(val) + (val < 0 ? -0.5 : 0.5);
+			else if (n % 4 == 2)
+				val = nextafter(round(val) + 0.5, n % 8 < 4 ? 0.0 : 1e9);
+			data.push_back(val);
+		}
+		for (int order = 0; order <= 2; ++order) {
+			vector<int> scalarResiduals(data.size());
+			vector<uint8_t> scalarSizes(data.size());
+			vector<uint32_t> scalarAmps(data.size());
+			vector<int> scalarXs(data.size());
+			vector<double> scalarVals(data.size());
+			for (auto& codecKernels : kernels) {
+				vector<int> residuals(data.size());
+				vector<uint8_t> sizes(data.size());
+				vector<uint32_t> amps(data.size());
+				vector<int> xs(data.size());
+				vector<double> vals(data.size());
+				int prev1 = 0, prev2 = 0;
+				codecKernels.quantizeResiduals(&data[0], data.size(), 1.0, order, prev1, prev2,
+						&residuals[0], &sizes[0], &amps[0]);
+				prev1 = prev2 = 0;
+				codecKernels.reconstructResiduals(&residuals[0], residuals.size(), 0.5, order, prev1,
+						prev2, &xs[0], &vals[0]);
+				if (&codecKernels == &kernels[0]) {
+					scalarResiduals = residuals;
+					scalarSizes = sizes;
+					scalarAmps = amps;
+					scalarXs = xs;
+					scalarVals = vals;
+				}
+				REQUIRE(residuals == scalarResiduals);
+				REQUIRE(sizes == scalarSizes);
+				REQUIRE(amps == scalarAmps);
+				REQUIRE(xs == scalarXs);
+				REQUIRE(vals == scalarVals);
+			}
+			for (size_t n = 0; n < data.size(); ++n)
+				REQUIRE(scalarXs[n] == lround(data[n]));
+		}
+	}
+
+	SECTION( "Adaptive SizeIntCoder and SizeIntDecoder" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		// Small residuals, then large ones, then small again
+		vector<int> seq;
+		uint32_t lcg = 9;
+		for (int n = 0; n < 6000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			int shift = n >= 2000 && n < 4000 ? 9 : 2;
+			seq.push_back(((int)(lcg >> 8) % (1 << shift)) - (1 << (shift - 1)));
+		}
+		const int period = 256;
+		shared_ptr<IntCoder> staticCoder(getSizeIntCoder(table));
+		shared_ptr<IntCoder> adaptiveCoder(getAdaptiveSizeIntCoder(table, period, 2));
+		shared_ptr<ByteBufferSink> adaptiveByteSink(new ByteBufferSink());
+		{
+			BitSink adaptiveBitSink(adaptiveByteSink);
+			for (auto val : seq) {
+				staticCoder->code(bitSink, val);
+				adaptiveCoder->code(adaptiveBitSink, val);
+			}
+			adaptiveBitSink.close();
+		}
+		bitSink.close();
+		REQUIRE(adaptiveCoder->getCounts() == staticCoder->getCounts());
+		REQUIRE(adaptiveByteSink->getBuf().size() < byteSink->getBuf().size());
+
+		const vector<uint8_t>& code = adaptiveByteSink->getBuf();
+		for (int fusedLookahead = 1; fusedLookahead <= MAX_FUSED_LOOKAHEAD; fusedLookahead += 5) {
+			qs::BitSource bitSource(&code[0], code.size());
+			shared_ptr<IntDecoder> intDecoder(getAdaptiveSizeIntDecoder(table, period, 2, fusedLookahead));
+			for (auto val: seq) {
+				IntDecoder::Run run;
+				REQUIRE(intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_DECODING_OK);
+				REQUIRE(run.val == val);
+			}
+		}
+		// Read through a small buffer, so decode sometimes needs more bits
+		shared_ptr<qs::ByteBuffer> byteSource(new qs::ByteBuffer(code));
+		qs::BitSource bitSource(byteSource, 8);
+		shared_ptr<IntDecoder> intDecoder(getAdaptiveSizeIntDecoder(table, period, 2));
+		for (auto val: seq) {
+			IntDecoder::Run run;
+			while (intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_NEED_MORE_BITS)
+				;
+			REQUIRE(run.val == val);
+		}
+		// Periods too short to build the next table during the period
+		for (int shortPeriod = 1; shortPeriod <= 4; ++shortPeriod) {
+			shared_ptr<IntCoder> shortCoder(getAdaptiveSizeIntCoder(table, shortPeriod, 2));
+			shared_ptr<ByteBufferSink> shortByteSink(new ByteBufferSink());
+			{
+				BitSink shortBitSink(shortByteSink);
+				for (int n = 0; n < 200; ++n)
+					shortCoder->code(shortBitSink, seq[n]);
+				shortBitSink.close();
+			}
+			const vector<uint8_t>& shortCode = shortByteSink->getBuf();
+			qs::BitSource shortBitSource(&shortCode[0], shortCode.size());
+			shared_ptr<IntDecoder> shortDecoder(getAdaptiveSizeIntDecoder(table, shortPeriod, 2));
+			for (int n = 0; n < 200; ++n) {
+				IntDecoder::Run run;
+				REQUIRE(shortDecoder->decode(shortBitSource, run) == HuffmanDecoder::HUFF_DECODING_OK);
+				REQUIRE(run.val == seq[n]);
+			}
+		}
+	}
+
+	SECTION( "SizeIntCoder with a staged fusedLut codes the same" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		SizeIntCoder coder(shared_ptr<SizeCoderLuts>(new SizeCoderLuts(table, DEFAULT_FUSED_RANGE)));
+		shared_ptr<SizeCoderLuts> stagedLuts(new SizeCoderLuts(table, DEFAULT_FUSED_RANGE, true));
+		REQUIRE_THROWS(SizeIntCoder{stagedLuts});
+		int numSteps = 1;
+		while (!stagedLuts->generateFusedLut(1000))
+			numSteps++;
+		REQUIRE(numSteps == (2*DEFAULT_FUSED_RANGE + 1 + 999) / 1000);
+		SizeIntCoder stagedCoder(stagedLuts);
+		shared_ptr<ByteBufferSink> stagedByteSink(new ByteBufferSink());
+		BitSink stagedBitSink(stagedByteSink);
+		for (int val = -5000; val <= 5000; val += 7) {
+			coder.code(bitSink, val);
+			stagedCoder.code(stagedBitSink, val);
+		}
+		bitSink.close();
+		stagedBitSink.close();
+		REQUIRE(stagedByteSink->getBuf() == byteSink->getBuf());
+	}
+
+	SECTION( "Coders and decoders of a table share their LUTs" ) {
+		HuffmanTable table = getDefaultHuffmanTable();
+		REQUIRE(hashHuffmanTable(table) == hashHuffmanTable(getDefaultHuffmanTable()));
+		REQUIRE(hashHuffmanTable(table) != hashHuffmanTable(getBuiltinHuffmanTable(1)));
+		REQUIRE(getSizeCoderLuts(table) == getSizeCoderLuts(getDefaultHuffmanTable()));
+		REQUIRE(getSizeCoderLuts(table) != getSizeCoderLuts(table, 100));
+		REQUIRE(getSizeCoderLuts(table) != getSizeCoderLuts(getBuiltinHuffmanTable(1)));
+		REQUIRE(getSizeDecoderLuts(table) == getSizeDecoderLuts(getDefaultHuffmanTable()));
+		REQUIRE(getSizeDecoderLuts(table) != getSizeDecoderLuts(table, 8));
+
+		// A full registry drops the LUTs no one holds, or if everyone's held doesn't register more
+		LutRegistry<SizeCoderLuts> registry(2);
+		shared_ptr<const SizeCoderLuts> luts0 = registry.get(getBuiltinHuffmanTable(0), 10);
+		shared_ptr<const SizeCoderLuts> luts1 = registry.get(getBuiltinHuffmanTable(1), 10);
+		REQUIRE(registry.get(getBuiltinHuffmanTable(2), 10) != registry.get(getBuiltinHuffmanTable(2), 10));
+		REQUIRE(registry.size() == 2);
+		luts1.reset();
+		shared_ptr<const SizeCoderLuts> luts2 = registry.get(getBuiltinHuffmanTable(2), 10);
+		REQUIRE(registry.get(getBuiltinHuffmanTable(2), 10) == luts2);
+		REQUIRE(registry.get(getBuiltinHuffmanTable(0), 10) == luts0);
+		REQUIRE(registry.size() == 2);
+	}
+
+	SECTION( "RansIntCoder and RansIntDecoder" ) {
+		// Mostly zero (a nearly constant quantity), then small residuals, and a few large ones
+		vector<int> seq;
+		uint32_t lcg = 5;
+		for (int n = 0; n < 10000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			int shift = n < 3000 ? ((lcg >> 28) == 0 ? 1 : 0) : (lcg >> 29) == 0 ? 20 : 3;
+			seq.push_back(shift ? ((int)(lcg >> 8) % (1 << shift)) - (1 << (shift - 1)) : 0);
+		}
+		seq.push_back(INT_MAX);
+		seq.push_back(INT_MIN + 1);
+		// A long nearly constant stretch, where the size 0 frequency is close to RANS_PROB_SCALE
+		for (int n = 0; n < 20000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			seq.push_back((lcg >> 24) == 0 ? (int)(lcg >> 8 & 3) - 2 : 0);
+		}
+		shared_ptr<IntCoder> sizeCoder(getSizeIntCoder(getDefaultHuffmanTable()));
+		for (int numStates : {1, 4, 8})
+		for (int blockSize : {7, 1003, DEFAULT_RANS_BLOCK_SIZE, MAX_RANS_BLOCK_SIZE}) {
+			shared_ptr<IntCoder> ransCoder(getRansIntCoder(blockSize, numStates));
+			shared_ptr<ByteBufferSink> ransByteSink(new ByteBufferSink());
+			{
+				BitSink ransBitSink(ransByteSink);
+				for (auto val : seq)
+					ransCoder->code(ransBitSink, val);
+				ransCoder->flush(ransBitSink);
+				ransBitSink.close();
+			}
+			const vector<uint8_t>& code = ransByteSink->getBuf();
+			if (blockSize == DEFAULT_RANS_BLOCK_SIZE && numStates == DEFAULT_RANS_STATES) {
+				for (auto val : seq)
+					sizeCoder->code(bitSink, val);
+				bitSink.close();
+				REQUIRE(ransCoder->getCounts() == sizeCoder->getCounts());
+				REQUIRE(code.size() < byteSink->getBuf().size());
+			}
+
+			qs::BitSource bitSource(&code[0], code.size());
+			shared_ptr<IntDecoder> intDecoder(getRansIntDecoder(numStates));
+			IntDecoder::Run run;
+			vector<int> decoded;
+			while (intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_DECODING_OK)
+				decoded.push_back(run.val);
+			REQUIRE(decoded == seq);
+
+			// Read through a small buffer, so decode sometimes needs more bits
+			shared_ptr<qs::ByteBuffer> byteSource(new qs::ByteBuffer(code));
+			qs::BitSource smallBitSource(byteSource, 8);
+			intDecoder.reset(getRansIntDecoder(numStates));
+			decoded.clear();
+			while (decoded.size() < seq.size()) {
+				while (intDecoder->decode(smallBitSource, run) == HuffmanDecoder::HUFF_NEED_MORE_BITS)
+					;
+				decoded.push_back(run.val);
+			}
+			REQUIRE(decoded == seq);
+		}
+		REQUIRE_THROWS(getRansIntCoder(0));
+		REQUIRE_THROWS(getRansIntCoder(MAX_RANS_BLOCK_SIZE + 1));
+		REQUIRE_THROWS(getRansIntCoder(DEFAULT_RANS_BLOCK_SIZE, 2));
+		REQUIRE_THROWS(getRansIntDecoder(2));
+
+		// A block of one size costs only its header
+		shared_ptr<IntCoder> ransCoder(getRansIntCoder());
+		shared_ptr<ByteBufferSink> constantByteSink(new ByteBufferSink());
+		BitSink constantBitSink(constantByteSink);
+		for (int n = 0; n < DEFAULT_RANS_BLOCK_SIZE; ++n)
+			ransCoder->code(constantBitSink, 0);
+		ransCoder->flush(constantBitSink);
+		constantBitSink.close();
+		REQUIRE(constantByteSink->getBuf().size() == (16 + 5 + 13 + 32 + DEFAULT_RANS_STATES*32 + 7) / 8);
+	}
+
+	SECTION( "ransNormalize" ) {
+		vector<uint32_t> counts = {1000000, 1, 0, 3, 999, 1};
+		vector<uint32_t> freqs = ransNormalize(counts);
+		uint32_t sum = 0;
+		for (unsigned s = 0; s < counts.size(); ++s) {
+			REQUIRE((freqs[s] == 0) == (counts[s] == 0));
+			sum += freqs[s];
+		}
+		REQUIRE(sum == RANS_PROB_SCALE);
+		REQUIRE(ransNormalize({0, 7}) == vector<uint32_t>({0, RANS_PROB_SCALE}));
+		REQUIRE_THROWS(ransNormalize({0, 0}));
+	}
+
+	SECTION( "ArithIntCoder and ArithIntDecoder" ) {
+		// Runs of small and large residuals, so the previous size is a good context
+		vector<int> seq;
+		uint32_t lcg = 7;
+		for (int n = 0; n < 20000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			int shift = (n / 500) % 3 == 0 ? 0 : (n / 500) % 3 == 1 ? 3 : 12;
+			seq.push_back(shift ? ((int)(lcg >> 8) % (1 << shift)) - (1 << (shift - 1)) : 0);
+		}
+		seq.push_back(INT_MAX);
+		seq.push_back(INT_MIN + 1);
+		seq.push_back(-1);
+		seq.push_back(1);
+		shared_ptr<IntCoder> sizeCoder(getSizeIntCoder(getDefaultHuffmanTable()));
+		shared_ptr<IntCoder> ransCoder(getRansIntCoder());
+		shared_ptr<ByteBufferSink> ransByteSink(new ByteBufferSink());
+		{
+			BitSink ransBitSink(ransByteSink);
+			for (auto val : seq) {
+				sizeCoder->code(bitSink, val);
+				ransCoder->code(ransBitSink, val);
+			}
+			ransCoder->flush(ransBitSink);
+			ransBitSink.close();
+		}
+		bitSink.close();
+		for (int blockSize : {1, 1000, DEFAULT_ARITH_BLOCK_SIZE, MAX_ARITH_BLOCK_SIZE}) {
+			shared_ptr<IntCoder> arithCoder(getArithIntCoder(blockSize));
+			shared_ptr<ByteBufferSink> arithByteSink(new ByteBufferSink());
+			{
+				BitSink arithBitSink(arithByteSink);
+				for (auto val : seq)
+					arithCoder->code(arithBitSink, val);
+				arithCoder->flush(arithBitSink);
+				arithBitSink.close();
+			}
+			const vector<uint8_t>& code = arithByteSink->getBuf();
+			REQUIRE(arithCoder->getCounts() == sizeCoder->getCounts());
+			if (blockSize != 1) {
+				REQUIRE(code.size() < ransByteSink->getBuf().size());
+				REQUIRE(code.size() < byteSink->getBuf().size());
+			}
+
+			qs::BitSource bitSource(&code[0], code.size());
+			shared_ptr<IntDecoder> intDecoder(getArithIntDecoder());
+			IntDecoder::Run run;
+			vector<int> decoded;
+			while (intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_DECODING_OK)
+				decoded.push_back(run.val);
+			REQUIRE(decoded == seq);
+
+			// Read through a small buffer, so decode sometimes needs more bits
+			shared_ptr<qs::ByteBuffer> byteSource(new qs::ByteBuffer(code));
+			qs::BitSource smallBitSource(byteSource, 8);
+			intDecoder.reset(getArithIntDecoder());
+			decoded.clear();
+			while (decoded.size() < seq.size()) {
+				while (intDecoder->decode(smallBitSource, run) == HuffmanDecoder::HUFF_NEED_MORE_BITS)
+					;
+				decoded.push_back(run.val);
+			}
+			REQUIRE(decoded == seq);
+		}
+		REQUIRE_THROWS(getArithIntCoder(0));
+		REQUIRE_THROWS(getArithIntCoder(MAX_ARITH_BLOCK_SIZE + 1));
+	}
+	SECTION( "ContextSizeIntCoder and ContextSizeIntDecoder" ) {
+		// Bursts of large residuals between stretches of small ones
+		vector<int> seq;
+		uint32_t lcg = 13;
+		for (int n = 0; n < 20000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			int shift = (n / 50) % 4 == 3 ? 10 : 1;
+			seq.push_back(((int)(lcg >> 8) % (1 << shift)) - (1 << (shift - 1)));
+		}
+		ContextSizeCounter counter;
+		for (auto val : seq)
+			counter.code(bitSink, val);
+		REQUIRE(counter.getContextCounts().size() == (size_t)NUM_SIZE_CONTEXTS);
+		vector<int> sumCounts(HUFF_MAX_NUMBER_SYMBOLS, 0);
+		vector<HuffmanTable> tables;
+		for (const auto& counts : counter.getContextCounts()) {
+			for (unsigned size = 0; size < counts.size(); ++size)
+				sumCounts[size] += counts[size];
+			bool anyCounts = std::any_of(counts.begin(), counts.end(), [](int c) { return c > 0; });
+			tables.push_back(anyCounts ? makeOptimalHuffmanTable(counts) : getDefaultHuffmanTable());
+		}
+		REQUIRE(sumCounts == counter.getCounts());
+
+		// The context tables code the sequence in fewer bits than its optimal single table
+		shared_ptr<IntCoder> sizeCoder(getSizeIntCoder(makeOptimalHuffmanTable(counter.getCounts())));
+		shared_ptr<IntCoder> contextCoder(getContextSizeIntCoder(tables));
+		shared_ptr<ByteBufferSink> contextByteSink(new ByteBufferSink());
+		{
+			BitSink contextBitSink(contextByteSink);
+			for (auto val : seq) {
+				sizeCoder->code(bitSink, val);
+				contextCoder->code(contextBitSink, val);
+			}
+			contextBitSink.close();
+		}
+		bitSink.close();
+		REQUIRE(contextCoder->getCounts() == counter.getCounts());
+		const vector<uint8_t>& code = contextByteSink->getBuf();
+		REQUIRE(code.size() < byteSink->getBuf().size());
+
+		for (int fusedLookahead = 1; fusedLookahead <= MAX_FUSED_LOOKAHEAD; fusedLookahead += 5) {
+			qs::BitSource bitSource(&code[0], code.size());
+			shared_ptr<IntDecoder> intDecoder(getContextSizeIntDecoder(tables, fusedLookahead));
+			vector<int> decoded;
+			IntDecoder::Run run;
+			for (size_t n = 0; n < seq.size(); ++n) {
+				REQUIRE(intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_DECODING_OK);
+				decoded.push_back(run.val);
+			}
+			REQUIRE(decoded == seq);
+		}
+		// Read through a small buffer, so decode sometimes needs more bits
+		shared_ptr<qs::ByteBuffer> byteSource(new qs::ByteBuffer(code));
+		qs::BitSource bitSource(byteSource, 8);
+		shared_ptr<IntDecoder> intDecoder(getContextSizeIntDecoder(tables));
+		vector<int> decoded;
+		IntDecoder::Run run;
+		while (decoded.size() < seq.size()) {
+			while (intDecoder->decode(bitSource, run) == HuffmanDecoder::HUFF_NEED_MORE_BITS)
+				;
+			decoded.push_back(run.val);
+		}
+		REQUIRE(decoded == seq);
+
+		tables.pop_back();
+		REQUIRE_THROWS(getContextSizeIntCoder(tables));
+		REQUIRE_THROWS(getContextSizeIntDecoder(tables));
+	}
 }
 
 } // namespace qs
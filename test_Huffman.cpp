@@ -4,6 +4,7 @@
 #include "catch.hpp"
 
 #include "BitSink.h"
+#include "BuiltinHuffmanTables.h"
 #include "qs_BitSource.h"
 #include "Coders.h"
 #include "Decoders.h"
@@ -12,7 +13,10 @@
 #include "HuffmanDecoder.h"
 #include "Modeller.h"
 
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <queue>
 #include <vector>
 
 using std::shared_ptr;
@@ -58,6 +62,70 @@ TEST_CASE( "Huffman coding", "[huffman]" ) {
     	REQUIRE(availBits == 6);
     }
 
+	SECTION( "Multi symbol huffman decoding" ) {
+		qs::HuffmanTable smallTable = { {0, 0, 3, 1, 1}, {2, 3, 1, 0, 4} };
+		std::vector<qs::HuffmanTable> tables = {smallTable, getDefaultHuffmanTable()};
+		for (const auto& huffTable : tables) {
+			int numSymbols = 0;
+			for (int len = 1; len <= HUFF_MAX_CODE_LENGTH; ++len)
+				numSymbols += huffTable.numCodes[len];
+			std::vector<uint8_t> symbols;
+			uint32_t lcg = 99;
+			shared_ptr<ByteBufferSink> byteSink(new ByteBufferSink());
+			BitSink bitSink(byteSink);
+			HuffmanCoder huffCoder(huffTable);
+			for (int n = 0; n < 5000; ++n) {
+				lcg = lcg * 1664525 + 1013904223;
+				// Favour the first (shortest) codes
+				int idx = (lcg >> 24) % 4 == 0 ? (lcg >> 8) % numSymbols : (lcg >> 8) % 3;
+				symbols.push_back(huffTable.symbol[idx]);
+				huffCoder.code(bitSink, symbols.back());
+			}
+			bitSink.close();
+
+			for (int lookahead = 11; lookahead <= 12; ++lookahead) {
+				qs::HuffmanDecoder huffDecoder(huffTable);
+				huffDecoder.generateMultiSymbolLut(lookahead);
+				qs::BitSource bitSource(&byteSink->getBuf()[0], byteSink->getBuf().size());
+				std::vector<uint8_t> decoded;
+				while (decoded.size() < symbols.size()) {
+					uint8_t syms[HuffmanDecoder::HUFF_MULTI_MAX_SYMBOLS];
+					int num = huffDecoder.decodeMulti(bitSource, syms);
+					REQUIRE(num > 0);
+					decoded.insert(decoded.end(), syms, syms + num);
+				}
+				decoded.resize(symbols.size()); // Padding bits may decode as extra symbols
+				REQUIRE(decoded == symbols);
+			}
+		}
+	}
+
+	SECTION( "Multi symbol huffman decoding stops after unchainable symbols" ) {
+		qs::HuffmanTable huffTable = { {0, 1, 0, 3}, {0, 1, 2, 3} };
+		BitSink bitSink(byteSink);
+		HuffmanCoder huffCoder(huffTable);
+		std::vector<uint8_t> symbols = {0, 0, 0, 1, 0, 2, 3, 0, 0};
+		for (auto symbol : symbols)
+			huffCoder.code(bitSink, symbol);
+		for (int n = 0; n < 64; ++n) // Keep the above out of the (slower) tail of the bitstream
+			huffCoder.code(bitSink, 0);
+		bitSink.close();
+
+		bool chainable[HUFF_MAX_NUMBER_SYMBOLS] = {false};
+		chainable[0] = true;
+		qs::HuffmanDecoder huffDecoder(huffTable);
+		huffDecoder.generateMultiSymbolLut(12, chainable);
+		qs::BitSource bitSource(&byteSink->getBuf()[0], byteSink->getBuf().size());
+		uint8_t syms[HuffmanDecoder::HUFF_MULTI_MAX_SYMBOLS];
+		REQUIRE(huffDecoder.decodeMulti(bitSource, syms) == 3); // 0 0 0
+		REQUIRE(huffDecoder.decodeMulti(bitSource, syms) == 1); // 1
+		REQUIRE(syms[0] == 1);
+		REQUIRE(huffDecoder.decodeMulti(bitSource, syms) == 2); // 0 2
+		REQUIRE(syms[1] == 2);
+		REQUIRE(huffDecoder.decodeMulti(bitSource, syms) == 1); // 3
+		REQUIRE(syms[0] == 3);
+	}
+
 	SECTION( "Kraft inequality" ) {
 		{
 			qs::HuffmanTable huffTable = { {0, 1, 0, 3}, {0, 1, 2, 3} };
@@ -73,6 +141,164 @@ TEST_CASE( "Huffman coding", "[huffman]" ) {
 		}
 	}
 
+	SECTION( "Optimal length limited Huffman tables" ) {
+		// Total code length of coding counts with table
+		auto cost = [](const vector<int>& counts, const HuffmanTable& table) {
+			HuffmanCoder huffCoder(table);
+			uint64_t bits = 0;
+			for (unsigned s = 0; s < counts.size(); ++s) {
+				if (counts[s])
+					REQUIRE(huffCoder.getCodeLength(s) > 0);
+				bits += (uint64_t)counts[s] * huffCoder.getCodeLength(s);
+			}
+			return bits;
+		};
+		// Unlimited Huffman code cost (including a weight 0 reserved symbol): the sum of the
+		// weights of the merged nodes
+		auto huffmanCost = [](const vector<int>& counts) {
+			std::priority_queue<uint64_t, vector<uint64_t>, std::greater<uint64_t> > heap;
+			heap.push(0);
+			for (auto c : counts)
+				if (c)
+					heap.push(c);
+			uint64_t bits = 0;
+			while (heap.size() > 1) {
+				uint64_t a = heap.top(); heap.pop();
+				uint64_t b = heap.top(); heap.pop();
+				bits += a + b;
+				heap.push(a + b);
+			}
+			return bits;
+		};
+
+		{
+			vector<int> counts = {5, 0, 1, 1, 2, 4};
+			HuffmanTable table = makeOptimalHuffmanTable(counts);
+			REQUIRE(cost(counts, table) == huffmanCost(counts));
+			// Kraft sum plus the (unused) all ones code of the longest length is exactly 1
+			int maxLen = HUFF_MAX_CODE_LENGTH;
+			while (table.numCodes[maxLen] == 0)
+				maxLen--;
+			REQUIRE(kraftSum(table.numCodes, maxLen) == (1u << maxLen) - 1);
+		}
+		{
+			vector<int> counts = {0, 7};
+			HuffmanTable table = makeOptimalHuffmanTable(counts);
+			REQUIRE(table.numCodes[1] == 1);
+			REQUIRE(table.symbol[0] == 1);
+		}
+		uint32_t lcg = 3;
+		for (int trial = 0; trial < 20; ++trial) {
+			vector<int> counts(33);
+			for (auto& c : counts) {
+				lcg = lcg * 1664525 + 1013904223;
+				c = (lcg >> 8) % 4 == 0 ? 0 : (lcg >> 12) % 10000;
+			}
+			HuffmanTable table = makeOptimalHuffmanTable(counts);
+			REQUIRE(cost(counts, table) == huffmanCost(counts));
+		}
+		{
+			// Fibonacci counts need codes much longer than 16 bits without a limit
+			vector<int> counts = {1, 1};
+			while (counts.size() < 30)
+				counts.push_back(counts[counts.size() - 1] + counts[counts.size() - 2]);
+			for (int maxCodeLength = 5; maxCodeLength <= HUFF_MAX_CODE_LENGTH; ++maxCodeLength) {
+				HuffmanTable table = makeOptimalHuffmanTable(counts, maxCodeLength);
+				for (int len = maxCodeLength + 1; len <= HUFF_MAX_CODE_LENGTH; ++len)
+					REQUIRE(table.numCodes[len] == 0);
+				uint64_t bits = cost(counts, table);
+				REQUIRE(bits > huffmanCost(counts));
+				if (maxCodeLength > 5) {
+					HuffmanTable shorter = makeOptimalHuffmanTable(counts, maxCodeLength - 1);
+					REQUIRE(bits <= cost(counts, shorter));
+				}
+			}
+			REQUIRE_THROWS(makeOptimalHuffmanTable(counts, 4)); // 31 symbols need 5 bits
+		}
+		REQUIRE_THROWS(makeOptimalHuffmanTable(vector<int>(10, 0)));
+	}
+
+	SECTION( "Write and read Huffman tables" ) {
+		vector<HuffmanTable> tables = {getDefaultHuffmanTable(),
+				makeOptimalHuffmanTable({3, 0, 9, 1, 1, 27})};
+		BitSink bitSink(byteSink);
+		bitSink.receive(1, 3); // Tables needn't be byte aligned
+		for (const auto& table : tables)
+			writeHuffmanTable(bitSink, table);
+		bitSink.close();
+		BitSource bitSource(&byteSink->getBuf()[0], byteSink->getBuf().size());
+		REQUIRE(bitSource.pop(3) == 1);
+		for (const auto& table : tables)
+			REQUIRE(readHuffmanTable(bitSource) == table);
+		REQUIRE_THROWS(readHuffmanTable(bitSource));
+	}
+
+	SECTION( "Compact Huffman tables and built-in tables" ) {
+		vector<HuffmanTable> tables = {getDefaultHuffmanTable(), makeOptimalHuffmanTable({0, 5}),
+				makeOptimalHuffmanTable({3, 0, 9, 1, 1, 27})};
+		for (int id = 0; id < NUM_BUILTIN_HUFFMAN_TABLES; ++id) {
+			tables.push_back(getBuiltinHuffmanTable(id));
+			HuffmanCoder huffCoder(tables.back()); // Valid table
+			for (int size = 0; size < 32; ++size)
+				REQUIRE(huffCoder.getCodeLength(size) > 0);
+		}
+		REQUIRE_THROWS(getBuiltinHuffmanTable(NUM_BUILTIN_HUFFMAN_TABLES));
+
+		BitSink bitSink(byteSink);
+		int numBits = 0;
+		for (const auto& table : tables) {
+			writeCompactHuffmanTable(bitSink, table);
+			numBits += compactHuffmanTableBits(table);
+		}
+		bitSink.close();
+		REQUIRE((int)byteSink->getBuf().size() == numBits/8 + 1);
+		BitSource bitSource(&byteSink->getBuf()[0], byteSink->getBuf().size());
+		for (const auto& table : tables)
+			REQUIRE(readCompactHuffmanTable(bitSource) == table);
+
+		// Much smaller than the JPEG (DHT) representation for residual size tables
+		REQUIRE(compactHuffmanTableBits(tables[2]) == 4 + (1 + 2 + 3 + 4 + 5) + 4 + 5*3);
+	}
+
+	SECTION( "Compile time LUTs of the built-in tables" ) {
+		static_assert(makeHuffmanCoderLuts(BuiltinHuffmanTables::TABLES[0]).codeLengthLut[1] == 2,
+				"coder LUTs are made at compile time");
+		static_assert(makeHuffmanDecoderLuts(BuiltinHuffmanTables::TABLES[0]).numBitsLut[0] == 2,
+				"decoder LUTs are made at compile time");
+
+		// The literal tables are the optimal tables of their peaked counts
+		const int peakSizes[NUM_BUILTIN_HUFFMAN_TABLES] = {0, 1, 2, 4, 6, 9, 13};
+		for (int id = 1; id < NUM_BUILTIN_HUFFMAN_TABLES; ++id) {
+			vector<int> counts(32);
+			for (int size = 0; size < 32; ++size) {
+				int shift = size < peakSizes[id] ? 2*(peakSizes[id] - size) : size - peakSizes[id];
+				counts[size] = 1 + ((1 << 20) >> std::min(shift, 20));
+			}
+			REQUIRE(getBuiltinHuffmanTable(id) == makeOptimalHuffmanTable(counts));
+		}
+
+		for (int id = 0; id < NUM_BUILTIN_HUFFMAN_TABLES; ++id) {
+			const HuffmanTable table = getBuiltinHuffmanTable(id);
+			REQUIRE(findBuiltinHuffmanTable(table) == id);
+			HuffmanCoder huffCoder(table);
+			HuffmanCoderLuts luts = makeHuffmanCoderLuts(table);
+			for (int symbol = 0; symbol < HUFF_MAX_NUMBER_SYMBOLS; ++symbol) {
+				REQUIRE(huffCoder.getCode(symbol) == luts.codeLut[symbol]);
+				REQUIRE(huffCoder.getCodeLength(symbol) == luts.codeLengthLut[symbol]);
+			}
+			shared_ptr<ByteBufferSink> sink(new ByteBufferSink());
+			BitSink bitSink(sink);
+			for (int size = 0; size < 32; ++size)
+				huffCoder.code(bitSink, size);
+			bitSink.close();
+			BitSource bitSource(&sink->getBuf()[0], sink->getBuf().size());
+			HuffmanDecoder huffDecoder(table);
+			for (int size = 0; size < 32; ++size)
+				REQUIRE(huffDecoder.decode(bitSource) == size);
+		}
+		REQUIRE(findBuiltinHuffmanTable(makeOptimalHuffmanTable({3, 0, 9, 1, 1, 27})) == -1);
+	}
+
 	SECTION( "magnitude bits" ) {
 		{
 			qs::Model model = getMagBitsModel(0);
@@ -0,0 +1,223 @@
+/*
+ * test_Quantity.cpp
+ *
+ *  Created on: 18/10/2026
+ *      Author: jim
+ */
+#include "catch.hpp"
+
+#include "Coders.h"
+#include "HuffmanTable.h"
+#include "qs_Quantity.h"
+
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+using std::vector;
+
+namespace qs {
+
+TEST_CASE( "QuantitiesSequence tests", "[quantity]" ) {
+
+	// A smooth quantity with steps of 1/64 and a (mostly constant) one with steps of 1
+	vector<QuantityInfo> qInfos = {QuantityInfo("latitude", "", QStep(0, -6)),
+			QuantityInfo("ignition", "", QStep(0, 0))};
+	vector<vector<double> > rows;
+	double val = -41.0;
+	double slope = 0.0;
+	uint32_t lcg = 11;
+	for (int n = 0; n < 3000; ++n) {
+		lcg = lcg * 1664525 + 1013904223;
+		slope += ((int)(lcg >> 24) - 128) / 4096.0;
+		val += slope;
+		rows.push_back({val, (double)((n / 700) % 2)});
+	}
+	vector<vector<double> > quantized = rows;
+	for (auto& row : quantized) {
+		row[0] = lround(row[0] * 64) / 64.0;
+		row[1] = lround(row[1]);
+	}
+
+	SECTION( "Encode and decode with the default, optimized and adaptive tables" ) {
+		vector<size_t> codeSizes;
+		for (auto mode : {QuantitiesSequence::DEFAULT_TABLE, QuantitiesSequence::OPTIMIZE,
+				QuantitiesSequence::ADAPTIVE}) {
+			QuantitiesSequence qs(qInfos, mode);
+			for (const auto& row : rows)
+				qs.push(row);
+			vector<uint8_t> code = qs.getCode();
+			REQUIRE(qs.getCode() == code);
+			REQUIRE_THROWS(qs.push(rows[0]));
+			codeSizes.push_back(code.size());
+
+			QuantitiesSequenceDecoder decoder(qInfos, &code[0], code.size());
+			REQUIRE(decoder.getNumVals() == rows.size());
+			REQUIRE(decoder.decode() == quantized);
+
+			// Truncated in the last quantity's bitstream
+			REQUIRE_THROWS(QuantitiesSequenceDecoder(qInfos, &code[0], code.size() - 1));
+			// More values than the bitstreams could hold
+			vector<uint8_t> inflated = code;
+			inflated[0] = 0xFF;
+			REQUIRE_THROWS(QuantitiesSequenceDecoder(qInfos, &inflated[0], inflated.size()));
+		}
+		// Values without any quantities
+		vector<uint8_t> noQuantities = {0xFF, 0xFF, 0xFF, 0xFF};
+		REQUIRE_THROWS(QuantitiesSequenceDecoder(vector<QuantityInfo>(), &noQuantities[0], 4));
+		noQuantities.assign(4, 0);
+		REQUIRE(QuantitiesSequenceDecoder(vector<QuantityInfo>(), &noQuantities[0], 4).getNumVals() == 0);
+		// The optimized tables (header included) cost less than the default table
+		REQUIRE(codeSizes[1] < codeSizes[0]);
+	}
+
+	SECTION( "Per quantity tables" ) {
+		// The table ID is the first byte of each quantity's bitstream
+		auto getTableIds = [&qInfos](const vector<uint8_t>& code) {
+			vector<int> ids;
+			size_t offset = 4;
+			for (unsigned n = 0; n < qInfos.size(); ++n) {
+				size_t numBytes = ((size_t)code[offset] << 24) | (code[offset + 1] << 16) |
+						(code[offset + 2] << 8) | code[offset + 3];
+				ids.push_back(code[offset + 4]);
+				offset += 4 + numBytes;
+			}
+			return ids;
+		};
+		{
+			QuantitiesSequence qs(qInfos, QuantitiesSequence::OPTIMIZE);
+			for (const auto& row : rows)
+				qs.push(row);
+			vector<uint8_t> code = qs.getCode();
+			vector<int> ids = getTableIds(code);
+			REQUIRE(ids[0] == QuantitiesSequence::EXPLICIT_TABLE);
+			REQUIRE(ids[1] == QuantitiesSequence::EXPLICIT_TABLE);
+		}
+		{
+			// A speed like quantity, stopped (constant) for stretches, so the previous sizes
+			// predict the next well
+			vector<QuantityInfo> speedInfos = {QuantityInfo("speed", "", QStep(0, -4))};
+			vector<vector<double> > speeds;
+			double speed = 0;
+			uint32_t lcg = 3;
+			for (int n = 0; n < 6000; ++n) {
+				lcg = lcg * 1664525 + 1013904223;
+				if ((n / 300) % 2)
+					speed += ((int)(lcg >> 24) - 128) / 256.0;
+				speeds.push_back({lround(speed * 16) / 16.0});
+			}
+			QuantitiesSequence qs(speedInfos, QuantitiesSequence::OPTIMIZE);
+			for (const auto& row : speeds)
+				qs.push(row);
+			vector<uint8_t> code = qs.getCode();
+			REQUIRE(code[8] == QuantitiesSequence::CONTEXT_TABLES);
+			QuantitiesSequenceDecoder decoder(speedInfos, &code[0], code.size());
+			REQUIRE(decoder.decode() == speeds);
+		}
+		{
+			// Too short to pay for a table
+			QuantitiesSequence qs(qInfos, QuantitiesSequence::OPTIMIZE);
+			for (int n = 0; n < 2; ++n)
+				qs.push(rows[n]);
+			vector<uint8_t> code = qs.getCode();
+			vector<int> ids = getTableIds(code);
+			REQUIRE(ids[0] < NUM_BUILTIN_HUFFMAN_TABLES);
+			REQUIRE(ids[1] < NUM_BUILTIN_HUFFMAN_TABLES);
+			QuantitiesSequenceDecoder decoder(qInfos, &code[0], code.size());
+			vector<vector<double> > shouldBe(quantized.begin(), quantized.begin() + 2);
+			REQUIRE(decoder.decode() == shouldBe);
+		}
+	}
+
+	SECTION( "Standard quantity tables" ) {
+		REQUIRE(getStdQuantityIdx("wheel_based_speed") == 5);
+		REQUIRE(getStdQuantityIdx("ignition") == 6);
+		REQUIRE(getStdQuantityIdx("unknown") == STD_QUANTITY_NOT_PRESENT);
+		REQUIRE(getStdQuantityHuffmanTable(STD_QUANTITY_NOT_PRESENT) == NULL);
+		// The tables aren't trained yet, so 0xFC is not a table ID
+		vector<QuantityInfo> gpsInfos = {QuantityInfo("gps_speed", "", QStep())};
+		vector<uint8_t> code = {0, 0, 0, 0, 0, 0, 0, 1, 0xFC};
+		QuantitiesSequenceDecoder decoder(gpsInfos, &code[0], code.size());
+		REQUIRE_THROWS(decoder.decode());
+	}
+
+	SECTION( "Per block predictor selection" ) {
+		// Noise (order 0 codes it best), a smooth altitude like quantity (order 3), and rows
+		vector<QuantityInfo> selInfos = {QuantityInfo("acceleration", "", QStep(0, -6)),
+				QuantityInfo("altitude", "", QStep(0, -6)), qInfos[0], qInfos[1]};
+		vector<vector<double> > selRows;
+		double accel = 0.0, vel = 0.0, alt = 0.0;
+		for (int n = 0; n < 3000; ++n) {
+			lcg = lcg * 1664525 + 1013904223;
+			accel += ((int)(lcg >> 24) - 128) / 4096.0;
+			vel += accel;
+			alt += vel;
+			selRows.push_back({((int)(lcg >> 12 & 0x3FF) - 512) / 64.0, alt, rows[n][0], rows[n][1]});
+		}
+		vector<vector<double> > selQuantized = selRows;
+		for (auto& row : selQuantized) {
+			for (int m = 0; m < 3; ++m)
+				row[m] = lround(row[m] * 64) / 64.0;
+			row[3] = lround(row[3]);
+		}
+
+		SelectablePredictor predictor;
+		vector<double> noise, smooth;
+		for (int n = 0; n < QuantitiesSequence::BLOCK_SIZE; ++n) {
+			noise.push_back(selRows[n][0]);
+			smooth.push_back(selRows[n][1]);
+		}
+		REQUIRE(predictor.selectOrder(&noise[0], noise.size(), 64) == 0);
+		REQUIRE(predictor.selectOrder(&smooth[0], smooth.size(), 64) == 3);
+		REQUIRE_THROWS(predictor.setOrder(4));
+
+		for (auto mode : {QuantitiesSequence::DEFAULT_TABLE, QuantitiesSequence::OPTIMIZE,
+				QuantitiesSequence::ADAPTIVE}) {
+			vector<size_t> codeSizes;
+			for (bool selectPredictors : {false, true}) {
+				QuantitiesSequence qs(selInfos, mode, selectPredictors);
+				for (const auto& row : selRows)
+					qs.push(row);
+				vector<uint8_t> code = qs.getCode();
+				codeSizes.push_back(code.size());
+				REQUIRE((code[8] == QuantitiesSequence::SELECTED_PREDICTORS) == selectPredictors);
+				QuantitiesSequenceDecoder decoder(selInfos, &code[0], code.size());
+				REQUIRE(decoder.decode() == selQuantized);
+				REQUIRE_THROWS(QuantitiesSequenceDecoder(selInfos, &code[0], code.size() - 1));
+			}
+			REQUIRE(codeSizes[1] < codeSizes[0]);
+		}
+
+		// Short sequences, and a part block after whole ones
+		for (int numVals : {0, 1, 2, 3, QuantitiesSequence::BLOCK_SIZE + 2}) {
+			for (auto mode : {QuantitiesSequence::DEFAULT_TABLE, QuantitiesSequence::OPTIMIZE,
+					QuantitiesSequence::ADAPTIVE}) {
+				QuantitiesSequence qs(selInfos, mode, true);
+				for (int n = 0; n < numVals; ++n)
+					qs.push(selRows[n]);
+				vector<uint8_t> code = qs.getCode();
+				QuantitiesSequenceDecoder decoder(selInfos, &code[0], code.size());
+				vector<vector<double> > shouldBe(selQuantized.begin(), selQuantized.begin() + numVals);
+				REQUIRE(decoder.decode() == shouldBe);
+			}
+		}
+	}
+
+	SECTION( "Empty and short sequences" ) {
+		for (int numVals = 0; numVals <= 2; ++numVals) {
+			for (auto mode : {QuantitiesSequence::DEFAULT_TABLE, QuantitiesSequence::OPTIMIZE,
+					QuantitiesSequence::ADAPTIVE}) {
+				QuantitiesSequence qs(qInfos, mode);
+				for (int n = 0; n < numVals; ++n)
+					qs.push(rows[n]);
+				vector<uint8_t> code = qs.getCode();
+				QuantitiesSequenceDecoder decoder(qInfos, &code[0], code.size());
+				vector<vector<double> > shouldBe(quantized.begin(), quantized.begin() + numVals);
+				REQUIRE(decoder.decode() == shouldBe);
+			}
+		}
+	}
+}
+
+} // namespace qs
@@ -8,12 +8,77 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdint.h>
+#include <string.h>
+
 #include <iomanip>
 #include <iosfwd>
 #include <sstream>
 
 namespace qs {
 
+/*
+ * Unaligned big endian (bitstream order) 64 bit stores and loads. memcpy compiles down to a
+ * single (unaligned) move on the targets we care about.
+ */
+inline uint64_t byteSwap64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap64(x);
+#else
+    x = ((x & 0x00FF00FF00FF00FFull) << 8)  | ((x >> 8)  & 0x00FF00FF00FF00FFull);
+    x = ((x & 0x0000FFFF0000FFFFull) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFull);
+    return (x << 32) | (x >> 32);
+#endif
+}
+
+inline void storeBigEndian64(uint8_t* p, uint64_t x)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(p, &x, sizeof(x));
+#else
+    x = byteSwap64(x);
+    memcpy(p, &x, sizeof(x));
+#endif
+}
+
+inline uint64_t loadBigEndian64(const uint8_t* p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return x;
+#else
+    return byteSwap64(x);
+#endif
+}
+
+// Number of bits needed to represent val (0 for 0)
+inline int bitLength(uint32_t val)
+{
+#if defined(__GNUC__)
+    return val ? 32 - __builtin_clz(val) : 0;
+#else
+    int nbits = 0;
+    while (val) {
+      nbits++;
+      val >>= 1;
+    }
+    return nbits;
+#endif
+}
+
+/*
+ * lround(x) (halves rounded away from zero) for x in the range of int64_t, inline so quantizing
+ * loops don't call into libm. x - (double)(int64_t)x is exact, so the result is too.
+ */
+inline long lroundFast(double x)
+{
+    int64_t i = (int64_t)x;
+    double frac = x - (double)i;
+    return i + (frac >= 0.5) - (frac <= -0.5);
+}
+
 // http://stackoverflow.com/questions/673240/how-do-i-print-an-unsigned-char-as-hex-in-c-using-ostream
 struct HexCharStruct
 {